@@ -116,7 +116,9 @@
 
 using namespace std;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 
 struct rfidData *rfidData;
 
@@ -140,7 +142,7 @@ const char *xml_filename;
 
 int parse_state = PARSE_STATE_NONE;
 int verbose = 0;
-char msgbuf[2048];
+static char msgbuf[2048];
 
 char tagBuffer[TAG_BUF_LEN];
 
@@ -150,7 +152,9 @@ const char *parse_states[] =
 };
 int parseTagNum = -1;
 
+#ifndef SIM_RUNTIME
 int debug = 0;
+#endif
 
 struct stat configStat;
 #define LOOP_SLEEP_MS	10
@@ -243,6 +247,7 @@ int main(int argc, char *argv[])
 	int detect;
 	struct stat statCheck;
 	int lcount;
+	struct loopTimer loopTimer;
 	int ttyfd = -1;
 	
 	if ( argc > 1 )
@@ -368,7 +373,7 @@ int main(int argc, char *argv[])
 	
 	state = 0;
 	rfidData->tagDetected = 0;
-	shmData->auscultation.side = 0;
+	shmSensorUpdate(SHM_AUSCULTATION, &shmData->auscultation.side, 0 );
 	lcount = 0;
 
 #ifdef USE_BBBGPIO
@@ -385,6 +390,7 @@ int main(int argc, char *argv[])
 		printf("%s\n", msgbuf );
 	}
 	
+	loopTimerStart(&loopTimer, LOOP_RFID, LOOP_SLEEP_US );
 	while ( 1 )
 	{
 		if ( lcount++ >= LOOPS_PER_10SEC )
@@ -424,7 +430,7 @@ int main(int argc, char *argv[])
 				}
 				else
 				{
-					shmData->auscultation.side = 0;
+					shmSensorUpdate(SHM_AUSCULTATION, &shmData->auscultation.side, 0 );
 				}
 				break;
 
@@ -444,7 +450,7 @@ int main(int argc, char *argv[])
 						}
 						rfidData->tagDetected = 0;						
 					}
-					shmData->auscultation.side = 0;
+					shmSensorUpdate(SHM_AUSCULTATION, &shmData->auscultation.side, 0 );
 					if ( verbose )
 					{
 						sprintf(msgbuf, "Detect  0 State 2 to 0 Count %d", count );
@@ -601,7 +607,7 @@ int main(int argc, char *argv[])
 						}
 						rfidData->tagDetected = 0;						
 					}
-					shmData->auscultation.side = 0;
+					shmSensorUpdate(SHM_AUSCULTATION, &shmData->auscultation.side, 0 );
 					if ( verbose )
 					{
 						sprintf(msgbuf, "Detect 0 State 3 to 0" );
@@ -616,7 +622,7 @@ int main(int argc, char *argv[])
 					sts = read(ttyfd, &tagBuffer[0], TAG_BUF_LEN );
 				}
 		}
-		usleep(LOOP_SLEEP_US); // 10 ms delay between checks.
+		loopTimerWait(&loopTimer ); // 10 ms between checks
 	}
 
 	return 0;
@@ -626,6 +632,7 @@ int
 tagCheck(uint64_t newid)
 {
 	unsigned int tagIndex;
+	unsigned int dirty;
 	
 	for ( tagIndex = 0 ; tagIndex < rfidData->tagCount ; tagIndex++ )
 	{
@@ -640,22 +647,34 @@ tagCheck(uint64_t newid)
 			//shmData->respiration.right_lung_sound_volume = rfidData->tags[tagIndex].rightLungStrength;
 			//shmData->respiration.right_lung_sound_mute   = 0;
 			
-			shmData->auscultation.col  = rfidData->tags[tagIndex].xPosition;
-			shmData->auscultation.row  = rfidData->tags[tagIndex].yPosition;
-			shmData->auscultation.side = rfidData->tags[tagIndex].side;
-			shmData->auscultation.heartStrength = rfidData->tags[tagIndex].heartStrength;
-			shmData->auscultation.leftLungStrength = rfidData->tags[tagIndex].leftLungStrength;
-			shmData->auscultation.rightLungStrength = rfidData->tags[tagIndex].rightLungStrength;
+			shmWriteBegin(SHM_AUSCULTATION );
+			dirty  = shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.col, rfidData->tags[tagIndex].xPosition );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.row, rfidData->tags[tagIndex].yPosition );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.side, rfidData->tags[tagIndex].side );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.heartStrength, rfidData->tags[tagIndex].heartStrength );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.leftLungStrength, rfidData->tags[tagIndex].leftLungStrength );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.rightLungStrength, rfidData->tags[tagIndex].rightLungStrength );
+			shmWriteEnd(SHM_AUSCULTATION, dirty );
+			if ( dirty )
+			{
+				shmSensorNotify();
+			}
 			return ( tagIndex );
 		}
 	}
 	// Tag not found
-	shmData->auscultation.side = 3;
-	shmData->auscultation.col  = 9;
-	shmData->auscultation.row  = 9;
-	shmData->auscultation.heartStrength = 0;
-	shmData->auscultation.leftLungStrength = 0;
-	shmData->auscultation.rightLungStrength = 0;
+	shmWriteBegin(SHM_AUSCULTATION );
+	dirty  = shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.side, 3 );
+	dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.col, 9 );
+	dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.row, 9 );
+	dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.heartStrength, 0 );
+	dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.leftLungStrength, 0 );
+	dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.rightLungStrength, 0 );
+	shmWriteEnd(SHM_AUSCULTATION, dirty );
+	if ( dirty )
+	{
+		shmSensorNotify();
+	}
 	return ( -1 );
 }
 
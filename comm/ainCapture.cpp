@@ -0,0 +1,221 @@
+/*
+ * ainCapture.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Analog input capture daemon. Reads whole scans from the IIO buffer and
+ * publishes them in shmData->ainRing, where breathSense and pulse read them with
+ * the ainStream API, and ainRead and read_ain take single values. When this daemon
+ * is not running, those fall back to the sysfs files.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+
+#include "shmData.h"
+#include "simUtil.h"
+#include "simAin.h"
+
+struct shmData *shmData;
+
+char msgbuf[2048];
+
+int debug = 0;
+int isDaemon = 0;
+
+static volatile sig_atomic_t stopping = 0;
+
+// Default scan: every channel, as the driver refuses sysfs reads of any channel
+// while the buffer is on. Channels the driver does not have are left out.
+#define AIN_CAPTURE_MASK	( ( 1u << AIN_CHANNELS_MAX ) - 1 )
+
+static void
+ainCaptureStop(int sig )
+{
+	(void)sig;
+	stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ainDevice dev;
+	struct ainFrame frames[AIN_RING_BATCH];
+	struct ainRing *ring;
+	const char *fakeFile = NULL;
+	unsigned int chanMask = AIN_CAPTURE_MASK;
+	int fakeRate = AIN_FAKE_RATE;
+	long long rateStart;
+	long long lastTs = 0;
+	long long now;
+	int rateFrames = 0;
+	int count;
+	int sts;
+	int c;
+	int i;
+
+	opterr = 0;
+
+	while (( c = getopt(argc, argv, "hDf:r:m:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'D':
+				debug++;
+				break;
+
+			case 'f':
+				fakeFile = optarg;
+				break;
+
+			case 'r':
+				fakeRate = atoi(optarg );
+				break;
+
+			case 'm':
+				chanMask = strtoul(optarg, NULL, 0 ) & ( ( 1u << AIN_CHANNELS_MAX ) - 1 );
+				break;
+
+			case 'h':
+				printf("Usage: %s [-D] [-m chanmask] [-f file [-r rate]]\n", argv[0] );
+				printf("\t-D : Enable debug\n" );
+				printf("\t-m : Channels to capture, as a bit mask (default 0x%x)\n", AIN_CAPTURE_MASK );
+				printf("\t-f : Replay raw frames from a file instead of the ADC\n" );
+				printf("\t-r : Frames per second from the file (default %d)\n", AIN_FAKE_RATE );
+				exit ( 0 );
+				break;
+
+			case '?':
+				if ( optopt == 'f' || optopt == 'r' || optopt == 'm' )
+				  fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint (optopt))
+				  fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+				else
+				  fprintf (stderr,
+						   "Unknown option character `\\x%x'.\n",
+						   optopt);
+				return 1;
+
+			 default:
+				fprintf (stderr, "Unhandled option `-%c'.\n", c);
+				abort ();
+		}
+	}
+
+	if ( ! debug )
+	{
+		daemonize();
+		isDaemon = 1;
+	}
+	// Replaces the daemonize handler, so the ring is marked idle before exit
+	signal(SIGTERM, ainCaptureStop );
+	signal(SIGINT, ainCaptureStop );
+
+	sts = initSHM(SHM_OPEN );
+	if ( sts )
+	{
+		perror("initSHM");
+		return ( -1 );
+	}
+	ring = &shmData->ainRing;
+
+	if ( fakeFile )
+	{
+		sts = ainDeviceOpenFake(&dev, fakeFile, chanMask, fakeRate );
+	}
+	else
+	{
+		sts = ainDeviceOpen(&dev, AIN_IIO_SYS_DIR, AIN_IIO_DEV, chanMask, AIN_IIO_BUF_LEN );
+	}
+	if ( sts < 0 )
+	{
+		log_message("", "ainCapture: Can not open the AIN device - Exiting" );
+		return ( -2 );
+	}
+	chanMask = 0;
+	for ( i = 0 ; i < dev.chanCount ; i++ )
+	{
+		chanMask |= 1u << dev.chan[i];
+	}
+	sprintf(msgbuf, "ainCapture: channels 0x%x, %d byte frames, %s timestamps",
+			chanMask, dev.frameSize, dev.tsOffset >= 0 ? "device" : "synthesized" );
+	log_message("", msgbuf );
+
+	ring->chanMask = chanMask;
+	ring->overruns = 0;
+	ring->rate = 0;
+	rateStart = ainNow();
+	
+	// sysfs reads fail from here on, so single reads are sent to the ring now
+	__atomic_store_n(&ring->started, rateStart, __ATOMIC_RELAXED );
+	__atomic_store_n(&ring->active, 1, __ATOMIC_RELEASE );
+
+	while ( ! stopping )
+	{
+		count = ainDeviceRead(&dev, frames, AIN_RING_BATCH, 100 );
+		if ( count < 0 )
+		{
+			sprintf(msgbuf, "ainCapture: read failed: %s", strerror(errno ) );
+			log_message("", msgbuf );
+			break;
+		}
+		if ( count == 0 )
+		{
+			continue;
+		}
+		// A gap of more than two frame periods means the kernel buffer overflowed
+		if ( lastTs && ring->rate > 0 &&
+			 ( frames[0].ts - lastTs ) > ( 2000000000LL / ring->rate ) )
+		{
+			ring->overruns++;
+		}
+		lastTs = frames[count-1].ts;
+
+		ainRingPush(frames, count );
+
+		rateFrames += count;
+		now = ainNow();
+		if ( now - rateStart >= 1000000000LL )
+		{
+			ring->rate = ( (long long)rateFrames * 1000000000LL ) / ( now - rateStart );
+			rateFrames = 0;
+			rateStart = now;
+			if ( debug )
+			{
+				printf("rate %d overruns %llu", ring->rate, ring->overruns );
+				for ( i = 0 ; i < AIN_CHANNELS_MAX ; i++ )
+				{
+					if ( chanMask & ( 1u << i ) )
+					{
+						printf(" AIN%d %d", i, frames[count-1].value[i] );
+					}
+				}
+				printf("\n" );
+			}
+		}
+	}
+	__atomic_store_n(&ring->active, 0, __ATOMIC_RELEASE );
+	ainDeviceClose(&dev );
+	log_message("", "ainCapture: stopped" );
+	return ( 0 );
+}
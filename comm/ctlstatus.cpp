@@ -22,6 +22,7 @@
 	
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <vector>  
 #include <string>  
@@ -32,6 +33,7 @@
 
 #include "simUtil.h"
 #include "shmData.h"
+#include "simFields.h"
 #include "version.h"
 
 using namespace std;
@@ -43,6 +45,14 @@ void makejson(ostream & output, string key, string content)
 
 struct shmData *shmData;
 void sendStatus(void );
+void sendFields(const struct simFieldTable *table, const void *base );
+void sendHistory(int max );
+void sendLoops(void );
+void sendClock(void );
+
+// "?history=N" adds the last N samples of each AIN channel that has any
+#define HISTORY_MAX		AIN_HISTORY_LEN
+int historyMax = 0;
 
 int debug = 0;
 
@@ -50,6 +60,7 @@ int
 main( int argc, const char* argv[] )
 {
     char buffer[256];
+	const char *query;
 	int sts;
 
 	cout << "Content-Type: application/json\r\n\r\n";
@@ -66,6 +77,15 @@ main( int argc, const char* argv[] )
 	}
 
 
+	query = getenv("QUERY_STRING" );
+	if ( query && strncmp(query, "history=", 8 ) == 0 )
+	{
+		historyMax = atoi(&query[8] );
+		if ( historyMax > HISTORY_MAX )
+		{
+			historyMax = HISTORY_MAX;
+		}
+	}
 	sendStatus();
 	
 	return ( 0 );
@@ -122,6 +142,12 @@ sendStatus(void )
 	makejson(cout, "count", itoa(shmData->manual_breath_count) );
 	cout << ",\n";
 	makejson(cout, "fallState", itoa(shmData->respiration.fallState ) );
+	cout << ",\n";
+	makejson(cout, "breath_count", itoa(shmData->respiration.breath_count ) );
+	cout << ",\n";
+	makejson(cout, "breath_duration", itoa(shmData->respiration.breath_duration ) );
+	cout << ",\n";
+	makejson(cout, "breath_volume", itoa(shmData->respiration.breath_volume ) );
 	cout << "\n},\n";
 	
 	cout << " \"cpr\" : {\n";
@@ -140,16 +166,151 @@ sendStatus(void )
 	makejson(cout, "maxDistance", itoa(shmData->cpr.maxDistance ) );
 	cout << "\n},\n";
 	
+	sendFields(&cardiacTable, &shmData->cardiac );
+	sendFields(&eyesTable, &shmData->eyes );
+	
+	sendLoops();
+	
+	if ( historyMax > 0 )
+	{
+		sendHistory(historyMax );
+	}
+	
 	cout << " \"general\" : {\n";
 	makejson(cout, "simMgrIPAddr", shmData->simMgrIPAddr );
 	cout << ",\n";
 	makejson(cout, "simMgrStatusPort", itoa(shmData->simMgrStatusPort) );
 	cout << ",\n";
+	makejson(cout, "syncFramed", itoa(shmData->syncStats.framed) );
+	cout << ",\n";
+	makejson(cout, "syncEvents", itoa(shmData->syncStats.events) );
+	cout << ",\n";
+	makejson(cout, "syncLost", itoa(shmData->syncStats.lost) );
+	cout << ",\n";
+	makejson(cout, "beatIbi", itoa(shmData->syncStats.beatIbi) );
+	cout << ",\n";
+	makejson(cout, "beatPhase", itoa(shmData->syncStats.beatPhase) );
+	cout << ",\n";
+	makejson(cout, "beatPredicted", itoa(shmData->syncStats.beatPredicted) );
+	cout << ",\n";
+	sendClock();
 	makejson(cout, "simCtlVersion", SIMCTL_VERSION );
 	cout << "\n}\n";
 	
 	cout << "\n}\n";
 }
 
+/*
+ * Function: sendFields
+ *
+ * Output a sim-mgr section using its field descriptor table
+ */
+void
+sendFields(const struct simFieldTable *table, const void *base )
+{
+	char buffer[STR_SIZE+16];
+	int i;
+	
+	cout << " \"" << table->section << "\" : {\n";
+	for ( i = 0 ; i < table->count ; i++ )
+	{
+		simFieldFormat(&table->fields[i], base, buffer, sizeof(buffer) );
+		makejson(cout, table->fields[i].name, buffer );
+		if ( i < table->count - 1 )
+		{
+			cout << ",\n";
+		}
+	}
+	cout << "\n},\n";
+}
+
+/*
+ * Function: sendHistory
+ *
+ * Output up to max recent samples of each AIN channel, as [msec, value] pairs
+ * with the time on CLOCK_MONOTONIC
+ */
+void
+sendHistory(int max )
+{
+	static struct ainSample samples[HISTORY_MAX];
+	int chan;
+	int count;
+	int i;
+	int first = 1;
+	
+	cout << " \"history\" : {\n";
+	for ( chan = 0 ; chan < AIN_CHANNELS_MAX ; chan++ )
+	{
+		count = ainHistoryRecent(chan, samples, max );
+		if ( count == 0 )
+		{
+			continue;
+		}
+		if ( ! first )
+		{
+			cout << ",\n";
+		}
+		first = 0;
+		cout << "\"ain" << chan << "\":[";
+		for ( i = 0 ; i < count ; i++ )
+		{
+			cout << ( i ? "," : "" ) << "[" << samples[i].ts / 1000000 << "," << samples[i].value << "]";
+		}
+		cout << "]";
+	}
+	cout << "\n},\n";
+}
 
+/*
+ * Function: sendClock
+ *
+ * Output the sim-mgr clock offset estimate, as part of the general section
+ */
+void
+sendClock(void )
+{
+	struct clockSync cs;
+	char buffer[128];
+	
+	if ( ! clockSyncGet(&cs ) )
+	{
+		makejson(cout, "clockSync", "none" );
+	}
+	else
+	{
+		snprintf(buffer, sizeof(buffer), "offset %lldus rtt %d/%dus drift %dppb samples %u",
+				 cs.offset, cs.rtt, cs.rttMin, cs.drift, cs.samples );
+		makejson(cout, "clockSync", buffer );
+	}
+	cout << ",\n";
+}
 
+/*
+ * Function: sendLoops
+ *
+ * Output the timing of each daemon's sampling loop
+ */
+void
+sendLoops(void )
+{
+	static const char *loopNames[LOOP_TIMERS] = { "breath", "pulse", "cpr", "eyes", "rfid" };
+	struct loopStats *stats;
+	char buffer[128];
+	int i;
+	
+	cout << " \"loops\" : {\n";
+	for ( i = 0 ; i < LOOP_TIMERS ; i++ )
+	{
+		stats = &shmData->loopStats[i];
+		snprintf(buffer, sizeof(buffer), "period %dus rate %d.%03dHz late %d/%dus overruns %u",
+				 stats->period, stats->rate / 1000, stats->rate % 1000,
+				 stats->lateAvg, stats->lateMax, stats->overruns );
+		makejson(cout, loopNames[i], buffer );
+		if ( i < LOOP_TIMERS - 1 )
+		{
+			cout << ",\n";
+		}
+	}
+	cout << "\n},\n";
+}
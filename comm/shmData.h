@@ -91,6 +91,13 @@ struct respiration
 	
 	int riseState;
 	int fallState;
+	
+	// Manual breaths measured by breathSense
+	int breath_count;			// Breaths since breathSense started
+	int breath_duration;		// Last breath, msec
+	int breath_volume;			// Last breath, area above the baseline in ADC count-sec
+	long long breath_onset;		// CLOCK_MONOTONIC nsec, start of the last breath
+	long long breath_end;		// and its end, 0 while the breath is in progress
 };
 
 struct auscultation
@@ -237,6 +244,114 @@ struct eyes
 	int send_input_response;	// input response overrides
 };
 
+#define AIN_CHANNELS_MAX	8		// AM335x ADC channels AIN0 - AIN7
+
+// One scan of the analog inputs from the IIO capture buffer (see ainCapture)
+struct ainFrame
+{
+	long long ts;								// CLOCK_MONOTONIC, nsec
+	unsigned short value[AIN_CHANNELS_MAX];		// Raw ADC counts, 0 if not in the scan
+};
+
+#define AIN_RING_FRAMES		2048	// Power of two, about 1s at the AM335x continuous rate
+
+// Single producer (ainCapture), any number of readers. The producer fills the
+// slot at head, then advances head. A reader keeps its own tail and checks head
+// again after copying, so a slot overwritten during the copy is detected.
+struct ainRing
+{
+	int active;							// Set while ainCapture is filling the ring
+	unsigned int chanMask;				// Channels in the scan
+	int rate;							// Measured frames per second
+	unsigned int seq;					// Bumped with head, futex word for readers
+	long long lastPush;					// CLOCK_MONOTONIC nsec of the last push
+	long long started;					// CLOCK_MONOTONIC nsec when the buffer was enabled
+	unsigned long long head;			// Frames written since start
+	unsigned long long overruns;		// Device buffer overflows seen by ainCapture
+	struct ainFrame frames[AIN_RING_FRAMES];
+};
+
+#define AIN_HISTORY_LEN		1024	// Power of two, samples kept per channel
+
+struct ainSample
+{
+	long long ts;						// CLOCK_MONOTONIC, nsec
+	int value;
+	int pad;
+};
+
+// Recent samples of one AIN channel, as used by the daemon that owns the channel
+// (breathSense for the breath sensor, pulse for the touch sensors). One producer
+// per channel appends; readers keep their own tail and never block it.
+struct ainHistory
+{
+	unsigned long long head;			// Samples written since start
+	struct ainSample samples[AIN_HISTORY_LEN];
+};
+
+// Sampling loops of the sensor daemons, paced by loopTimerWait (see simUtil.h)
+#define LOOP_BREATH			0
+#define LOOP_PULSE			1
+#define LOOP_CPR			2
+#define LOOP_EYES			3
+#define LOOP_RFID			4
+#define LOOP_TIMERS			5
+
+struct loopStats
+{
+	int period;					// usec, as registered by the daemon
+	int rate;					// Achieved over the last second, in mHz
+	int lateMax;				// usec, worst wake-up lateness over the last second
+	int lateAvg;				// usec, mean wake-up lateness over the last second
+	unsigned int ticks;			// Periods run since start
+	unsigned int overruns;		// Periods missed because the loop ran late
+};
+
+// Sync events from the sim-mgr, kept by soundSense
+struct syncStats
+{
+	int framed;					// Binary frame version in use, 0 for the text protocol
+	unsigned int events;		// Sync events received
+	unsigned int lost;			// Framed events missing from the sequence
+	unsigned int lastSeq;
+	long long lastMgrTime;		// sim-mgr time of the last framed event, usec
+	long long lastRxTime;		// CLOCK_MONOTONIC nsec when the last event was read
+	int beatIbi;				// usec, heart beat interval learned from the pulse syncs
+	int beatPhase;				// usec, last pulse sync less its predicted time
+	unsigned int beatPredicted;	// Heart beats played before their sync arrived, or without one
+};
+
+// The sim-mgr's sync clock against our CLOCK_MONOTONIC, estimated by soundSense from
+// clock exchanges on the sync socket. The sim-mgr time at local time t (usec) is
+//	t + offset + ( t - updated ) * drift / 1e9
+// Written with clockSyncPublish and read with clockSyncGet (see simUtil.h).
+struct clockSync
+{
+	unsigned int seq;			// Odd while being written
+	int valid;
+	long long offset;			// usec, sim-mgr time minus ours at updated
+	long long updated;			// Our CLOCK_MONOTONIC time of the offset, usec
+	int drift;					// sim-mgr clock rate against ours, parts per billion
+	int rtt;					// usec, round trip of the exchange the offset came from
+	int rttMin;					// usec, lowest round trip seen
+	unsigned int samples;		// Exchanges completed
+};
+
+// Sub-structs covered by the seqlock snapshot/publish API (see shmData.dataSeq)
+#define SHM_CARDIAC			0
+#define SHM_RESPIRATION		1
+#define SHM_AUSCULTATION	2
+#define SHM_PULSE			3
+#define SHM_CPR				4
+#define SHM_EYES			5
+#define SHM_SECTIONS		6
+
+// Consumers of the dirty masks (see shmData.dataDirty)
+#define SHM_READER_CONTROLLER	0	// simController
+#define SHM_READER_SOUND		1	// soundSense
+#define SHM_READER_EYES			2	// eyesScan
+#define SHM_READERS				3
+
 struct shmData 
 {
 	sem_t	i2c_sema;	// Mutex lock - Lock for I2C bus access
@@ -258,6 +373,40 @@ struct shmData
 	int manual_breath_threashold;
 	int manual_breath_count;
 	int manual_breath_invert;
+	
+	// Analog input samples from the IIO capture buffer, when ainCapture is running
+	struct ainRing ainRing;
+	
+	// Sample history of each AIN channel, for waveform views and calibration
+	struct ainHistory ainHistory[AIN_CHANNELS_MAX];
+	
+	// Timing of each daemon's sampling loop
+	struct loopStats loopStats[LOOP_TIMERS];
+	
+	// Sync socket events
+	struct syncStats syncStats;
+	
+	// sim-mgr clock offset
+	struct clockSync clockSync;
+	
+	// Sensor change notification. Producers bump sensorSeq after changing a field that
+	// is sent to the sim-mgr (auscultation, pulse, cpr, manual_breath, eyes.connected).
+	// simController sleeps on it as a futex, so changes go out without polling.
+	unsigned int sensorSeq;
+	
+	// Advanced by soundSense when the sim-mgr pushes a "statusChange" notice on the
+	// sync socket. simController reads the status at once when it moves.
+	unsigned int simMgrStatusSeq;
+	
+	// Seqlock counter for each SHM_* sub-struct. Odd while a writer is updating the
+	// struct. Readers copy the struct with shmSnapshot and retry if the count moved.
+	unsigned int dataSeq[SHM_SECTIONS];
+	
+	// Fields changed since each reader last looked, one bit per field in the order
+	// of the simFields.h tables. shmWriteEnd sets the bits for every reader, and a
+	// reader takes and clears its own word with shmDirtyTake. dataSeq is the
+	// generation number of the struct.
+	unsigned int dataDirty[SHM_READERS][SHM_SECTIONS];
 };
 
 int cardiac_parse(const char *elem,  const char *value, struct cardiac *card );
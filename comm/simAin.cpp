@@ -0,0 +1,495 @@
+/*
+ * simAin.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * IIO buffered capture. The scan is configured through scan_elements in sysfs,
+ * the buffer is enabled, and frames are read from the character device. Each
+ * raw frame holds the enabled channels in scan index order, each aligned to its
+ * storage size, followed by the timestamp if it is enabled.
+ *
+ * A fake device reads raw frames from a file, so the capture path can be run on
+ * a desktop. The file holds the channels in the mask as little endian 16 bit
+ * values, in channel order, with no timestamp. It is replayed in a loop at the
+ * given rate.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "simAin.h"
+
+extern int debug;
+
+/*
+ * Function: ainSysWrite
+ *
+ * Write a value to a file under the device's sysfs directory.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+ainSysWrite(struct ainDevice *dev, const char *name, const char *value )
+{
+	char path[512];
+	int fd;
+	int sts;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->sysDir, name );
+	fd = open(path, O_WRONLY );
+	if ( fd < 0 )
+	{
+		return ( -1 );
+	}
+	sts = write(fd, value, strlen(value ) );
+	close(fd );
+	return ( sts < 0 ? -1 : 0 );
+}
+
+/*
+ * Function: ainSysRead
+ *
+ * Read a file under the device's sysfs directory, without the trailing newline.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+ainSysRead(struct ainDevice *dev, const char *name, char *buf, int len )
+{
+	char path[512];
+	int fd;
+	int sts;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->sysDir, name );
+	fd = open(path, O_RDONLY );
+	if ( fd < 0 )
+	{
+		return ( -1 );
+	}
+	sts = read(fd, buf, len - 1 );
+	close(fd );
+	if ( sts < 0 )
+	{
+		return ( -1 );
+	}
+	while ( sts > 0 && ( buf[sts-1] == '\n' || buf[sts-1] == ' ' ) )
+	{
+		sts--;
+	}
+	buf[sts] = 0;
+	return ( 0 );
+}
+
+struct ainElement
+{
+	int chan;		// AIN channel, or -1 for the timestamp
+	int index;
+	int bytes;
+	int shift;
+	unsigned int mask;
+	int bigEndian;
+};
+
+/*
+ * Function: ainElementRead
+ *
+ * Get the scan index and type ("le:u12/16>>0") of a scan element.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+ainElementRead(struct ainDevice *dev, const char *prefix, struct ainElement *el )
+{
+	char name[128];
+	char buf[64];
+	char endian;
+	char sign;
+	unsigned int bits;
+	unsigned int storage;
+	unsigned int shift = 0;
+
+	snprintf(name, sizeof(name), "scan_elements/%s_index", prefix );
+	if ( ainSysRead(dev, name, buf, sizeof(buf) ) < 0 )
+	{
+		return ( -1 );
+	}
+	el->index = atoi(buf );
+	snprintf(name, sizeof(name), "scan_elements/%s_type", prefix );
+	if ( ainSysRead(dev, name, buf, sizeof(buf) ) < 0 )
+	{
+		return ( -1 );
+	}
+	if ( sscanf(buf, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage, &shift ) < 4 )
+	{
+		return ( -1 );
+	}
+	if ( ( storage != 16 && storage != 32 && storage != 64 ) || bits == 0 || bits > 32 )
+	{
+		return ( -1 );
+	}
+	el->bytes = storage / 8;
+	el->shift = shift;
+	el->mask = ( bits == 32 ) ? 0xffffffff : ( ( 1u << bits ) - 1 );
+	el->bigEndian = ( endian == 'b' );
+	return ( 0 );
+}
+
+/*
+ * Function: ainLayout
+ *
+ * Place the scan elements in index order, each aligned to its own size, and fill
+ * in the frame layout of dev.
+ */
+static void
+ainLayout(struct ainDevice *dev, struct ainElement *el, int count )
+{
+	struct ainElement tmp;
+	int offset = 0;
+	int align = 1;
+	int i;
+	int j;
+
+	for ( i = 1 ; i < count ; i++ )
+	{
+		for ( j = i ; j > 0 && el[j].index < el[j-1].index ; j-- )
+		{
+			tmp = el[j];
+			el[j] = el[j-1];
+			el[j-1] = tmp;
+		}
+	}
+	dev->chanCount = 0;
+	dev->tsOffset = -1;
+	for ( i = 0 ; i < count ; i++ )
+	{
+		offset = ( offset + el[i].bytes - 1 ) & ~( el[i].bytes - 1 );
+		if ( el[i].chan < 0 )
+		{
+			dev->tsOffset = offset;
+		}
+		else
+		{
+			j = dev->chanCount++;
+			dev->chan[j] = el[i].chan;
+			dev->offset[j] = offset;
+			dev->bytes[j] = el[i].bytes;
+			dev->shift[j] = el[i].shift;
+			dev->mask[j] = el[i].mask;
+			dev->bigEndian[j] = el[i].bigEndian;
+		}
+		offset += el[i].bytes;
+		if ( el[i].bytes > align )
+		{
+			align = el[i].bytes;
+		}
+	}
+	// Frames are padded to the largest element
+	dev->frameSize = ( offset + align - 1 ) & ~( align - 1 );
+}
+
+/*
+ * Function: ainDeviceOpen
+ *
+ * Enable the IIO buffer with a scan of the channels in chanMask, plus the
+ * timestamp if the driver has one, and open the character device.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+ainDeviceOpen(struct ainDevice *dev, const char *sysDir, const char *devPath,
+			  unsigned int chanMask, int bufLen )
+{
+	struct ainElement el[AIN_CHANNELS_MAX+1];
+	char name[128];
+	char buf[32];
+	int count = 0;
+	int chan;
+
+	memset(dev, 0, sizeof(struct ainDevice) );
+	dev->fd = -1;
+	snprintf(dev->sysDir, sizeof(dev->sysDir), "%s", sysDir );
+
+	// The scan can only be changed while the buffer is off
+	ainSysWrite(dev, "buffer/enable", "0" );
+
+	for ( chan = 0 ; chan < AIN_CHANNELS_MAX ; chan++ )
+	{
+		snprintf(name, sizeof(name), "scan_elements/in_voltage%d_en", chan );
+		if ( ainSysWrite(dev, name, ( chanMask & ( 1u << chan ) ) ? "1" : "0" ) < 0 )
+		{
+			continue;	// Not provided by this driver
+		}
+		if ( chanMask & ( 1u << chan ) )
+		{
+			snprintf(name, sizeof(name), "in_voltage%d", chan );
+			if ( ainElementRead(dev, name, &el[count] ) < 0 )
+			{
+				log_message("", "ainDeviceOpen: bad scan element" );
+				return ( -1 );
+			}
+			el[count].chan = chan;
+			count++;
+		}
+	}
+	if ( count == 0 )
+	{
+		log_message("", "ainDeviceOpen: no channels in the scan" );
+		return ( -1 );
+	}
+	if ( ainSysWrite(dev, "scan_elements/in_timestamp_en", "1" ) == 0 &&
+		 ainElementRead(dev, "in_timestamp", &el[count] ) == 0 )
+	{
+		el[count].chan = -1;
+		count++;
+		// Frames are compared with CLOCK_MONOTONIC by the readers
+		if ( ainSysWrite(dev, "current_timestamp_clock", "monotonic" ) < 0 )
+		{
+			count--;
+			ainSysWrite(dev, "scan_elements/in_timestamp_en", "0" );
+		}
+	}
+	ainLayout(dev, el, count );
+	if ( dev->frameSize > AIN_FRAME_BYTES_MAX )
+	{
+		log_message("", "ainDeviceOpen: frame too large" );
+		return ( -1 );
+	}
+
+	snprintf(buf, sizeof(buf), "%d", bufLen );
+	ainSysWrite(dev, "buffer/length", buf );
+	if ( ainSysWrite(dev, "buffer/enable", "1" ) < 0 )
+	{
+		log_message("", "ainDeviceOpen: can not enable the IIO buffer" );
+		return ( -1 );
+	}
+	dev->fd = open(devPath, O_RDONLY | O_NONBLOCK | O_CLOEXEC );
+	if ( dev->fd < 0 )
+	{
+		log_message("", "ainDeviceOpen: can not open the IIO device" );
+		ainSysWrite(dev, "buffer/enable", "0" );
+		return ( -1 );
+	}
+	dev->framePeriod = 1000000000LL / AIN_FAKE_RATE;	// Refined from the frames read
+	return ( 0 );
+}
+
+/*
+ * Function: ainDeviceOpenFake
+ *
+ * Open a file of raw frames to replay at rate frames per second.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+ainDeviceOpenFake(struct ainDevice *dev, const char *fileName, unsigned int chanMask, int rate )
+{
+	int chan;
+
+	memset(dev, 0, sizeof(struct ainDevice) );
+	dev->fake = 1;
+	dev->tsOffset = -1;
+	for ( chan = 0 ; chan < AIN_CHANNELS_MAX ; chan++ )
+	{
+		if ( chanMask & ( 1u << chan ) )
+		{
+			dev->chan[dev->chanCount] = chan;
+			dev->offset[dev->chanCount] = dev->chanCount * 2;
+			dev->bytes[dev->chanCount] = 2;
+			dev->mask[dev->chanCount] = 0xffff;
+			dev->chanCount++;
+		}
+	}
+	dev->frameSize = dev->chanCount * 2;
+	if ( dev->frameSize == 0 || rate <= 0 )
+	{
+		return ( -1 );
+	}
+	dev->framePeriod = 1000000000LL / rate;
+	dev->fd = open(fileName, O_RDONLY | O_CLOEXEC );
+	if ( dev->fd < 0 )
+	{
+		return ( -1 );
+	}
+	dev->lastTs = ainNow();
+	return ( 0 );
+}
+
+static unsigned int
+ainRawValue(const unsigned char *p, int bytes, int bigEndian )
+{
+	unsigned int val = 0;
+	int i;
+
+	for ( i = 0 ; i < bytes && i < 4 ; i++ )
+	{
+		if ( bigEndian )
+		{
+			val = ( val << 8 ) | p[i];
+		}
+		else
+		{
+			val |= (unsigned int)p[i] << ( 8 * i );
+		}
+	}
+	return ( val );
+}
+
+/*
+ * Function: ainDecode
+ *
+ * Convert count raw frames to ainFrames. Frames without a device timestamp are
+ * spread evenly from the last frame time up to now.
+ */
+static void
+ainDecode(struct ainDevice *dev, struct ainFrame *frames, int count, long long now )
+{
+	const unsigned char *raw;
+	long long ts;
+	int i;
+	int j;
+
+	if ( dev->tsOffset < 0 && ! dev->fake && dev->lastTs > 0 && now > dev->lastTs )
+	{
+		dev->framePeriod = ( now - dev->lastTs ) / count;
+	}
+	for ( i = 0 ; i < count ; i++ )
+	{
+		raw = (const unsigned char *)&dev->raw[i * dev->frameSize];
+		memset(frames[i].value, 0, sizeof(frames[i].value) );
+		for ( j = 0 ; j < dev->chanCount ; j++ )
+		{
+			frames[i].value[dev->chan[j]] =
+				( ainRawValue(&raw[dev->offset[j]], dev->bytes[j], dev->bigEndian[j] ) >> dev->shift[j] ) & dev->mask[j];
+		}
+		if ( dev->tsOffset >= 0 )
+		{
+			memcpy(&ts, &raw[dev->tsOffset], sizeof(ts) );
+		}
+		else if ( dev->lastTs > 0 )
+		{
+			ts = dev->lastTs + ( i + 1 ) * dev->framePeriod;
+		}
+		else
+		{
+			ts = now - ( count - 1 - i ) * dev->framePeriod;
+		}
+		frames[i].ts = ts;
+	}
+	dev->lastTs = frames[count-1].ts;
+}
+
+/*
+ * Function: ainDeviceRead
+ *
+ * Read up to max frames (no more than AIN_RING_BATCH), waiting up to timeoutMs
+ * for the first. A fake device paces its frames to the rate it was opened with.
+ *
+ * Returns: The number of frames, 0 on timeout, -1 on error
+ */
+int
+ainDeviceRead(struct ainDevice *dev, struct ainFrame *frames, int max, int timeoutMs )
+{
+	struct pollfd pfd;
+	struct timespec wake;
+	long long now;
+	long long due;
+	int bytes;
+	int count;
+	int sts;
+
+	if ( max > AIN_RING_BATCH )
+	{
+		max = AIN_RING_BATCH;
+	}
+	if ( dev->fake )
+	{
+		// Sleep until the next frame is due, then take all of the frames that are
+		due = dev->lastTs + dev->framePeriod;
+		wake.tv_sec = due / 1000000000LL;
+		wake.tv_nsec = due % 1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL );
+		now = ainNow();
+		count = ( now - dev->lastTs ) / dev->framePeriod;
+		if ( count > max )
+		{
+			count = max;
+		}
+		if ( count < 1 )
+		{
+			count = 1;
+		}
+		bytes = read(dev->fd, dev->raw, count * dev->frameSize );
+		if ( bytes < dev->frameSize )
+		{
+			// End of the file, replay from the start
+			lseek(dev->fd, 0, SEEK_SET );
+			bytes = read(dev->fd, dev->raw, count * dev->frameSize );
+			if ( bytes < dev->frameSize )
+			{
+				return ( -1 );
+			}
+		}
+		count = bytes / dev->frameSize;
+		ainDecode(dev, frames, count, now );
+		return ( count );
+	}
+
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	sts = poll(&pfd, 1, timeoutMs );
+	if ( sts < 0 )
+	{
+		return ( errno == EINTR ? 0 : -1 );
+	}
+	if ( sts == 0 )
+	{
+		return ( 0 );
+	}
+	bytes = read(dev->fd, dev->raw, max * dev->frameSize );
+	if ( bytes < 0 )
+	{
+		return ( ( errno == EAGAIN || errno == EINTR ) ? 0 : -1 );
+	}
+	count = bytes / dev->frameSize;
+	if ( count > 0 )
+	{
+		ainDecode(dev, frames, count, ainNow() );
+	}
+	return ( count );
+}
+
+void
+ainDeviceClose(struct ainDevice *dev )
+{
+	if ( dev->fd >= 0 )
+	{
+		close(dev->fd );
+		dev->fd = -1;
+	}
+	if ( ! dev->fake )
+	{
+		ainSysWrite(dev, "buffer/enable", "0" );
+	}
+}
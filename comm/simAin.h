@@ -0,0 +1,66 @@
+/*
+ * simAin.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMAIN_H_
+#define SIMAIN_H_
+
+#include "shmData.h"
+#include "simUtil.h"
+
+// Buffered capture from the AM335x ADC through the IIO buffer interface. All of
+// the channels in the scan are sampled together by the ADC's continuous mode, and
+// whole frames are read from /dev/iio:deviceN in bulk.
+
+#define AIN_IIO_SYS_DIR		"/sys/bus/iio/devices/iio:device0"
+#define AIN_IIO_DEV			"/dev/iio:device0"
+#define AIN_IIO_BUF_LEN		1024	// Frames held by the kernel buffer
+#define AIN_FAKE_RATE		1000	// Default frames per second from a fake device
+#define AIN_FRAME_BYTES_MAX	64		// 8 channels of 4 bytes, and an 8 byte timestamp
+
+struct ainDevice
+{
+	int fd;
+	int fake;						// Reading a file instead of the IIO device
+	char sysDir[256];
+
+	// Layout of a raw frame, from scan_elements
+	int frameSize;
+	int chanCount;
+	int chan[AIN_CHANNELS_MAX];		// Channel number of each scan element
+	int offset[AIN_CHANNELS_MAX];	// Byte offset in the frame
+	int bytes[AIN_CHANNELS_MAX];	// Storage size, 2 or 4
+	int shift[AIN_CHANNELS_MAX];
+	unsigned int mask[AIN_CHANNELS_MAX];
+	int bigEndian[AIN_CHANNELS_MAX];
+	int tsOffset;					// Offset of the timestamp, -1 if none
+
+	long long lastTs;				// Time of the last frame read
+	long long framePeriod;			// nsec, for fake pacing and synthesized timestamps
+
+	char raw[AIN_RING_BATCH * AIN_FRAME_BYTES_MAX];
+};
+
+int ainDeviceOpen(struct ainDevice *dev, const char *sysDir, const char *devPath,
+				  unsigned int chanMask, int bufLen );
+int ainDeviceOpenFake(struct ainDevice *dev, const char *fileName, unsigned int chanMask, int rate );
+int ainDeviceRead(struct ainDevice *dev, struct ainFrame *frames, int max, int timeoutMs );
+void ainDeviceClose(struct ainDevice *dev );
+
+#endif /* SIMAIN_H_ */
@@ -50,28 +50,38 @@
 */
 
 #include "simUtil.h"
+#include "simHttp.h"
 #include "shmData.h"
+#include "simFields.h"
 
 using namespace std;
 
-#define SEC_NONE		0
-#define SEC_CARDIAC		1
-#define SEC_RESPIRATION	2
-#define SEC_GENERAL		3
-#define SEC_EYES		4
-
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 #define BUF_LEN_MAX	4096
-char msgbuf[BUF_LEN_MAX+4];
-char simctlrReadCmd[BUF_LEN_MAX+4];
+static char msgbuf[BUF_LEN_MAX+4];
 char simctlrWriteCmd[BUF_LEN_MAX+4];
+#define SIM_RESP_MAX	(4*BUF_LEN_MAX)
+char simMgrResp[SIM_RESP_MAX+4];
 
 int simMgrSyncTime(void);
+char *respGets(char *line, int size, char **pos );
+static long int msecNow(void );
+
+// Sensor changes are sent as soon as they are signalled. The sim-mgr status is
+// read on this interval, or at once when soundSense relays a status change notice.
+#define SIM_MGR_READ_MS			200
+#define SIM_MGR_READ_PUSH_MS	1000
+#define SIM_MGR_TIME_SYNC_MS	(60*60*1000)	// Hourly once the time is set
+#define SIM_MGR_TIME_RETRY_MS	3000
 void simMgrRead(void );
 void simMgrWrite(void );
 void initializeSensorData(void );
 
+#ifndef SIM_RUNTIME
 int debug = 0;
+#endif
 
 #ifdef DO_DEAMON_STARTS
 	// This section is as yet untested. I need to create a "clean up" function
@@ -105,7 +115,6 @@ startProcess(const char *cmd, const char *arg )
 int main(int argc, char *argv[])
 {
 	int sts;
-	int loop_count;
 	
 	// Do GPIO Pin configurations
 	system("config-pin P9.24 uart" );	// UART1 - For rfidScan
@@ -129,6 +138,13 @@ int main(int argc, char *argv[])
 		log_message("", msgbuf );
 		exit ( -1 );
 	}
+	
+	// The segment outlives the daemons. A daemon killed inside a write leaves its
+	// seqlock count odd, and every writer and reader would then wait on it forever.
+	memset(shmData->dataSeq, 0, sizeof(shmData->dataSeq) );
+	memset(shmData->dataDirty, 0, sizeof(shmData->dataDirty) );
+	memset(&shmData->clockSync, 0, sizeof(shmData->clockSync) );
+	__atomic_store_n(&shmData->ainRing.active, 0, __ATOMIC_RELEASE );	// ainCapture starts after us
 
 	shmData->cardiac.rate = 80;
 	shmData->respiration.awRR = 50;
@@ -150,6 +166,13 @@ int main(int argc, char *argv[])
 	releaseI2CLock();
 	
 	initializeSensorData();
+	shmDirtyReset(SHM_READER_CONTROLLER );
+	
+	sts = simHttpInit();
+	if ( sts )
+	{
+		log_message("", "simHttpInit failed" );
+	}
 	
 #ifdef DO_DEAMON_STARTS
 	// Start the other deamons
@@ -160,42 +183,69 @@ int main(int argc, char *argv[])
 	cprPid = startProcess("/usr/local/bin/cprScan" );
 #endif // DO_DEAMON_STARTS
 
-	loop_count = 30;
-	int timeWasSet = 0;
+	unsigned int sensorSeq;
+	unsigned int statusSeq;
+	unsigned int lastStatusSeq = 0;
+	long int now;
+	long int nextRead = 0;
+	long int nextTimeSync;
 	
+	nextTimeSync = msecNow() + SIM_MGR_TIME_RETRY_MS;
 	while ( 1 )
 	{
 		if ( shmData->simMgrStatusPort != 0 )
 		{
-			if ( ( loop_count & 1 ) == 0 )
+			// Sample the sequence before sending, so a change made while the write
+			// is in progress ends the wait below immediately.
+			sensorSeq = shmSensorSeq();
+			simMgrWrite();
+			
+			now = msecNow();
+			statusSeq = __atomic_load_n(&shmData->simMgrStatusSeq, __ATOMIC_ACQUIRE );
+			if ( ( now >= nextRead ) || ( statusSeq != lastStatusSeq ) )
 			{
 				simMgrRead();
+				lastStatusSeq = statusSeq;
+				// Once the sim-mgr has shown it pushes change notices, polling is
+				// only a fallback.
+				nextRead = now + ( statusSeq != 0 ? SIM_MGR_READ_PUSH_MS : SIM_MGR_READ_MS );
 			}
-			else
+			if ( now >= nextTimeSync )
 			{
-				simMgrWrite();
-			}
-			loop_count--;
-			if ( loop_count < 1 )
-			{
-				sts = simMgrSyncTime();
-				if ( sts == 0 )
+				if ( simMgrSyncTime() == 0 )
 				{
-					timeWasSet = 1;
-				}
-				if ( timeWasSet )
-				{
-					loop_count = (60*60*100);	// 60 minutes
+					nextTimeSync = now + SIM_MGR_TIME_SYNC_MS;
 				}
 				else
 				{
-					loop_count = 30;	// 0.3 seconds
+					nextTimeSync = now + SIM_MGR_TIME_RETRY_MS;
 				}
 			}
+			now = msecNow();
+			// Sleep until a sensor changes, a status notice arrives or the next read is due
+			shmSensorWait(sensorSeq, ( nextRead > now ? nextRead - now : 1 ) );
+		}
+		else
+		{
+			usleep(100000 );
 		}
-		usleep(100000 );
 	}
 }
+
+/*
+ * Function: msecNow
+ *
+ * Monotonic time in msec, used to schedule the sim-mgr reads
+ */
+static long int
+msecNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( ( ts.tv_sec * 1000 ) + ( ts.tv_nsec / 1000000 ) );
+}
+
 /*
  * look for updates in sensors and send changes
 */
@@ -230,141 +280,191 @@ initializeSensorData(void )
 }
 char ampChar[] = "%26";
 
+// When set, every changed field is sent in a single set: request, with the
+// parameters joined by '&'. Clear it to send one field per request, for sim-mgr
+// versions that only act on the first set: parameter.
+int simMgrBatchWrite = 1;
+static int writeLen;
+static int writeCount;
+
+// Shadows moved by the pending write, with their values before, so a failed write
+// can be undone and resent
+#define WRITE_UNDO_MAX	16
+static int *undoShadow[WRITE_UNDO_MAX];
+static int undoValue[WRITE_UNDO_MAX];
+static int undoCount;
+static int breathPending;		// A manual breath taken from shmData but not yet sent
+
+/*
+ * Function: queueSet
+ *
+ * Append "set:param=value" to the pending write command if the value differs from
+ * the shadow copy. The shadow is updated only when the parameter is queued, so in
+ * single field mode anything not queued is picked up on the next pass. If the write
+ * fails, queueUndo puts the shadows back.
+ * A NULL shadow always queues the value. Nothing is queued that would not fit in
+ * the command.
+ *
+ * Returns: 1 if queued, 0 if not
+ */
+static int
+queueSet(const char *param, int *shadow, int value )
+{
+	int len;
+
+	if ( shadow && *shadow == value )
+	{
+		return ( 0 );
+	}
+	if ( writeCount > 0 && ! simMgrBatchWrite )
+	{
+		return ( 0 );
+	}
+	len = snprintf(&simctlrWriteCmd[writeLen], BUF_LEN_MAX - writeLen, "%sset:%s=%d",
+				   ( writeCount > 0 ? "&" : "" ), param, value );
+	if ( len >= BUF_LEN_MAX - writeLen )
+	{
+		// Full. The shadow is left alone, so it is queued on the next pass.
+		simctlrWriteCmd[writeLen] = 0;
+		return ( 0 );
+	}
+	writeLen += len;
+	if ( shadow )
+	{
+		if ( undoCount < WRITE_UNDO_MAX )
+		{
+			undoShadow[undoCount] = shadow;
+			undoValue[undoCount] = *shadow;
+			undoCount++;
+		}
+		*shadow = value;
+	}
+	writeCount++;
+	return ( 1 );
+}
+
+/*
+ * Function: queueUndo
+ *
+ * Restore the shadows changed by the pending write, newest first, so the values
+ * compare as changed again on the next pass.
+ */
+static void
+queueUndo(void )
+{
+	while ( undoCount > 0 )
+	{
+		undoCount--;
+		*undoShadow[undoCount] = undoValue[undoCount];
+	}
+}
+
+/*
+ * Function: simMgrWrite
+ *
+ * Send the sensor fields that changed. The shmData dirty masks are gathered into
+ * sensorDirty, so sections that were not written are skipped without a compare.
+ * A section's bits are kept until a pass finds nothing more to send for it.
+ */
+static unsigned int sensorDirty[SHM_SECTIONS];
+
+#define AUS_SENT	( SHM_BIT(auscultation, side) | SHM_BIT(auscultation, row) | SHM_BIT(auscultation, col) )
+#define PULSE_SENT	( SHM_BIT(pulse, right_dorsal) | SHM_BIT(pulse, left_dorsal) | \
+					  SHM_BIT(pulse, right_femoral) | SHM_BIT(pulse, left_femoral) )
+#define CPR_SENT	( SHM_BIT(cpr, compression) | SHM_BIT(cpr, release) )
+
 void
 simMgrWrite(void )
 {
-	FILE *pipe;
-	int do_send;
+	struct auscultation ausNow;
+	struct pulse pulNow;
+	struct cpr cprNow;
+	int breathSent;
+	int section;
+	
+	for ( section = SHM_RESPIRATION ; section < SHM_SECTIONS ; section++ )
+	{
+		sensorDirty[section] |= shmDirtyTake(SHM_READER_CONTROLLER, section );
+	}
 	while ( 1 ) 
 	{
-		do_send = 0;
-		if ( aus.side != shmData->auscultation.side )
+		writeLen = 0;
+		writeCount = 0;
+		undoCount = 0;
+		breathSent = 0;
+		simctlrWriteCmd[0] = 0;
+		
+		// Consistent copies, so a side/row/col triple is never sent half updated
+		if ( sensorDirty[SHM_AUSCULTATION] & AUS_SENT )
 		{
-			aus.side = shmData->auscultation.side;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:auscultation:side=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				aus.side );
-			do_send++;
+			shmSnapshot(SHM_AUSCULTATION, &ausNow );
+			queueSet("auscultation:side", &aus.side, ausNow.side );
+			queueSet("auscultation:row", &aus.row, ausNow.row );
+			queueSet("auscultation:col", &aus.col, ausNow.col );
 		}
-		else if ( aus.row != shmData->auscultation.row ) 
+		if ( sensorDirty[SHM_PULSE] & PULSE_SENT )
 		{
-			aus.row = shmData->auscultation.row;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:auscultation:row=%d", 
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				aus.row );
-			do_send++;
+			shmSnapshot(SHM_PULSE, &pulNow );
+			queueSet("pulse:right_dorsal", &pul.right_dorsal, pulNow.right_dorsal );
+			queueSet("pulse:left_dorsal", &pul.left_dorsal, pulNow.left_dorsal );
+			queueSet("pulse:right_femoral", &pul.right_femoral, pulNow.right_femoral );
+			queueSet("pulse:left_femoral", &pul.left_femoral, pulNow.left_femoral );
 		}
-		else if ( aus.col != shmData->auscultation.col )
+		if ( breathPending ||
+			 ( ( sensorDirty[SHM_RESPIRATION] & SHM_BIT(respiration, manual_breath) ) &&
+			   shmData->respiration.manual_breath ) )
 		{
-			aus.col = shmData->auscultation.col;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:auscultation:col=%d", 
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				aus.col );
-			do_send++;
-		}
-		else if ( pul.right_dorsal != shmData->pulse.right_dorsal ) 
-		{
-			pul.right_dorsal = shmData->pulse.right_dorsal;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:pulse:right_dorsal=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				pul.right_dorsal );
-			do_send++;
-		}
-		else if ( pul.left_dorsal != shmData->pulse.left_dorsal ) 
-		{
-			pul.left_dorsal = shmData->pulse.left_dorsal;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:pulse:left_dorsal=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				pul.left_dorsal );
-			do_send++;
-		}
-		else if ( pul.right_femoral != shmData->pulse.right_femoral ) 
-		{
-			pul.right_femoral = shmData->pulse.right_femoral;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:pulse:right_femoral=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				pul.right_femoral );
-			do_send++;
-		}
-		else if ( pul.left_femoral != shmData->pulse.left_femoral ) 
-		{
-			pul.left_femoral = shmData->pulse.left_femoral;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:pulse:left_femoral=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				pul.left_femoral );
-			do_send++;
-		}
-
-		else if ( shmData->respiration.manual_breath )
-		{
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:respiration:manual_breath=1",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort );
-			shmData->respiration.manual_breath = 0;
-			do_send++;
-		}
-		else if ( cpr.compression != shmData->cpr.compression )
-		{
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:cpr:compression=%d",
-				shmData->simMgrIPAddr, 
-				shmData->simMgrStatusPort, 
-				shmData->cpr.compression );
-			cpr.compression = shmData->cpr.compression;
-			do_send++;
+			if ( queueSet("respiration:manual_breath", NULL, 1 ) )
+			{
+				breathSent = 1;
+				if ( shmData->respiration.manual_breath )
+				{
+					shmWriteBegin(SHM_RESPIRATION );
+					shmData->respiration.manual_breath = 0;
+					shmWriteEnd(SHM_RESPIRATION, SHM_BIT(respiration, manual_breath) );
+				}
+			}
 		}
-		else if ( cpr.release != shmData->cpr.release )
+		if ( sensorDirty[SHM_CPR] & CPR_SENT )
 		{
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:cpr:release=%d",
-				shmData->simMgrIPAddr, 
-				shmData->simMgrStatusPort,
-				shmData->cpr.release );
-			cpr.release = shmData->cpr.release;
-			do_send++;
+			shmSnapshot(SHM_CPR, &cprNow );
+			queueSet("cpr:compression", &cpr.compression, cprNow.compression );
+			queueSet("cpr:release", &cpr.release, cprNow.release );
 		}
 #if 0
-		else if ( ( def.last != shmData->defibrillation.last ) ||
+		if ( ( def.last != shmData->defibrillation.last ) ||
 			 ( def.energy != shmData->defibrillation.energy ) )
 		{
-			do_send++;
 		}
 #endif
-		else if ( eyeState.connected != shmData->eyes.connected )
+		if ( sensorDirty[SHM_EYES] & SHM_BIT(eyes, connected) )
 		{
-			eyeState.connected = shmData->eyes.connected;
-			sprintf(simctlrWriteCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?set:eyes:connected=%d",
-				shmData->simMgrIPAddr,
-				shmData->simMgrStatusPort,
-				eyeState.connected );
-			do_send++;
+			queueSet("eyes:connected", &eyeState.connected, shmData->eyes.connected );
 		}
-		if ( do_send )
+		
+		if ( writeCount > 0 )
 		{
 			//log_message("", simctlrWriteCmd );
-			pipe = popen(simctlrWriteCmd, "r" );
-			if ( !pipe )
+			// Could parse the return, but not really needed.
+			if ( simHttpStatusGet(shmData->simMgrIPAddr, shmData->simMgrStatusPort,
+								  simctlrWriteCmd, msgbuf, BUF_LEN_MAX ) < 0 )
 			{
-				perror("popen" );
-				exit ( 1 );
+				// sim-mgr not answering, or it refused the write. The dirty bits are
+				// kept and the shadows put back, so this batch and the rest go out on
+				// the next pass.
+				queueUndo();
+				breathPending |= breathSent;
+				break;
 			}
-			else
+			if ( breathSent )
 			{
-				while (fgets(msgbuf, BUF_LEN_MAX, pipe) != NULL)
-				{
-					// Could parse the return, but not really needed.
-					//log_message("", msgbuf );
-				}
-				pclose(pipe );
+				breathPending = 0;
 			}
 		}
 		else
 		{
+			// Every shadow matches, nothing is pending
+			memset(sensorDirty, 0, sizeof(sensorDirty) );
 			break;
 		}
 	}
@@ -373,7 +473,7 @@ simMgrWrite(void )
 int
 simMgrSyncTime(void)
 {
-	FILE *pipe1;
+	char *respPtr;
 	FILE *pipe2;
 	char buff[1024];
 	char dbuff[64];
@@ -391,19 +491,17 @@ simMgrSyncTime(void)
 	int len;
 	int i;
 	
-	sprintf(buff, "simCurl  %s:%d/cgi-bin/simstatus.cgi?date=1", shmData->simMgrIPAddr, shmData->simMgrStatusPort );
-	//log_message("", buff );
-	pipe1 = popen(buff, "r" );
-	if ( !pipe1 )
+	sts = simHttpStatusGet(shmData->simMgrIPAddr, shmData->simMgrStatusPort, "date=1", simMgrResp, SIM_RESP_MAX );
+	if ( sts < 0 )
 	{
-		sprintf(buff, "Get Date fails: %s", strerror(errno ) );
+		sprintf(buff, "Get Date fails from %s:%d", shmData->simMgrIPAddr, shmData->simMgrStatusPort );
 		syslog (LOG_DAEMON | LOG_NOTICE, buff );
 	}
 	else
 	{
 // Super-simple parse routine
-
-		while (fgets(dbuff, 64, pipe1) != NULL)
+		respPtr = simMgrResp;
+		while (respGets(dbuff, 64, &respPtr) != NULL)
 		{
 			len = strlen(dbuff);
 			//snprintf(msgbuf, BUF_LEN_MAX, "simMgrSyncTime: %d \"%s\"", len, dbuff );
@@ -505,117 +603,240 @@ simMgrSyncTime(void)
 				}
 			}
 		}
-		pclose(pipe1 );
 	}
 	return ( rval );
 }
 
-int maxLog = 0;
-void
-simMgrRead(void )
+/*
+ * Sections of the simctrldata response that are applied to shared memory. Each has
+ * a cache of the last value text, so only changed fields are applied. Fields are
+ * applied inside a seqlock write of the matching SHM_* struct. Local daemons write
+ * some of the same structs (eyesScan sets its defaults at start), so the cache is
+ * dropped whenever the seqlock count shows another writer has been in the struct.
+*/
+struct simSection
 {
-	FILE *pipe;
-	int section;
-	int i;
-	int sts;
-	char name[128];
-	char value[128];
-	
-	sprintf(simctlrReadCmd, "simCurl  %s:%d/cgi-bin/simstatus.cgi?simctrldata=1", shmData->simMgrIPAddr, shmData->simMgrStatusPort );
+	const struct simFieldTable *table;
+	int shm;
+	void *base;
+	struct simFieldCache cache;
+	unsigned int seq;					// Seqlock count after our last write
+};
+
+static struct simSection simSections[] =
+{
+	{ &cardiacTable, SHM_CARDIAC, NULL, {}, 0 },
+	{ &respirationTable, SHM_RESPIRATION, NULL, {}, 0 },
+	{ &eyesTable, SHM_EYES, NULL, {}, 0 },
+};
+#define SIM_SECTIONS	( (int)( sizeof(simSections) / sizeof(simSections[0]) ) )
 
-	pipe = popen(simctlrReadCmd, "r" );
-	if ( !pipe )
+static inline int
+isRespDelim(char c )
+{
+	switch ( c )
 	{
-		perror("popen" );
-		exit ( 1 );
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+		case ':':
+		case '"':
+		case '{':
+		case '}':
+		case ',':
+			return ( 1 );
 	}
-	else
+	return ( 0 );
+}
+
+/*
+ * Function: simMgrParse
+ *
+ * Single pass, in place parse of the simctrldata response. Each line is split into
+ * words on the JSON punctuation. A word followed by '{' starts a section, and the
+ * first two words of any other line are a name and value. Unlike the old sscanf
+ * parse, an empty value ("vpc":"") no longer ends the section. Words are NULL terminated
+ * in the buffer itself, nothing is copied.
+ */
+static void
+simMgrParse(char *buf )
+{
+	struct simSection *section = NULL;
+	struct simSection *writing = NULL;	// Section with a seqlock write open
+	unsigned int dirty = 0;				// Fields of that section changed so far
+	char *p = buf;
+	char *word[2];
+	int wordLen[2];
+	int words;
+	int open;
+	int eol;
+	int i;
+	char c;
+	
+	while ( *p )
 	{
-		// Super-simple parse routine
-		int simMgrGotData = 0;
-		section = SEC_NONE;
-		while (fgets(msgbuf, BUF_LEN_MAX, pipe) != NULL)
+		words = 0;
+		open = 0;
+		eol = 0;
+		while ( *p && ! eol )
 		{
-			simMgrGotData = 1;
-			for ( i = 0 ; msgbuf[i] != 0 ; i++ )
+			if ( isRespDelim(*p ) )
 			{
-				switch ( msgbuf[i] )
-				{
-					case ':':
-					case '"':
-					case '}':
-					case '{':
-					case ',':
-						msgbuf[i] = ' ';
-						break;
-				}
+				c = *p++;
 			}
-			// Check for a data line
-			sts = sscanf(msgbuf, "%s %s", name, value );
-			if ( sts == 1 )
+			else
 			{
-				// printf("Section: '%s'\n", name );
-				if ( strcmp(name, "cardiac" ) == 0 )
+				if ( words < 2 )
 				{
-					section = SEC_CARDIAC;
+					word[words] = p;
 				}
-				else if ( strcmp(name, "respiration" ) == 0 )
+				while ( *p && ! isRespDelim(*p ) )
 				{
-					section = SEC_RESPIRATION;
+					p++;
 				}
-				else if ( strcmp(name, "eyes" ) == 0 )
+				if ( words < 2 )
 				{
-					section = SEC_EYES;
+					wordLen[words] = p - word[words];
 				}
-				else
+				words++;
+				c = *p;
+				if ( c )
 				{
-					section = SEC_NONE;
+					*p++ = 0;
 				}
-				
 			}
-			else if ( sts == 2 )
+			if ( c == '\n' )
+			{
+				eol = 1;
+			}
+			else if ( c == '{' )
+			{
+				// Anything after the brace is parsed as a new line
+				open = 1;
+				eol = 1;
+			}
+		}
+		
+		if ( open && words >= 1 )
+		{
+			if ( writing )
 			{
-				switch ( section )
+				writing->seq = shmWriteEnd(writing->shm, dirty );
+				writing = NULL;
+				dirty = 0;
+			}
+			section = NULL;
+			for ( i = 0 ; i < SIM_SECTIONS ; i++ )
+			{
+				if ( strcmp(word[0], simSections[i].table->section ) == 0 )
 				{
-					case SEC_NONE:
-						if ( debug > 1)
-						{
-							printf("none: '%s', Value '%s'\n", name, value );
-						}
-						break;
-					case SEC_CARDIAC:
-						if ( debug > 1)
-						{
-							printf("cardiac: '%s', Value '%s'\n", name, value );
-						}
-						cardiac_parse(name,  value, &shmData->cardiac );
-						break;
-					case SEC_RESPIRATION:
-						if ( debug > 1 )
-						{
-							printf("respiration: '%s', Value '%s'\n", name, value );
-						}
-						respiration_parse(name,  value, &shmData->respiration );
-						break;
-					case SEC_EYES:
-						if ( debug > 1 )
-						{
-							printf("eyes: '%s', Value '%s'\n", name, value );
-						}
-						eyes_parse(name, value, &shmData->eyes );
-						break;
+					section = &simSections[i];
+					break;
 				}
 			}
-
 		}
-		pclose(pipe );
+		else if ( words >= 2 )
+		{
+			if ( debug > 1 )
+			{
+				printf("%s: '%s', Value '%s'\n", ( section ? section->table->section : "none" ), word[0], word[1] );
+			}
+			if ( section )
+			{
+				if ( ! writing )
+				{
+					// Readers see all of the section's changes at once
+					if ( shmWriteBegin(section->shm ) != section->seq )
+					{
+						// Written by another daemon since: its values may differ from the cache
+						simFieldCacheClear(&section->cache );
+					}
+					writing = section;
+				}
+				simFieldApplyChanged(section->table, &section->cache, section->base,
+									 word[0], word[1], wordLen[1], &dirty );
+			}
+		}
+	}
+	if ( writing )
+	{
+		writing->seq = shmWriteEnd(writing->shm, dirty );
+	}
+}
 
-		// Detect WinVetSim coming online: force resend of eyes.connected
+void
+simMgrRead(void )
+{
+	int sts;
+	int i;
+	
+	sts = simHttpStatusPoll(shmData->simMgrIPAddr, shmData->simMgrStatusPort, "simctrldata=1", simMgrResp, SIM_RESP_MAX );
+	if ( sts == SIM_HTTP_NOT_MODIFIED && ! simMgrWasAvailable )
+	{
+		// Back online: the full response is needed to resend state and reload the caches
+		sts = simHttpStatusGet(shmData->simMgrIPAddr, shmData->simMgrStatusPort, "simctrldata=1", simMgrResp, SIM_RESP_MAX );
+	}
+	if ( sts == SIM_HTTP_NOT_MODIFIED )
+	{
+		// Nothing changed since the last read
+		simMgrWasAvailable = 1;
+	}
+	else if ( sts < 0 )
+	{
+		simMgrWasAvailable = 0;
+	}
+	else
+	{
+		int simMgrGotData = ( sts > 0 );
+		
+		simSections[0].base = &shmData->cardiac;
+		simSections[1].base = &shmData->respiration;
+		simSections[2].base = &shmData->eyes;
+		
+		// Detect WinVetSim coming online: force resend of eyes.connected, and
+		// apply every field of the first response.
 		if (simMgrGotData && !simMgrWasAvailable)
 		{
 			eyeState.connected = 0;
+			sensorDirty[SHM_EYES] |= SHM_BIT(eyes, connected);
+			for ( i = 0 ; i < SIM_SECTIONS ; i++ )
+			{
+				simFieldCacheClear(&simSections[i].cache );
+			}
 		}
+		simMgrParse(simMgrResp );
 		simMgrWasAvailable = simMgrGotData;
 	}
 }
 
+/*
+ * Function: respGets
+ *
+ * fgets() equivalent for an in-memory response. Copies the next line, including
+ * the newline, from *pos into line and advances *pos past it.
+ *
+ * Returns: line, or NULL at the end of the response
+ */
+char *
+respGets(char *line, int size, char **pos )
+{
+	char *src = *pos;
+	int len = 0;
+
+	if ( *src == 0 || size < 2 )
+	{
+		return ( NULL );
+	}
+	while ( *src && len < size - 1 )
+	{
+		line[len++] = *src;
+		if ( *src++ == '\n' )
+		{
+			break;
+		}
+	}
+	line[len] = 0;
+	*pos = src;
+	return ( line );
+}
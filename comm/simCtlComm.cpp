@@ -23,6 +23,7 @@
  * 
  * The specific host name may be provided by creating a file, /simulator/simmgr that contains the host name or IP address.
  * If the file does not exist or is empty, the local subnet will be scanned to find a simmgr.
+ * The address found by a scan is saved in /simulator/simmgrLast and is tried first on the next start.
 */
 #include <stdlib.h>
 #include <unistd.h>
@@ -34,12 +35,18 @@
 #include <sys/stat.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <endian.h>
 
 #include <iostream>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <arpa/inet.h>
@@ -49,6 +56,7 @@
 
 #include "simCtlComm.h"
 #include "simUtil.h"
+#include "shmData.h"
 #include "version.h"
 
 #define BUF_MAX	4096
@@ -142,7 +150,6 @@ simCtlComm::openListen(int active )
 
 	char hostAddr[32];
 	struct IPv4 myIP;
-	int i, j;
 	struct ifaddrs *myaddrs, *ifa;
     void *in_addr;
 	struct sockaddr_in *s4;
@@ -208,53 +215,20 @@ simCtlComm::openListen(int active )
 	}
 	if ( strlen(simMgrName) == 0 )
 	{
-		sts = -1;
-		while ( sts )
+		// The address found last time is usually still right
+		fd = this->tryLastSimMgr();
+		while ( fd <= 0 )
 		{
-			for ( j = 0 ; j < 2 && connectState == false ; j++ )
+			// Scan the local subnet looking for the server
+			fd = this->scanSubnet(&myIP );
+			if ( fd <= 0 )
 			{
-				if ( scanBothPorts )
-				{
-					if ( j == 0 )
-					{
-						commPort = WVS_SYNC_PORT;
-					}
-					else
-					{
-						commPort = LINUX_SYNC_PORT;
-					}
-				}
-				// Scan the local subnet looking for the server
-				for ( i = 1 ; i < 255 ; i++ )
-				{
-					if ( i == myIP.b4 ) // Don't scan our own address
-					{
-						continue;
-					}
-					sprintf(hostAddr, "%d.%d.%d.%d", myIP.b1, myIP.b2, myIP.b3, i );
-					if ( debug )
-					{
-						printf("Trying \"%s\"\n", hostAddr );
-					}
-					fd = this->trySimMgrOpen(hostAddr );
-					if ( fd <= 0 )
-					{
-					}
-					else
-					{
-						commFD = fd;
-						sts = 0;
-						break;
-					}
-
-				}
-				if ( sts )
-				{
-					// Not found - Wait and then try again
-					usleep(10000 );
-				}
+				// Not found - Wait and then try again
+				usleep(SCAN_RETRY_US );
 			}
 		}
+		commFD = fd;
+		this->saveLastSimMgr();
 	}
 	else
 	{
@@ -305,204 +279,1099 @@ simCtlComm::openListen(int active )
 	return ( 0 );
 }
 
-#define SM_BUF_MAX	32
-
+/*
+ * Function: scanSubnet
+ *
+ * Look for the simmgr on the local /24. Non-blocking connects are started to every host, on
+ * both sync ports when scanBothPorts is set, with up to SCAN_WINDOW in flight at once. epoll
+ * reports each connect as it completes; the first one to succeed is taken and the rest are
+ * closed. An attempt with no answer after SCAN_CONNECT_MS is dropped to free its slot.
+ *
+ * Returns: The connected socket, or -1 if no simmgr answered
+ */
 int
-simCtlComm::wait(void )
+simCtlComm::scanSubnet(struct IPv4 *myIP )
 {
-	int len;
-	char buffer[SM_BUF_MAX];
-	int syncState = SYNC_NONE;
-	while ( 1 )
+	struct scanSlot
+	{
+		int fd;
+		int host;
+		int port;
+		long long deadline;
+	};
+	struct scanSlot slots[SCAN_WINDOW];
+	struct epoll_event events[SCAN_WINDOW];
+	struct sockaddr_in addr;
+	int ports[2];
+	int portCount;
+	int next = 0;		// Next candidate, as host index * portCount + port index
+	int candidates;
+	int inFlight = 0;
+	int found = -1;
+	int efd;
+	int count;
+	int valopt;
+	socklen_t lon;
+	long long now;
+	int i;
+	int s;
+
+	if ( scanBothPorts )
+	{
+		ports[0] = WVS_SYNC_PORT;
+		ports[1] = LINUX_SYNC_PORT;
+		portCount = 2;
+	}
+	else
+	{
+		ports[0] = commPort;
+		portCount = 1;
+	}
+	candidates = 254 * portCount;
+
+	efd = epoll_create1(EPOLL_CLOEXEC );
+	if ( efd < 0 )
+	{
+		sprintf(msgbuf, "comm.scanSubnet epoll_create1: %s", strerror(errno ) );
+		log_message("", msgbuf);
+		return ( -1 );
+	}
+	for ( s = 0 ; s < SCAN_WINDOW ; s++ )
 	{
-		memset(buffer, 0, SM_BUF_MAX );
-		len = read(commFD, buffer, SM_BUF_MAX-1 );
-		if ( len > 0 )
+		slots[s].fd = -1;
+	}
+
+	while ( found < 0 && ( next < candidates || inFlight > 0 ) )
+	{
+		now = scanNow();
+
+		// Fill the free slots with the next candidates
+		for ( s = 0 ; s < SCAN_WINDOW && next < candidates ; s++ )
 		{
-			if ( debug > 1 )
+			if ( slots[s].fd >= 0 )
 			{
-				printf("%s", buffer );
+				continue;
 			}
-			syncState = SYNC_NONE;
-			if ( strstr(buffer, "pulse" ) )
+			slots[s].host = ( next / portCount ) + 1;
+			slots[s].port = ports[next % portCount];
+			next++;
+			if ( slots[s].host == myIP->b4 ) // Don't scan our own address
 			{
-				syncState |= SYNC_PULSE;
+				s--;
+				continue;
 			}
-			if ( strstr(buffer, "pulseVPC" ) )
+			slots[s].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+			if ( slots[s].fd < 0 )
 			{
-				syncState |= SYNC_PULSE_VPC;
+				break;
 			}
-			if (  strstr(buffer, "breath" )  )
+			memset(&addr, 0, sizeof(addr) );
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(slots[s].port );
+			addr.sin_addr.s_addr = myIP->b1 | ( myIP->b2 << 8 ) | ( myIP->b3 << 16 ) | ( (unsigned int)slots[s].host << 24 );
+			if ( connect(slots[s].fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 && errno != EINPROGRESS )
 			{
-				syncState |= SYNC_BREATH;
+				// Refused or unreachable at once
+				close(slots[s].fd );
+				slots[s].fd = -1;
+				continue;
 			}
-			if (  strstr(buffer, "statusPort" )  )
+			events[0].events = EPOLLOUT;
+			events[0].data.u32 = s;
+			epoll_ctl(efd, EPOLL_CTL_ADD, slots[s].fd, &events[0] );
+			slots[s].deadline = now + SCAN_CONNECT_MS;
+			inFlight++;
+		}
+		if ( inFlight == 0 )
+		{
+			continue;
+		}
+
+		count = epoll_wait(efd, events, SCAN_WINDOW, SCAN_POLL_MS );
+		for ( i = 0 ; i < count ; i++ )
+		{
+			s = events[i].data.u32;
+			if ( slots[s].fd < 0 )
 			{
-				char *ptr;
-				
-				ptr = strchr(buffer, ':' );
-				if ( ptr )
-				{
-					ptr++;
-					this->simMgrStatusPort = atoi(ptr );
-					syncState |= SYNC_STATUS_PORT;
-				}
+				continue;
 			}
-			if (  strstr(buffer, "version" )  )
+			lon = sizeof(int);
+			valopt = -1;
+			getsockopt(slots[s].fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon );
+			if ( valopt == 0 && found < 0 )
 			{
-				// Write back the version
-				sprintf(buffer, "%s", SIMCTL_VERSION );
-				len = write(commFD, buffer, strlen(buffer) );
+				found = s;
+				continue;
 			}
-			if ( syncState != SYNC_NONE )
+			// Anything else just means the polled address is not a SimManager.
+			close(slots[s].fd );
+			slots[s].fd = -1;
+			inFlight--;
+		}
+
+		// Give up on hosts that have not answered
+		now = scanNow();
+		for ( s = 0 ; s < SCAN_WINDOW ; s++ )
+		{
+			if ( slots[s].fd >= 0 && s != found && now >= slots[s].deadline )
 			{
-				return ( syncState );
+				close(slots[s].fd );
+				slots[s].fd = -1;
+				inFlight--;
 			}
 		}
-		else
+	}
+	for ( s = 0 ; s < SCAN_WINDOW ; s++ )
+	{
+		if ( slots[s].fd >= 0 && s != found )
 		{
-			// Check if closed and try to reopen
-			buffer[0] = 'P';
-			
-			len = write(commFD, buffer, 1 );
-			if ( ( len < 0 )  ||  ( errno == EPIPE ) )
-			{
-				// Leave barkState as TRUE, to prevent additional barks.
-				connectState = FALSE;
-				
-				//close(commFD );
-				
-				sprintf(msgbuf, "Closed - Reopen Pipe" );
-				log_message("", msgbuf);
-				int sts = this->reopen();
-				if ( sts )
+			close(slots[s].fd );
+		}
+	}
+	close(efd );
+	if ( found < 0 )
+	{
+		return ( -1 );
+	}
+
+	commPort = slots[found].port;
+	sprintf(currentHostAddr, "%d.%d.%d.%d", myIP->b1, myIP->b2, myIP->b3, slots[found].host );
+	memcpy(simMgrIPAddr, currentHostAddr, SIM_IP_ADDR_SIZE );
+	sprintf(msgbuf, "Found simMgr at %s:%d\n", currentHostAddr, commPort );
+	log_message("", msgbuf);
+	barkState = TRUE;
+	int enableKeepAlive = 1;
+	setsockopt(slots[found].fd, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enableKeepAlive, sizeof(enableKeepAlive));
+
+	return ( slots[found].fd );
+}
+
+/*
+ * Function: scanNow
+ *
+ * Returns: CLOCK_MONOTONIC time in msec
+ */
+long long
+simCtlComm::scanNow(void )
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+/*
+ * Function: tryLastSimMgr
+ *
+ * Try the simmgr address found by the last scan, from SIM_MGR_LAST_FILE.
+ *
+ * Returns: The connected socket, or -1
+ */
+int
+simCtlComm::tryLastSimMgr(void )
+{
+	FILE *fd;
+	char hostAddr[SIM_IP_ADDR_SIZE];
+	int port;
+	int savedPort = commPort;
+	int sts;
+	int sock;
+
+	fd = fopen(SIM_MGR_LAST_FILE, "r" );
+	if ( fd == NULL )
+	{
+		return ( -1 );
+	}
+	memset(hostAddr, 0, SIM_IP_ADDR_SIZE );
+	sts = fscanf(fd, "%31[0-9.]:%d", hostAddr, &port );
+	fclose(fd );
+	if ( sts != 2 )
+	{
+		return ( -1 );
+	}
+	if ( scanBothPorts )
+	{
+		if ( port != WVS_SYNC_PORT && port != LINUX_SYNC_PORT )
+		{
+			return ( -1 );
+		}
+		commPort = port;
+	}
+	else if ( port != commPort )
+	{
+		return ( -1 );
+	}
+	sock = this->trySimMgrOpen(hostAddr );
+	if ( sock <= 0 )
+	{
+		commPort = savedPort;
+		return ( -1 );
+	}
+	return ( sock );
+}
+
+/*
+ * Function: saveLastSimMgr
+ *
+ * Record the current simmgr address and port, to be tried first on the next start.
+ */
+void
+simCtlComm::saveLastSimMgr(void )
+{
+	FILE *fd;
+
+	fd = fopen(SIM_MGR_LAST_FILE, "w" );
+	if ( fd == NULL )
+	{
+		if ( debug )
+		{
+			sprintf(msgbuf, "comm.saveLastSimMgr %s: %s", SIM_MGR_LAST_FILE, strerror(errno ) );
+			log_message("", msgbuf);
+		}
+		return;
+	}
+	fprintf(fd, "%s:%d\n", currentHostAddr, commPort );
+	fclose(fd );
+}
+
+#define SM_BUF_MAX	32
+
+// epoll tags for the two descriptors wait() sleeps on
+#define SYNC_EV_LINK	1
+#define SYNC_EV_TIMER	2
+
+/*
+ * Function: waitStart
+ *
+ * Create the epoll set and timer used by wait(), and register the link opened by openListen().
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int
+simCtlComm::waitStart(void )
+{
+	struct epoll_event ev;
+
+	epollFD = epoll_create1(EPOLL_CLOEXEC );
+	if ( epollFD < 0 )
+	{
+		sprintf(msgbuf, "comm.wait epoll_create1: %s", strerror(errno ) );
+		log_message("", msgbuf);
+		return ( -1 );
+	}
+	timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if ( timerFD < 0 )
+	{
+		sprintf(msgbuf, "comm.wait timerfd_create: %s", strerror(errno ) );
+		log_message("", msgbuf);
+		close(epollFD );
+		epollFD = -1;
+		return ( -1 );
+	}
+	memset(&ev, 0, sizeof(ev) );
+	ev.events = EPOLLIN;
+	ev.data.u32 = SYNC_EV_TIMER;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &ev );
+
+	linkUp(commFD );
+	return ( 0 );
+}
+
+/*
+ * Function: timerSet
+ *
+ * Arm the wait() timer. With periodic set, it repeats every ms; otherwise it fires once.
+ */
+void
+simCtlComm::timerSet(int ms, int periodic )
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its) );
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = ( ms % 1000 ) * 1000000L;
+	if ( periodic )
+	{
+		its.it_interval = its.it_value;
+	}
+	timerfd_settime(timerFD, 0, &its, NULL );
+}
+
+/*
+ * Function: linkUp
+ *
+ * Take a newly connected socket as the sync link. Turns on TCP keepalive, so a peer that
+ * goes away without closing is found in a few seconds, and starts the idle heartbeat.
+ */
+void
+simCtlComm::linkUp(int fd )
+{
+	struct epoll_event ev;
+	int opt;
+
+	commFD = fd;
+	opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt) );
+	opt = SYNC_KEEPALIVE_IDLE;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt) );
+	opt = SYNC_KEEPALIVE_INTVL;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt) );
+	opt = SYNC_KEEPALIVE_CNT;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt) );
+	opt = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt) );
+
+	// Reads are done only when epoll reports data
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL ) | O_NONBLOCK );
+
+	memset(&ev, 0, sizeof(ev) );
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u32 = SYNC_EV_LINK;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev );
+
+	connectState = TRUE;
+	linkIdle = false;
+	backoffMs = SYNC_BACKOFF_MIN_MS;
+	reopenTries = 0;
+	timerSet(SYNC_HEARTBEAT_MS, 1 );
+}
+
+/*
+ * Function: linkDown
+ *
+ * Drop a failed link and start the reconnect timer.
+ */
+void
+simCtlComm::linkDown(void )
+{
+	// Leave barkState as TRUE, to prevent additional barks.
+	connectState = FALSE;
+	if ( commFD >= 0 )
+	{
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, commFD, NULL );
+		close(commFD );
+		commFD = -1;
+	}
+	rxLen = 0;
+	rxSeqValid = false;
+	framedVersion = 0;
+	sprintf(msgbuf, "Closed - Reopen Pipe" );
+	log_message("", msgbuf);
+
+	// The first retry is immediate, so a pulse is not lost to a brief drop
+	linkRetry();
+}
+
+/*
+ * Function: linkRetry
+ *
+ * Try to reconnect to the last simmgr address. On failure, the reconnect timer is set with an
+ * exponential backoff. After SYNC_REOPEN_TRIES failures the subnet is scanned again.
+ */
+void
+simCtlComm::linkRetry(void )
+{
+	int fd;
+	int sts;
+
+	fd = this->trySimMgrOpen(currentHostAddr );
+	if ( fd > 0 )
+	{
+		sprintf(msgbuf, "reopened simMgr at %s\n", currentHostAddr );
+		log_message("", msgbuf);
+		linkUp(fd );
+		return;
+	}
+	if ( ++reopenTries < SYNC_REOPEN_TRIES )
+	{
+		timerSet(backoffMs, 0 );
+		backoffMs *= 2;
+		if ( backoffMs > SYNC_BACKOFF_MAX_MS )
+		{
+			backoffMs = SYNC_BACKOFF_MAX_MS;
+		}
+		return;
+	}
+	sprintf(msgbuf, "Reopen Failed - Rescan" );
+	log_message("", msgbuf);
+
+	// openListen retries until the simmgr is found
+	sts = this->openListen(LISTEN_ACTIVE );
+	sprintf(msgbuf, "openListen returns %d", sts );
+	log_message("", msgbuf);
+	if ( sts == 0 )
+	{
+		linkUp(commFD );
+	}
+	else
+	{
+		reopenTries = 0;
+		timerSet(SYNC_BACKOFF_MAX_MS, 0 );
+	}
+}
+
+/*
+ * Function: eventPush
+ *
+ * Queue a text protocol event for waitEvent()
+ */
+void
+simCtlComm::eventPush(int flags, long long rxTime )
+{
+	struct syncEvent *ev;
+
+	ev = &events[( eventHead + eventCount ) % SYNC_EVENTS_MAX];
+	memset(ev, 0, sizeof(struct syncEvent) );
+	ev->flags = flags;
+	ev->rxTime = rxTime;
+	eventCount++;
+}
+
+/*
+ * Function: sendFrame
+ *
+ * Send a binary frame to the sim-mgr. extraLen bytes from extra are sent after the fixed fields.
+ *
+ * Returns: The send() result
+ */
+int
+simCtlComm::sendFrame(int type, unsigned int seq, long long time, int value, const void *extra, int extraLen )
+{
+	unsigned char frame[SYNC_FRAME_MAX];
+	int len;
+	int sts;
+	uint16_t len16;
+	uint32_t seq32;
+	uint64_t time64;
+	uint32_t val32;
+
+	if ( extraLen > SYNC_FRAME_MAX - SYNC_FRAME_MIN )
+	{
+		extraLen = SYNC_FRAME_MAX - SYNC_FRAME_MIN;
+	}
+	len = SYNC_FRAME_MIN + extraLen;
+	memset(frame, 0, SYNC_FRAME_MIN );
+	frame[0] = SYNC_FRAME_MAGIC;
+	frame[1] = SYNC_FRAME_VERSION;
+	len16 = htole16(len );
+	memcpy(&frame[2], &len16, 2 );
+	frame[4] = type;
+	seq32 = htole32(seq );
+	memcpy(&frame[8], &seq32, 4 );
+	time64 = htole64(time );
+	memcpy(&frame[12], &time64, 8 );
+	val32 = htole32(value );
+	memcpy(&frame[20], &val32, 4 );
+	if ( extraLen > 0 )
+	{
+		memcpy(&frame[SYNC_FRAME_MIN], extra, extraLen );
+	}
+	sts = send(commFD, frame, len, MSG_NOSIGNAL );
+	if ( sts < 0 && debug )
+	{
+		sprintf(msgbuf, "comm.sendFrame: %s", strerror(errno ) );
+		log_message("", msgbuf);
+	}
+	return ( sts );
+}
+
+/*
+ * Function: clockReset
+ *
+ * Forget the clock exchanges, when the sim-mgr (and so maybe its clock) changes.
+ */
+void
+simCtlComm::clockReset(void )
+{
+	clockFilterCount = 0;
+	clockPointCount = 0;
+	clockReqTime = 0;
+	clockDrift = 0;
+}
+
+/*
+ * Function: clockRequest
+ *
+ * Start a clock exchange. A request still unanswered is dropped.
+ *
+ * Returns: The send() result
+ */
+int
+simCtlComm::clockRequest(void )
+{
+	clockReqSeq++;
+	clockReqTime = ainNow() / 1000;
+	return ( sendFrame(SYNC_FRAME_TIME_REQ, clockReqSeq, clockReqTime, 0, NULL, 0 ) );
+}
+
+/*
+ * Function: clockUpdate
+ *
+ * Add a completed clock exchange and publish the new estimate.
+ *
+ * Parameters: t1 - request sent, our time
+ *             t2 - request received, sim-mgr time
+ *             t3 - response sent, sim-mgr time
+ *             t4 - response received, our time
+ */
+void
+simCtlComm::clockUpdate(long long t1, long long t2, long long t3, long long t4 )
+{
+	struct clockSample sample;
+	struct clockSample *best;
+	struct clockSample *p;
+	struct clockSync cs;
+	long long x0;
+	long long y0;
+	double meanX = 0;
+	double meanY = 0;
+	double sxx = 0;
+	double sxy = 0;
+	double slope;
+	int count = 0;
+	int good;
+	int i;
+
+	sample.rtt = ( t4 - t1 ) - ( t3 - t2 );
+	if ( sample.rtt < 0 )
+	{
+		return;
+	}
+	sample.offset = ( ( t2 - t1 ) + ( t3 - t4 ) ) / 2;
+	sample.local = t1 + ( t4 - t1 ) / 2;
+
+	if ( clockValid && clockFilterCount > 0 &&
+		 llabs(sample.offset - ( clockOffset + ( ( sample.local - clockUpdated ) * clockDrift ) / 1000000000LL ) ) > CLOCK_STEP_US &&
+		 sample.rtt < CLOCK_STEP_US )
+	{
+		// The sim-mgr clock was stepped or restarted
+		sprintf(msgbuf, "comm: sim-mgr clock moved, offset %lld usec - restarting estimate", sample.offset );
+		log_message("", msgbuf);
+		clockReset();
+		clockValid = false;
+	}
+
+	// The lowest round trip ages upward, so a lasting change in the network is followed
+	if ( ! clockValid || sample.rtt < clockRttMin )
+	{
+		clockRttMin = sample.rtt;
+	}
+	else
+	{
+		clockRttMin += CLOCK_RTT_AGE_US;
+	}
+
+	// The filter keeps the last CLOCK_FILTER_LEN exchanges, oldest first
+	if ( clockFilterCount == CLOCK_FILTER_LEN )
+	{
+		memmove(&clockFilter[0], &clockFilter[1], sizeof(struct clockSample) * ( CLOCK_FILTER_LEN - 1 ) );
+		clockFilterCount--;
+	}
+	clockFilter[clockFilterCount++] = sample;
+	best = &clockFilter[0];
+	for ( i = 1 ; i < clockFilterCount ; i++ )
+	{
+		if ( clockFilter[i].rtt <= best->rtt )
+		{
+			best = &clockFilter[i];
+		}
+	}
+
+	// When every recent exchange was delayed, hold the last good offset and drift
+	good = ( best->rtt <= clockRttMin + CLOCK_RTT_SLACK_US );
+	if ( good || ! clockValid )
+	{
+		clockOffset = best->offset;
+		clockUpdated = best->local;
+		clockRtt = best->rtt;
+	}
+	if ( good && ( clockPointCount == 0 || best->local - clockPoints[clockPointCount-1].local >= CLOCK_DRIFT_GAP_US ) )
+	{
+		if ( clockPointCount == CLOCK_DRIFT_LEN )
+		{
+			memmove(&clockPoints[0], &clockPoints[1], sizeof(struct clockSample) * ( CLOCK_DRIFT_LEN - 1 ) );
+			clockPointCount--;
+		}
+		clockPoints[clockPointCount++] = *best;
+
+		// Fit the drift to the offsets from exchanges near the lowest round trip
+		x0 = clockPoints[0].local;
+		y0 = clockPoints[0].offset;
+		for ( i = 0 ; i < clockPointCount ; i++ )
+		{
+			p = &clockPoints[i];
+			if ( p->rtt <= clockRttMin + CLOCK_RTT_SLACK_US )
+			{
+				meanX += p->local - x0;
+				meanY += p->offset - y0;
+				count++;
+			}
+		}
+		if ( count >= 3 && clockPoints[clockPointCount-1].local - clockPoints[0].local >= CLOCK_DRIFT_SPAN_US )
+		{
+			meanX /= count;
+			meanY /= count;
+			for ( i = 0 ; i < clockPointCount ; i++ )
+			{
+				p = &clockPoints[i];
+				if ( p->rtt <= clockRttMin + CLOCK_RTT_SLACK_US )
 				{
-					sprintf(msgbuf, "Reopen Failed - Rescan" );
-					log_message("", msgbuf);
-				
-					sts = this->openListen(1);
-					sprintf(msgbuf, "openListen returns %d", sts );
-					log_message("", msgbuf);
+					sxx += ( p->local - x0 - meanX ) * ( p->local - x0 - meanX );
+					sxy += ( p->local - x0 - meanX ) * ( p->offset - y0 - meanY );
 				}
 			}
+			slope = sxx > 0 ? ( sxy / sxx ) * 1e9 : 0;
+			if ( slope > -CLOCK_DRIFT_MAX_PPB && slope < CLOCK_DRIFT_MAX_PPB )
+			{
+				clockDrift = (int)slope;
+			}
 		}
-		usleep(1000);
+	}
+	clockValid = true;
+	clockSamples++;
+
+	cs.valid = 1;
+	cs.offset = clockOffset;
+	cs.updated = clockUpdated;
+	cs.drift = clockDrift;
+	cs.rtt = clockRtt;
+	cs.rttMin = clockRttMin;
+	cs.samples = clockSamples;
+	clockSyncPublish(&cs );
+	if ( debug > 1 )
+	{
+		printf("clock offset %lld rtt %d drift %d ppb (sample offset %lld rtt %d)\n",
+				clockOffset, clockRtt, clockDrift, sample.offset, sample.rtt );
 	}
 }
+
+/*
+ * Function: rxFrame
+ *
+ * Decode one binary frame at the start of the receive buffer.
+ *
+ * Returns: Bytes used, 0 if the frame is not complete yet, or -1 if this is not a frame
+ */
 int
-simCtlComm::reopen(void)
+simCtlComm::rxFrame(const unsigned char *frame, int len, long long rxTime )
 {
-	int fd = commFD;
-	struct sockaddr_in addr;
-	long arg;
-	int res;
-	struct timeval tv;
-	fd_set myset; 
-	socklen_t lon;
-	int valopt;
-	int ldebug = debug;
-	
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(commPort );	
-	addr.sin_addr.s_addr = inet_addr(currentHostAddr); 
-		
-// Trying to connect with timeout 
-	res = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-	if ( res < 0 )
+	struct syncEvent *ev;
+	uint16_t len16;
+	uint32_t seq32;
+	uint64_t time64;
+	uint32_t val32;
+	int frameLen;
+	int type;
+	int value;
+	int flags;
+
+	if ( len < SYNC_FRAME_HEADER )
 	{
-		if (errno == EINPROGRESS)
-		{ 
-			//sprintf(msgbuf, (stderr, "EINPROGRESS in connect() - selecting\n"); 
-			//log_message("", msgbuf);
-			
-			tv.tv_sec = 0; 
-			tv.tv_usec = 10000; 
-			FD_ZERO(&myset); 
-			FD_SET(fd, &myset); 
-			res = select(fd+1, NULL, &myset, NULL, &tv); 
-			if (res < 0 && errno != EINTR)
-			{ 
-				//printf(msgbuf, "comm.openListen select(): %s", strerror(errno ) );
-				//log_message("", msgbuf);
-			} 
-			else if (res > 0)
-			{ 
-				// Socket selected for write 
-				lon = sizeof(int); 
-				if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0)
-				{ 
-					// fprintf(stderr, "Error in getsockopt() %d - %s\n", errno, strerror(errno)); 
-				} 
-				else
-				{
-					// Check the value returned... 
-					if (valopt) 
-					{
-						// This just means the polled address is not a SimManager. It did not answer on the port.
-						// sprintf(msgbuf, "Error in delayed connection() %d - %s\n", valopt, strerror(valopt) );
-						// log_message("", msgbuf);
-					}
-					else
-					{
-						sprintf(msgbuf, "reopened simMgr at %s\n", currentHostAddr );
-						log_message("", msgbuf);
-						barkState = TRUE;
-						int enableKeepAlive = 1;
-						setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enableKeepAlive, sizeof(enableKeepAlive));
+		return ( 0 );
+	}
+	memcpy(&len16, &frame[2], 2 );
+	frameLen = le16toh(len16 );
+	if ( frame[1] == 0 || frameLen < SYNC_FRAME_MIN || frameLen > SYNC_FRAME_MAX )
+	{
+		return ( -1 );
+	}
+	if ( len < frameLen )
+	{
+		return ( 0 );
+	}
+	type = frame[4];
+	memcpy(&seq32, &frame[8], 4 );
+	memcpy(&time64, &frame[12], 8 );
+	memcpy(&val32, &frame[20], 4 );
+	value = (int)le32toh(val32 );
 
-						return ( fd );
-					}
-				}
-			} 
-			else 
-			{ 
-				if ( ldebug )
+	switch ( type )
+	{
+		case SYNC_FRAME_HELLO:
+			framedVersion = value < SYNC_FRAME_VERSION ? value : SYNC_FRAME_VERSION;
+			rxSeqValid = false;
+			sendFrame(SYNC_FRAME_HELLO, 0, 0, SYNC_FRAME_VERSION, NULL, 0 );
+			sprintf(msgbuf, "comm: sim-mgr sync frames, version %d", framedVersion );
+			log_message("", msgbuf);
+			clockReset();
+			clockRequest();
+			return ( frameLen );
+
+		case SYNC_FRAME_TIME_RESP:
+			if ( frameLen >= SYNC_FRAME_MIN + 16 )
+			{
+				uint64_t t1;
+				uint64_t t2;
+
+				memcpy(&t1, &frame[SYNC_FRAME_MIN], 8 );
+				memcpy(&t2, &frame[SYNC_FRAME_MIN+8], 8 );
+				// Only the answer to the latest request; an older one waited in a queue
+				if ( clockReqTime != 0 && (long long)le64toh(t1 ) == clockReqTime )
 				{
-					sprintf(msgbuf, "Timeout in select()\n" );
-					log_message("", msgbuf);
+					clockUpdate(clockReqTime, (long long)le64toh(t2 ), (long long)le64toh(time64 ), rxTime / 1000 );
+					clockReqTime = 0;
 				}
-				// fprintf(stderr, "Timeout in select()\n");
-			} 
-		} 
-		else
-		{ 
-			fprintf(stderr, "Error Reconnecting %d - %s\n", errno, strerror(errno));  
-			sprintf(msgbuf, "comm.openListen Error connecting): %s", strerror(errno ) );
+			}
+			return ( frameLen );
+
+		case SYNC_FRAME_VERSION_REQ:
+			sendFrame(SYNC_FRAME_VERSION_REQ, 0, 0, 0, SIMCTL_VERSION, strlen(SIMCTL_VERSION ) );
+			return ( frameLen );
+
+		case SYNC_FRAME_PULSE:
+			flags = SYNC_PULSE;
+			break;
+
+		case SYNC_FRAME_PULSE_VPC:
+			flags = SYNC_PULSE | SYNC_PULSE_VPC;
+			break;
+
+		case SYNC_FRAME_BREATH:
+			flags = SYNC_BREATH;
+			break;
+
+		case SYNC_FRAME_STATUS_PORT:
+			this->simMgrStatusPort = value;
+			flags = SYNC_STATUS_PORT;
+			break;
+
+		case SYNC_FRAME_STATUS_CHANGE:
+			flags = SYNC_STATUS_CHANGE;
+			break;
+
+		default:
+			// From a newer sim-mgr
+			return ( frameLen );
+	}
+
+	ev = &events[( eventHead + eventCount ) % SYNC_EVENTS_MAX];
+	memset(ev, 0, sizeof(struct syncEvent) );
+	ev->flags = flags;
+	ev->framed = 1;
+	ev->seq = le32toh(seq32 );
+	ev->mgrTime = (long long)le64toh(time64 );
+	ev->rxTime = rxTime;
+	if ( rxSeqValid && (int)( ev->seq - rxSeq ) > 1 )
+	{
+		ev->lost = ev->seq - rxSeq - 1;
+		if ( debug )
+		{
+			sprintf(msgbuf, "comm: %u sync frames lost before seq %u", ev->lost, ev->seq );
 			log_message("", msgbuf);
-			return -1;
 		}
 	}
+	rxSeq = ev->seq;
+	rxSeqValid = true;
+	eventCount++;
+	return ( frameLen );
+}
+
+/*
+ * Function: syncTextDecode
+ *
+ * Decode one text protocol message at the start of text. Messages are not delimited:
+ * "pulse" may be the start of "pulseVPC", and a status port may go on in the next read.
+ * Unless final is set, such a message waits for more bytes. final is set once no more
+ * have come for SYNC_TEXT_HOLD_MS, and the message is then taken as it is.
+ *
+ * Parameters: flags - set to the SYNC_* flags of the message, SYNC_NONE for a version request
+ *             port - set to the port of a statusPort message
+ *
+ * Returns: Bytes used, 0 if the message may not be complete yet, or -1 if no message
+ *			starts here
+ */
+int
+syncTextDecode(const unsigned char *text, int len, int final, int *flags, int *port )
+{
+	// A word that another starts with must come after it
+	static const struct
+	{
+		const char *word;
+		int flags;
+	} words[] =
+	{
+		{ "pulseVPC",		SYNC_PULSE | SYNC_PULSE_VPC },
+		{ "pulse",			SYNC_PULSE },
+		{ "breath",			SYNC_BREATH },
+		{ "statusPort",		SYNC_STATUS_PORT },
+		{ "statusChange",	SYNC_STATUS_CHANGE },
+		{ "version",		SYNC_NONE },
+	};
+	unsigned int i;
+	int wordLen;
+	int used;
+
+	for ( i = 0 ; i < sizeof(words) / sizeof(words[0]) ; i++ )
+	{
+		wordLen = strlen(words[i].word );
+		if ( len < wordLen )
+		{
+			if ( ! final && memcmp(text, words[i].word, len ) == 0 )
+			{
+				return ( 0 );
+			}
+			continue;
+		}
+		if ( memcmp(text, words[i].word, wordLen ) != 0 )
+		{
+			continue;
+		}
+		used = wordLen;
+		if ( words[i].flags == SYNC_STATUS_PORT )
+		{
+			// statusPort:<port>
+			if ( used < len && text[used] == ':' )
+			{
+				used++;
+			}
+			*port = 0;
+			while ( used < len && isdigit(text[used] ) )
+			{
+				*port = *port * 10 + ( text[used] - '0' );
+				used++;
+			}
+			if ( used == len && ! final )
+			{
+				return ( 0 );
+			}
+		}
+		*flags = words[i].flags;
+		return ( used );
+	}
+	return ( -1 );
+}
+
+/*
+ * Function: rxText
+ *
+ * Act on one text protocol message at the start of the receive buffer. Several may
+ * arrive in one read; each becomes its own event.
+ *
+ * Returns: As syncTextDecode
+ */
+int
+simCtlComm::rxText(const unsigned char *text, int len, int final, long long rxTime )
+{
+	char buffer[SM_BUF_MAX];
+	int flags = SYNC_NONE;
+	int port = 0;
+	int used;
+
+	used = syncTextDecode(text, len, final, &flags, &port );
+	if ( used <= 0 )
+	{
+		return ( used );
+	}
+	if ( flags == SYNC_STATUS_PORT )
+	{
+		this->simMgrStatusPort = port;
+	}
+	if ( flags == SYNC_NONE )
+	{
+		// Write back the version
+		sprintf(buffer, "%s", SIMCTL_VERSION );
+		send(commFD, buffer, strlen(buffer), MSG_NOSIGNAL );
+	}
 	else
 	{
-		if ( ldebug )
+		eventPush(flags, rxTime );
+	}
+	return ( used );
+}
+
+/*
+ * Function: rxParse
+ *
+ * Turn the receive buffer into events. A message cut off at the end of the buffer is
+ * kept for the next read, or with final, a text message is taken as it is.
+ */
+void
+simCtlComm::rxParse(long long rxTime, int final )
+{
+	int pos = 0;
+	int used;
+
+	while ( pos < rxLen && eventCount < SYNC_EVENTS_MAX )
+	{
+		if ( rxBuf[pos] == SYNC_FRAME_MAGIC )
+		{
+			used = rxFrame(&rxBuf[pos], rxLen - pos, rxTime );
+		}
+		else
+		{
+			used = rxText(&rxBuf[pos], rxLen - pos, final, rxTime );
+		}
+		if ( used == 0 )
 		{
-			printf("res is %d\n", res );
+			break;
 		}
+		// Skip a byte that starts nothing we know
+		pos += ( used < 0 ) ? 1 : used;
 	}
-	// Set to blocking mode again... 
-	if( (arg = fcntl(fd, F_GETFL, NULL)) < 0)
-	{ 
-		fprintf(stderr, "Error fcntl(..., F_GETFL) (%s)\n", strerror(errno));
-		sprintf(msgbuf, "comm.openListen fcntl(F_GETFL) fails: %s", strerror(errno ) );
-		log_message("", msgbuf);
-	} 
-	arg &= (~O_NONBLOCK); 
-	if( fcntl(fd, F_SETFL, arg) < 0) 
-	{ 
-		fprintf(stderr, "Error fcntl(..., F_SETFL) (%s)\n", strerror(errno));
-		sprintf(msgbuf, "comm.openListen fcntl(F_SETFL) fails: %s", strerror(errno ) );
-		log_message("", msgbuf);
+	if ( pos == 0 && rxLen == SYNC_RX_MAX )
+	{
+		// Can not happen with a sane peer; drop the buffer rather than stall
+		pos = rxLen;
+	}
+	rxLen -= pos;
+	memmove(rxBuf, &rxBuf[pos], rxLen );
+}
+
+/*
+ * Function: wait
+ *
+ * Returns: The SYNC_* flags of the next sync event
+ */
+int
+simCtlComm::wait(void )
+{
+	struct syncEvent ev;
+
+	return ( waitEvent(&ev ) );
+}
+
+/*
+ * Function: waitEvent
+ *
+ * Sleep until the simmgr sends a sync message. The thread only wakes for link data, the
+ * idle heartbeat, or the reconnect timer; a 'P' probe is sent when the link has been idle
+ * for a heartbeat period. Each message is returned as a separate event, even when several
+ * arrive together.
+ *
+ * Returns: The SYNC_* flags of the event, also in ev->flags
+ */
+int
+simCtlComm::waitEvent(struct syncEvent *ev )
+{
+	int len;
+	char buffer[SM_BUF_MAX];
+	struct epoll_event epEvents[2];
+	uint64_t expirations;
+	long long rxTime;
+	int count;
+	int timeout;
+	int i;
+
+	if ( epollFD < 0 && waitStart() < 0 )
+	{
+		memset(ev, 0, sizeof(struct syncEvent) );
+		return ( SYNC_NONE );
+	}
+	while ( 1 )
+	{
+		if ( eventCount == 0 && rxLen > 0 )
+		{
+			// Left over when the event queue filled
+			rxParse(ainNow(), 0 );
+		}
+		if ( eventCount > 0 )
+		{
+			*ev = events[eventHead];
+			eventHead = ( eventHead + 1 ) % SYNC_EVENTS_MAX;
+			eventCount--;
+			return ( ev->flags );
+		}
+		// A text message at the end of the buffer may still be growing
+		timeout = ( rxLen > 0 && rxBuf[0] != SYNC_FRAME_MAGIC ) ? SYNC_TEXT_HOLD_MS : -1;
+		count = epoll_wait(epollFD, epEvents, 2, timeout );
+		if ( count == 0 )
+		{
+			// Nothing more came: take it as it is
+			rxParse(rxHeldTime, 1 );
+			continue;
+		}
+		if ( count < 0 )
+		{
+			if ( errno != EINTR )
+			{
+				sprintf(msgbuf, "comm.wait epoll_wait: %s", strerror(errno ) );
+				log_message("", msgbuf);
+				sleep(1);
+			}
+			continue;
+		}
+		rxTime = ainNow();
+		for ( i = 0 ; i < count ; i++ )
+		{
+			if ( epEvents[i].data.u32 == SYNC_EV_TIMER )
+			{
+				if ( read(timerFD, &expirations, sizeof(expirations) ) <= 0 )
+				{
+					continue;
+				}
+				if ( ! connectState )
+				{
+					linkRetry();
+				}
+				else if ( framedVersion > 0 )
+				{
+					// The clock exchange also checks the link
+					if ( clockRequest() < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+					{
+						linkDown();
+					}
+				}
+				else if ( linkIdle )
+				{
+					// Check if closed
+					buffer[0] = 'P';
+					len = send(commFD, buffer, 1, MSG_NOSIGNAL );
+					if ( len < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+					{
+						linkDown();
+					}
+				}
+				else
+				{
+					linkIdle = true;
+				}
+				continue;
+			}
+			if ( commFD < 0 || rxLen >= SYNC_RX_MAX )
+			{
+				// Link was dropped earlier in this batch, or the queue is full
+				continue;
+			}
+			len = read(commFD, &rxBuf[rxLen], SYNC_RX_MAX - rxLen );
+			if ( len == 0 || ( len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+			{
+				linkDown();
+				continue;
+			}
+			if ( len < 0 )
+			{
+				continue;
+			}
+			linkIdle = false;
+			if ( debug > 1 )
+			{
+				printf("%.*s", len, (char *)&rxBuf[rxLen] );
+			}
+			rxLen += len;
+			rxParse(rxTime, 0 );
+			rxHeldTime = rxTime;
+		}
 	}
-	return ( 0 );
 }
 int
 simCtlComm::closeListen(void)
 {
-	if ( commFD )
+	if ( commFD >= 0 )
 	{
 		close(commFD );
-		commFD = 0;
+		commFD = -1;
+	}
+	if ( timerFD >= 0 )
+	{
+		close(timerFD );
+		timerFD = -1;
+	}
+	if ( epollFD >= 0 )
+	{
+		close(epollFD );
+		epollFD = -1;
 	}
+	connectState = FALSE;
 	return ( 0 );
 }
 
@@ -31,6 +31,85 @@
 #define SYNC_PULSE_VPC		2
 #define SYNC_BREATH			4
 #define SYNC_STATUS_PORT	8
+#define SYNC_STATUS_CHANGE	16
+
+// Binary sync frames. A frame starts with SYNC_FRAME_MAGIC, a byte that never appears in
+// the text protocol, so the sim-mgr may send either on the same socket. It switches to
+// frames by sending SYNC_FRAME_HELLO, which is answered with our own HELLO. Fields are
+// little endian:
+//	magic(1) version(1) length(2) type(1) flags(1) reserved(2) seq(4) time(8) value(4)
+// length is the whole frame. Bytes past the fixed fields are skipped, except in a reply
+// to SYNC_FRAME_VERSION_REQ where they carry SIMCTL_VERSION, and in SYNC_FRAME_TIME_RESP.
+// time is in usec on a clock of the sim-mgr's choosing, the same one for every frame.
+#define SYNC_FRAME_MAGIC		0xA5
+#define SYNC_FRAME_VERSION		1
+#define SYNC_FRAME_HEADER		4		// magic, version and length
+#define SYNC_FRAME_MIN			24		// Header and fixed fields
+#define SYNC_FRAME_MAX			256
+
+#define SYNC_FRAME_HELLO		1		// value: highest frame version supported
+#define SYNC_FRAME_PULSE		2
+#define SYNC_FRAME_PULSE_VPC	3
+#define SYNC_FRAME_BREATH		4
+#define SYNC_FRAME_STATUS_PORT	5		// value: the status port
+#define SYNC_FRAME_STATUS_CHANGE 6
+#define SYNC_FRAME_VERSION_REQ	7
+#define SYNC_FRAME_TIME_REQ		8		// From sim-ctl. time: our send time (t1), CLOCK_MONOTONIC
+#define SYNC_FRAME_TIME_RESP	9		// time: sim-mgr send time (t3). Followed by t1 as
+										// received and the sim-mgr receive time (t2), 8 bytes each
+
+#define SYNC_RX_MAX				512		// Receive buffer, for messages split across reads
+#define SYNC_TEXT_HOLD_MS		10		// Wait for the rest of a text message that may be cut off
+#define SYNC_EVENTS_MAX			128		// Events parsed but not yet returned by waitEvent()
+
+struct syncEvent
+{
+	int flags;					// SYNC_* flags of the event
+	int framed;					// From a binary frame; seq and mgrTime are set
+	unsigned int seq;
+	unsigned int lost;			// Frames missing from the sequence just before this one
+	long long mgrTime;			// sim-mgr event time, usec
+	long long rxTime;			// CLOCK_MONOTONIC nsec when the event was read
+};
+
+// Clock offset estimate, from the TIME_REQ/TIME_RESP exchanges. Each exchange gives an
+// offset and a round trip; the offset of the exchange with the lowest round trip in the
+// last CLOCK_FILTER_LEN is used, as it had the least queueing delay. If even that one is
+// well above the lowest round trip seen, the last good offset is kept. The drift is the
+// slope of the good offsets over time.
+#define CLOCK_FILTER_LEN		8
+#define CLOCK_DRIFT_LEN			16		// Filtered offsets the drift is fitted over
+#define CLOCK_DRIFT_SPAN_US		30000000LL	// Shortest span for a drift estimate
+// Shortest time between drift points, so a full set of them covers the span
+#define CLOCK_DRIFT_GAP_US		( CLOCK_DRIFT_SPAN_US / ( CLOCK_DRIFT_LEN - 1 ) )
+#define CLOCK_DRIFT_MAX_PPB		500000	// Larger drift is taken as a bad fit
+#define CLOCK_STEP_US			100000	// An offset change this large restarts the estimate
+#define CLOCK_RTT_SLACK_US		500		// Round trip above the lowest that is still good
+#define CLOCK_RTT_AGE_US		10		// Rise of the lowest round trip per exchange
+
+struct clockSample
+{
+	long long local;			// Our CLOCK_MONOTONIC time of the exchange, usec
+	long long offset;			// sim-mgr time minus ours, usec
+	int rtt;					// usec
+};
+
+// Sync link upkeep, used by wait()
+#define SYNC_HEARTBEAT_MS		1000	// Send a 'P' probe when the link is idle this long, or
+										// with frames, a clock exchange
+#define SYNC_KEEPALIVE_IDLE		2		// TCP keepalive: idle seconds before the first probe
+#define SYNC_KEEPALIVE_INTVL	1		// TCP keepalive: seconds between probes
+#define SYNC_KEEPALIVE_CNT		3		// TCP keepalive: unanswered probes before the link fails
+#define SYNC_BACKOFF_MIN_MS		50		// First reconnect delay, doubled on each failure
+#define SYNC_BACKOFF_MAX_MS		5000
+#define SYNC_REOPEN_TRIES		8		// Reconnects to the last address before a rescan
+
+// Subnet scan, used by openListen() when no simmgr name is set
+#define SCAN_WINDOW			256		// Connects in flight at once
+#define SCAN_CONNECT_MS		250		// Drop an unanswered connect after this long
+#define SCAN_POLL_MS		10
+#define SCAN_RETRY_US		100000	// Delay before scanning again when none is found
+#define SIM_MGR_LAST_FILE	"/simulator/simmgrLast"	// Address and port found by the last scan
 
 #define SIM_IP_ADDR_SIZE 32
 #define SIM_NAME_SIZE	512
@@ -40,6 +119,14 @@
 #ifndef FALSE
 #define FALSE	false
 #endif
+struct IPv4
+{
+	unsigned char b1;
+	unsigned char b2;
+	unsigned char b3;
+	unsigned char b4;
+};
+
 class simCtlComm {
 
 private:
@@ -47,8 +134,47 @@ private:
 	int commPort;
 	int trySimMgrOpen(char *name );
 	bool scanBothPorts = true;
-	int reopen(void );
 	char currentHostAddr[32];
+	int scanSubnet(struct IPv4 *myIP );
+	long long scanNow(void );
+	int tryLastSimMgr(void );
+	void saveLastSimMgr(void );
+
+	// wait() event loop
+	int epollFD = -1;
+	int timerFD = -1;
+	int backoffMs = SYNC_BACKOFF_MIN_MS;
+	int reopenTries = 0;
+	bool linkIdle = false;		// No data since the last heartbeat tick
+	int waitStart(void );
+	void timerSet(int ms, int periodic );
+	void linkUp(int fd );
+	void linkDown(void );
+	void linkRetry(void );
+
+	// Sync message parsing
+	unsigned char rxBuf[SYNC_RX_MAX];
+	int rxLen = 0;
+	struct syncEvent events[SYNC_EVENTS_MAX];
+	int eventHead = 0;
+	int eventCount = 0;
+	unsigned int rxSeq = 0;
+	bool rxSeqValid = false;
+	long long rxHeldTime = 0;	// When the bytes left in rxBuf were read
+	void rxParse(long long rxTime, int final );
+	int rxFrame(const unsigned char *frame, int len, long long rxTime );
+	int rxText(const unsigned char *text, int len, int final, long long rxTime );
+	void eventPush(int flags, long long rxTime );
+	int sendFrame(int type, unsigned int seq, long long time, int value, const void *extra, int extraLen );
+
+	// Clock offset estimate
+	struct clockSample clockFilter[CLOCK_FILTER_LEN];
+	int clockFilterCount = 0;
+	struct clockSample clockPoints[CLOCK_DRIFT_LEN];
+	int clockPointCount = 0;
+	unsigned int clockReqSeq = 0;
+	long long clockReqTime = 0;		// t1 of the outstanding request
+	int clockRequest(void );
 	
 public:
 	simCtlComm();
@@ -57,6 +183,7 @@ public:
 	int openListen(int active );	// If Active is set, the port stays open. Otherwise, this is simply used to discover the simmgr
 	int closeListen(void );
 	int wait(void );
+	int waitEvent(struct syncEvent *ev );
 	void show(void );
 	
 
@@ -65,15 +192,26 @@ public:
 	char simMgrName[SIM_NAME_SIZE];
 	char simMgrIPAddr[SIM_IP_ADDR_SIZE];
 	int  simMgrStatusPort;
+	int  framedVersion = 0;		// Binary frame version in use, 0 for the text protocol
+
+	// Latest clock offset estimate, also published in shmData->clockSync
+	bool clockValid = false;
+	long long clockOffset = 0;		// usec, sim-mgr time minus ours at clockUpdated
+	long long clockUpdated = 0;		// Our CLOCK_MONOTONIC time of the offset, usec
+	int  clockDrift = 0;			// parts per billion
+	int  clockRtt = 0;				// usec, round trip of the exchange the offset came from
+	int  clockRttMin = 0;
+	unsigned int clockSamples = 0;
+	
+	// Clock exchange results, from rxFrame. Public so test/clock_sync_test can run the
+	// estimate without a link.
+	void clockReset(void );
+	void clockUpdate(long long t1, long long t2, long long t3, long long t4 );
 	virtual ~simCtlComm();
 };
 
-struct IPv4
-{
-	unsigned char b1;
-	unsigned char b2;
-	unsigned char b3;
-	unsigned char b4;
-};
+// Text protocol decode, used by rxText
+int syncTextDecode(const unsigned char *text, int len, int final, int *flags, int *port );
+
 	
 #endif /* SIMCTLCOMM_H_ */
\ No newline at end of file
@@ -0,0 +1,305 @@
+/*
+ * simFields.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Field descriptor tables for the shmData sub-structs. The cardiac, respiration
+ * and eyes tables are the sim-mgr status sections; each table is indexed by a
+ * perfect hash that is found at compile time, so a key is resolved with one hash
+ * and one strcmp. Adding a field to a struct only needs a table entry here.
+ *
+ * The position of a field in its table is also its bit in the shmData dirty
+ * masks, see SHM_BIT.
+*/
+
+#ifndef SIMFIELDS_H_
+#define SIMFIELDS_H_
+
+#include <stddef.h>
+#include "shmData.h"
+
+#define FIELD_INT		0	// int, atoi of the value
+#define FIELD_STR		1	// char[STR_SIZE]
+#define FIELD_PULSE		2	// int, from "none", "weak", "medium" or "strong"
+
+struct simField
+{
+	const char *name;
+	int offset;
+	int type;
+	int flags;
+};
+
+#define FIELD_LOG		1	// Print the new value in debug mode
+#define FIELD_ALWAYS	2	// Command flag, apply on every read even if the text is unchanged
+#define FIELD_LOCAL		4	// Set by sim-ctl only. Has a dirty bit, but is not accepted from the sim-mgr
+
+#define SIM_FIELD_SLOTS		64	// Power of two, larger than any table
+
+struct simFieldIndex
+{
+	unsigned int seed;					// 0 if no perfect hash was found
+	signed char slot[SIM_FIELD_SLOTS];	// Index into the table, or -1
+};
+
+struct simFieldTable
+{
+	const char *section;
+	const struct simField *fields;
+	int count;
+	const struct simFieldIndex *index;
+};
+
+// FNV-1a, with the seed mixed into the offset basis
+constexpr unsigned int
+simFieldHash(const char *str, unsigned int seed )
+{
+	unsigned int hash = 2166136261u ^ seed;
+	while ( *str )
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return ( hash ^ ( hash >> 15 ) );
+}
+
+// Search for the first seed that maps every name to its own slot.
+template <int N>
+constexpr struct simFieldIndex
+simFieldIndexBuild(const struct simField (&fields)[N] )
+{
+	struct simFieldIndex index = { 0, { 0 } };
+	unsigned int seed = 0;
+	unsigned int h = 0;
+	int i = 0;
+	int ok = 0;
+
+	for ( seed = 1 ; seed < 100000 ; seed++ )
+	{
+		for ( i = 0 ; i < SIM_FIELD_SLOTS ; i++ )
+		{
+			index.slot[i] = -1;
+		}
+		ok = 1;
+		for ( i = 0 ; i < N && ok ; i++ )
+		{
+			h = simFieldHash(fields[i].name, seed ) & ( SIM_FIELD_SLOTS - 1 );
+			if ( index.slot[h] >= 0 )
+			{
+				ok = 0;
+			}
+			else
+			{
+				index.slot[h] = i;
+			}
+		}
+		if ( ok )
+		{
+			index.seed = seed;
+			return ( index );
+		}
+	}
+	return ( index );
+}
+
+#define FIELD(st, name, type, flags)	{ #name, offsetof(struct st, name), type, flags }
+
+constexpr struct simField cardiacFields[] =
+{
+	FIELD(cardiac, rhythm,							FIELD_STR, FIELD_LOG ),
+	FIELD(cardiac, vpc,								FIELD_STR, FIELD_LOG ),
+	FIELD(cardiac, pea,								FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, vpc_freq,						FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, vfib_amplitude,					FIELD_STR, FIELD_LOG ),
+	FIELD(cardiac, pwave,							FIELD_STR, FIELD_LOG ),
+	FIELD(cardiac, rate,							FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, pr_interval,						FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, qrs_interval,					FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, bps_sys,							FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, bps_dia,							FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, nibp_rate,						FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, nibp_read,						FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, nibp_freq,						FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, heart_sound_volume,				FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, heart_sound_mute,				FIELD_INT, FIELD_LOG ),
+	FIELD(cardiac, heart_sound,						FIELD_STR, FIELD_LOG ),
+	FIELD(cardiac, right_dorsal_pulse_strength,		FIELD_PULSE, FIELD_LOG ),
+	FIELD(cardiac, left_dorsal_pulse_strength,		FIELD_PULSE, FIELD_LOG ),
+	FIELD(cardiac, right_femoral_pulse_strength,	FIELD_PULSE, FIELD_LOG ),
+	FIELD(cardiac, left_femoral_pulse_strength,		FIELD_PULSE, FIELD_LOG ),
+};
+
+constexpr struct simField respirationFields[] =
+{
+	FIELD(respiration, inhalation_duration,		FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, exhalation_duration,		FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, left_lung_sound_volume,	FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, left_lung_sound_mute,	FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, right_lung_sound_volume,	FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, right_lung_sound_mute,	FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, left_lung_sound,			FIELD_STR, FIELD_LOG ),
+	FIELD(respiration, right_lung_sound,		FIELD_STR, FIELD_LOG ),
+	FIELD(respiration, rate,					FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, awRR,					FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, chest_movement,			FIELD_INT, FIELD_LOG ),
+	FIELD(respiration, manual_breath,			FIELD_INT, FIELD_LOCAL ),
+	FIELD(respiration, active,					FIELD_INT, FIELD_LOCAL ),
+	FIELD(respiration, breath_count,			FIELD_INT, FIELD_LOCAL ),
+	FIELD(respiration, breath_duration,			FIELD_INT, FIELD_LOCAL ),
+	FIELD(respiration, breath_volume,			FIELD_INT, FIELD_LOCAL ),
+};
+
+constexpr struct simField eyesFields[] =
+{
+	FIELD(eyes, right_state,			FIELD_INT, 0 ),
+	FIELD(eyes, right_lid,				FIELD_INT, 0 ),
+	FIELD(eyes, right_move,				FIELD_INT, 0 ),
+	FIELD(eyes, right_position,			FIELD_INT, 0 ),
+	FIELD(eyes, right_blink,			FIELD_INT, 0 ),
+	FIELD(eyes, right_pupil,			FIELD_INT, 0 ),
+	FIELD(eyes, left_state,				FIELD_INT, 0 ),
+	FIELD(eyes, left_lid,				FIELD_INT, 0 ),
+	FIELD(eyes, left_move,				FIELD_INT, 0 ),
+	FIELD(eyes, left_position,			FIELD_INT, 0 ),
+	FIELD(eyes, left_blink,				FIELD_INT, 0 ),
+	FIELD(eyes, left_pupil,				FIELD_INT, 0 ),
+	FIELD(eyes, right_plr_exposed,		FIELD_INT, 0 ),
+	FIELD(eyes, right_plr_consensual,	FIELD_INT, 0 ),
+	FIELD(eyes, right_menace,			FIELD_INT, 0 ),
+	FIELD(eyes, right_palpebral,		FIELD_INT, 0 ),
+	FIELD(eyes, right_nystagmus,		FIELD_INT, 0 ),
+	FIELD(eyes, left_plr_exposed,		FIELD_INT, 0 ),
+	FIELD(eyes, left_plr_consensual,	FIELD_INT, 0 ),
+	FIELD(eyes, left_menace,			FIELD_INT, 0 ),
+	FIELD(eyes, left_palpebral,			FIELD_INT, 0 ),
+	FIELD(eyes, left_nystagmus,			FIELD_INT, 0 ),
+	FIELD(eyes, send_command,			FIELD_INT, FIELD_ALWAYS ),
+	FIELD(eyes, send_input_response,	FIELD_INT, FIELD_ALWAYS ),
+	FIELD(eyes, connected,				FIELD_INT, FIELD_LOCAL ),
+};
+
+// Sensor structs, sent to the sim-mgr. These tables only provide the dirty bits.
+constexpr struct simField auscultationFields[] =
+{
+	FIELD(auscultation, side,				FIELD_INT, 0 ),
+	FIELD(auscultation, row,				FIELD_INT, 0 ),
+	FIELD(auscultation, col,				FIELD_INT, 0 ),
+	FIELD(auscultation, heartStrength,		FIELD_INT, 0 ),
+	FIELD(auscultation, leftLungStrength,	FIELD_INT, 0 ),
+	FIELD(auscultation, rightLungStrength,	FIELD_INT, 0 ),
+	FIELD(auscultation, tag,				FIELD_STR, 0 ),
+	FIELD(auscultation, heartTrim,			FIELD_INT, 0 ),
+	FIELD(auscultation, lungTrim,			FIELD_INT, 0 ),
+};
+
+constexpr struct simField pulseFields[] =
+{
+	FIELD(pulse, right_dorsal,		FIELD_INT, 0 ),
+	FIELD(pulse, left_dorsal,		FIELD_INT, 0 ),
+	FIELD(pulse, right_femoral,		FIELD_INT, 0 ),
+	FIELD(pulse, left_femoral,		FIELD_INT, 0 ),
+};
+
+constexpr struct simField cprFields[] =
+{
+	FIELD(cpr, last,			FIELD_INT, 0 ),
+	FIELD(cpr, compression,		FIELD_INT, 0 ),
+	FIELD(cpr, release,			FIELD_INT, 0 ),
+	FIELD(cpr, duration,		FIELD_INT, 0 ),
+	FIELD(cpr, x,				FIELD_INT, 0 ),
+	FIELD(cpr, y,				FIELD_INT, 0 ),
+	FIELD(cpr, z,				FIELD_INT, 0 ),
+	FIELD(cpr, tof_present,		FIELD_INT, 0 ),
+	FIELD(cpr, distance,		FIELD_INT, 0 ),
+	FIELD(cpr, maxDistance,		FIELD_INT, 0 ),
+};
+
+#undef FIELD
+
+#define FIELD_COUNT(table)	( (int)( sizeof(table) / sizeof(table[0]) ) )
+
+constexpr int
+simFieldNameEq(const char *a, const char *b )
+{
+	while ( *a && *a == *b )
+	{
+		a++;
+		b++;
+	}
+	return ( *a == *b );
+}
+
+// Dirty mask bit of a field, by name. 0 if the name is not in the table.
+template <int N>
+constexpr unsigned int
+simFieldBit(const struct simField (&fields)[N], const char *name )
+{
+	int i = 0;
+
+	for ( i = 0 ; i < N ; i++ )
+	{
+		if ( simFieldNameEq(fields[i].name, name ) )
+		{
+			return ( 1u << i );
+		}
+	}
+	return ( 0 );
+}
+
+// e.g. SHM_BIT(cardiac, heart_sound), for shmWriteEnd and shmDirtyTake masks
+#define SHM_BIT(st, name)	simFieldBit(st##Fields, #name )
+
+static_assert(FIELD_COUNT(cardiacFields) <= 32, "cardiacFields has more fields than dirty bits" );
+static_assert(FIELD_COUNT(respirationFields) <= 32, "respirationFields has more fields than dirty bits" );
+static_assert(FIELD_COUNT(eyesFields) <= 32, "eyesFields has more fields than dirty bits" );
+static_assert(FIELD_COUNT(auscultationFields) <= 32, "auscultationFields has more fields than dirty bits" );
+static_assert(FIELD_COUNT(pulseFields) <= 32, "pulseFields has more fields than dirty bits" );
+static_assert(FIELD_COUNT(cprFields) <= 32, "cprFields has more fields than dirty bits" );
+
+constexpr struct simFieldIndex cardiacIndex = simFieldIndexBuild(cardiacFields );
+constexpr struct simFieldIndex respirationIndex = simFieldIndexBuild(respirationFields );
+constexpr struct simFieldIndex eyesIndex = simFieldIndexBuild(eyesFields );
+
+static_assert(cardiacIndex.seed != 0, "No perfect hash for cardiacFields - increase SIM_FIELD_SLOTS" );
+static_assert(respirationIndex.seed != 0, "No perfect hash for respirationFields - increase SIM_FIELD_SLOTS" );
+static_assert(eyesIndex.seed != 0, "No perfect hash for eyesFields - increase SIM_FIELD_SLOTS" );
+
+constexpr struct simFieldTable cardiacTable = { "cardiac", cardiacFields, FIELD_COUNT(cardiacFields), &cardiacIndex };
+constexpr struct simFieldTable respirationTable = { "respiration", respirationFields, FIELD_COUNT(respirationFields), &respirationIndex };
+constexpr struct simFieldTable eyesTable = { "eyes", eyesFields, FIELD_COUNT(eyesFields), &eyesIndex };
+
+// Dirty masks with every field of a table
+#define SHM_ALL(st)		( ( FIELD_COUNT(st##Fields) == 32 ) ? ~0u : ( ( 1u << FIELD_COUNT(st##Fields) ) - 1 ) )
+
+// The text of the last value applied to each field of a table, so a repeated
+// status read only touches the fields that changed.
+struct simFieldCache
+{
+	unsigned char len[SIM_FIELD_SLOTS];		// Value length + 1, 0 if not cached
+	char value[SIM_FIELD_SLOTS][STR_SIZE];
+};
+
+const struct simField *simFieldFind(const struct simFieldTable *table, const char *name );
+int simFieldApply(const struct simFieldTable *table, void *base, const char *elem, const char *value );
+int simFieldApplyChanged(const struct simFieldTable *table, struct simFieldCache *cache, void *base,
+						 const char *elem, const char *value, int valueLen, unsigned int *dirty );
+void simFieldCacheClear(struct simFieldCache *cache );
+int simFieldFormat(const struct simField *field, const void *base, char *buf, int len );
+
+#endif /* SIMFIELDS_H_ */
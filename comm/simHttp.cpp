@@ -0,0 +1,328 @@
+/*
+ * simHttp.cpp
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replaces the popen("simCurl ...") calls in simController. Each call to simCurl
+ * paid for a fork/exec, curl_global_init and a new TCP connection. Here the
+ * library is initialized once and a curl easy handle is kept for each sim-mgr
+ * endpoint, so libcurl can reuse the open keep-alive connection.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include <curl/curl.h>
+
+#include "simHttp.h"
+#include "simUtil.h"
+
+extern int debug;
+
+struct simHttpEndpoint
+{
+	CURL *handle;
+	char addr[32];
+	int port;
+	unsigned int lastUse;
+	char pollQuery[64];					// Query the ETag belongs to
+	char etag[SIM_HTTP_ETAG_MAX];		// From the last 200 response to pollQuery
+	char newEtag[SIM_HTTP_ETAG_MAX];	// From the response in progress
+};
+
+struct simHttpResponse
+{
+	char *buf;
+	int len;
+	int max;
+};
+
+static struct simHttpEndpoint endpoints[SIM_HTTP_ENDPOINTS_MAX];
+static unsigned int useCount = 0;
+static int httpInitDone = 0;
+
+static size_t
+simHttpWrite(char *data, size_t size, size_t nmemb, void *userp )
+{
+	struct simHttpResponse *resp = (struct simHttpResponse *)userp;
+	size_t bytes = size * nmemb;
+	size_t room = resp->max - resp->len;
+
+	// Anything past the end of the caller's buffer is dropped, but the
+	// transfer is allowed to complete so the connection stays reusable.
+	if ( bytes < room )
+	{
+		room = bytes;
+	}
+	memcpy(&resp->buf[resp->len], data, room );
+	resp->len += room;
+
+	return ( bytes );
+}
+
+/*
+ * Function: simHttpHeader
+ *
+ * Header callback. Captures the ETag of the response in progress.
+ */
+static size_t
+simHttpHeader(char *data, size_t size, size_t nmemb, void *userp )
+{
+	struct simHttpEndpoint *ep = (struct simHttpEndpoint *)userp;
+	size_t bytes = size * nmemb;
+	size_t len;
+
+	if ( bytes > 5 && strncasecmp(data, "ETag:", 5 ) == 0 )
+	{
+		data += 5;
+		len = bytes - 5;
+		while ( len > 0 && ( *data == ' ' || *data == '\t' ) )
+		{
+			data++;
+			len--;
+		}
+		while ( len > 0 && ( data[len-1] == '\r' || data[len-1] == '\n' || data[len-1] == ' ' ) )
+		{
+			len--;
+		}
+		if ( len < SIM_HTTP_ETAG_MAX )
+		{
+			memcpy(ep->newEtag, data, len );
+			ep->newEtag[len] = 0;
+		}
+	}
+	return ( bytes );
+}
+
+int
+simHttpInit(void )
+{
+	if ( ! httpInitDone )
+	{
+		if ( curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK )
+		{
+			log_message("", "simHttpInit: curl_global_init failed" );
+			return ( -1 );
+		}
+		memset(endpoints, 0, sizeof(endpoints) );
+		httpInitDone = 1;
+	}
+	return ( 0 );
+}
+
+void
+simHttpClose(void )
+{
+	int i;
+
+	if ( httpInitDone )
+	{
+		for ( i = 0 ; i < SIM_HTTP_ENDPOINTS_MAX ; i++ )
+		{
+			if ( endpoints[i].handle )
+			{
+				curl_easy_cleanup(endpoints[i].handle );
+				endpoints[i].handle = NULL;
+			}
+		}
+		curl_global_cleanup();
+		httpInitDone = 0;
+	}
+}
+
+/*
+ * Function: simHttpEndpointGet
+ *
+ * Find the handle for the addr/port pair, creating one if needed. When the table
+ * is full the least recently used endpoint is closed and reused.
+ */
+static struct simHttpEndpoint *
+simHttpEndpointGet(const char *addr, int port )
+{
+	struct simHttpEndpoint *ep = NULL;
+	int i;
+
+	for ( i = 0 ; i < SIM_HTTP_ENDPOINTS_MAX ; i++ )
+	{
+		if ( endpoints[i].handle &&
+			 endpoints[i].port == port &&
+			 strcmp(endpoints[i].addr, addr ) == 0 )
+		{
+			ep = &endpoints[i];
+			ep->lastUse = ++useCount;
+			return ( ep );
+		}
+	}
+	for ( i = 0 ; i < SIM_HTTP_ENDPOINTS_MAX ; i++ )
+	{
+		if ( ! endpoints[i].handle )
+		{
+			ep = &endpoints[i];
+			break;
+		}
+		if ( ! ep || endpoints[i].lastUse < ep->lastUse )
+		{
+			ep = &endpoints[i];
+		}
+	}
+	if ( ep->handle )
+	{
+		curl_easy_cleanup(ep->handle );
+	}
+	ep->handle = curl_easy_init();
+	if ( ! ep->handle )
+	{
+		log_message("", "simHttp: curl_easy_init failed" );
+		return ( NULL );
+	}
+	snprintf(ep->addr, sizeof(ep->addr), "%s", addr );
+	ep->port = port;
+	ep->lastUse = ++useCount;
+	ep->pollQuery[0] = 0;
+	ep->etag[0] = 0;
+
+	curl_easy_setopt(ep->handle, CURLOPT_WRITEFUNCTION, simHttpWrite );
+	curl_easy_setopt(ep->handle, CURLOPT_HEADERFUNCTION, simHttpHeader );
+	curl_easy_setopt(ep->handle, CURLOPT_HEADERDATA, ep );
+	curl_easy_setopt(ep->handle, CURLOPT_NOSIGNAL, 1L );
+	curl_easy_setopt(ep->handle, CURLOPT_TCP_NODELAY, 1L );
+	curl_easy_setopt(ep->handle, CURLOPT_TCP_KEEPALIVE, 1L );
+	// A lost sim-mgr must not stall the read/write loop. The connection is
+	// dropped and re-established on the next request.
+	curl_easy_setopt(ep->handle, CURLOPT_TIMEOUT_MS, (long)SIM_HTTP_TIMEOUT_MS );
+	curl_easy_setopt(ep->handle, CURLOPT_CONNECTTIMEOUT_MS, (long)SIM_HTTP_TIMEOUT_MS );
+
+	return ( ep );
+}
+
+/*
+ * Function: simHttpRequest
+ *
+ * Common code for simHttpStatusGet and simHttpStatusPoll. When conditional is set,
+ * the stored ETag for the query is sent in If-None-Match.
+ */
+static int
+simHttpRequest(const char *addr, int port, const char *query, char *buf, int bufLen, int conditional )
+{
+	struct simHttpEndpoint *ep;
+	struct simHttpResponse resp;
+	struct curl_slist *headers = NULL;
+	char url[SIM_HTTP_URL_MAX];
+	char hdr[SIM_HTTP_ETAG_MAX+32];
+	long code = 0;
+	CURLcode res;
+
+	if ( ( ! addr ) || ( ! query ) || ( ! buf ) || ( bufLen < 1 ) )
+	{
+		return ( -1 );
+	}
+	if ( simHttpInit() )
+	{
+		return ( -1 );
+	}
+	ep = simHttpEndpointGet(addr, port );
+	if ( ! ep )
+	{
+		return ( -1 );
+	}
+	snprintf(url, sizeof(url), "http://%s:%d/cgi-bin/simstatus.cgi?%s", addr, port, query );
+
+	if ( conditional )
+	{
+		if ( strcmp(ep->pollQuery, query ) != 0 )
+		{
+			snprintf(ep->pollQuery, sizeof(ep->pollQuery), "%s", query );
+			ep->etag[0] = 0;
+		}
+		if ( ep->etag[0] )
+		{
+			snprintf(hdr, sizeof(hdr), "If-None-Match: %s", ep->etag );
+			headers = curl_slist_append(headers, hdr );
+		}
+	}
+	ep->newEtag[0] = 0;
+	
+	resp.buf = buf;
+	resp.len = 0;
+	resp.max = bufLen - 1;
+	curl_easy_setopt(ep->handle, CURLOPT_URL, url );
+	curl_easy_setopt(ep->handle, CURLOPT_WRITEDATA, &resp );
+	curl_easy_setopt(ep->handle, CURLOPT_HTTPHEADER, headers );
+
+	res = curl_easy_perform(ep->handle );
+	
+	curl_easy_setopt(ep->handle, CURLOPT_HTTPHEADER, NULL );
+	if ( headers )
+	{
+		curl_slist_free_all(headers );
+	}
+	if ( res != CURLE_OK )
+	{
+		// The server may have restarted, so the next poll fetches in full
+		ep->etag[0] = 0;
+		buf[0] = 0;
+		if ( debug )
+		{
+			fprintf(stderr, "simHttpRequest(%s) failed: %s\n", url, curl_easy_strerror(res) );
+		}
+		return ( -1 );
+	}
+	curl_easy_getinfo(ep->handle, CURLINFO_RESPONSE_CODE, &code );
+	if ( conditional )
+	{
+		if ( code == 304 )
+		{
+			return ( SIM_HTTP_NOT_MODIFIED );
+		}
+		if ( code == 200 )
+		{
+			memcpy(ep->etag, ep->newEtag, SIM_HTTP_ETAG_MAX );
+		}
+		else
+		{
+			ep->etag[0] = 0;
+		}
+	}
+	if ( code < 200 || code > 299 )
+	{
+		// An error page is not a status, and a set: that was refused did not happen
+		buf[0] = 0;
+		if ( debug )
+		{
+			fprintf(stderr, "simHttpRequest(%s) failed: HTTP %ld\n", url, code );
+		}
+		return ( -1 );
+	}
+	buf[resp.len] = 0;
+	return ( resp.len );
+}
+
+int
+simHttpStatusGet(const char *addr, int port, const char *query, char *buf, int bufLen )
+{
+	return ( simHttpRequest(addr, port, query, buf, bufLen, 0 ) );
+}
+
+int
+simHttpStatusPoll(const char *addr, int port, const char *query, char *buf, int bufLen )
+{
+	return ( simHttpRequest(addr, port, query, buf, bufLen, 1 ) );
+}
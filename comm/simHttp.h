@@ -0,0 +1,48 @@
+/*
+ * simHttp.h
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMHTTP_H_
+#define SIMHTTP_H_
+
+// In-process HTTP access to the Sim Manager status CGI. One keep-alive
+// libcurl handle is kept per sim-mgr endpoint (address and port), so
+// repeated requests reuse the same TCP connection.
+
+#define SIM_HTTP_ENDPOINTS_MAX	4
+#define SIM_HTTP_TIMEOUT_MS		2000
+#define SIM_HTTP_URL_MAX		2048
+
+int simHttpInit(void );
+void simHttpClose(void );
+
+#define SIM_HTTP_ETAG_MAX		64
+#define SIM_HTTP_NOT_MODIFIED	(-2)
+
+// Issue a GET of "http://addr:port/cgi-bin/simstatus.cgi?query" and place the
+// response, NULL terminated, in buf. Returns the response length, or -1 on error
+// or when the status is not 2xx.
+int simHttpStatusGet(const char *addr, int port, const char *query, char *buf, int bufLen );
+
+// As simHttpStatusGet, but conditional on the ETag returned by the last poll of the
+// same query. Returns SIM_HTTP_NOT_MODIFIED, with buf untouched, when the sim-mgr
+// answers 304. A sim-mgr that sends no ETag gets a plain GET every time.
+int simHttpStatusPoll(const char *addr, int port, const char *query, char *buf, int bufLen );
+
+#endif /* SIMHTTP_H_ */
@@ -27,593 +27,235 @@
 #include <stdbool.h>
 
 #include "shmData.h"
+#include "simFields.h"
 
 extern int debug;
 
-int
-cardiac_parse(const char *elem,  const char *value, struct cardiac *card )
+/*
+ * Function: simFieldFind
+ *
+ * Look up a field by name with the table's perfect hash.
+ *
+ * Returns: the descriptor, or NULL if the name is not in the table
+ */
+const struct simField *
+simFieldFind(const struct simFieldTable *table, const char *name )
 {
-	int sts = 0;
-	int int_val = atoi(value );
-	int pulse_val;
-	
-	if ( ( ! elem ) || ( ! value) || ( ! card ) )
-	{
-		return ( -11 );
-	}
-	if ( strcmp(elem, ("rhythm" ) ) == 0 )
-	{
-		if ( strcmp(value, card->rhythm ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac rhythm: %s (old %s)\n", value, card->rhythm );
-			}
-			sprintf(card->rhythm, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("vpc" ) ) == 0 )
-	{
-		if ( strcmp(value, card->vpc ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vpc: %s\n", value );
-			}
-			sprintf(card->vpc, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("pea" ) ) == 0 )
-	{
-		if ( int_val != card->pea )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pea: %d\n", int_val );
-			}
-			card->pea = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("vpc_freq" ) ) == 0 )
+	unsigned int h;
+	int i;
+
+	h = simFieldHash(name, table->index->seed ) & ( SIM_FIELD_SLOTS - 1 );
+	i = table->index->slot[h];
+	if ( i >= 0 && strcmp(table->fields[i].name, name ) == 0 &&
+		 ! ( table->fields[i].flags & FIELD_LOCAL ) )
 	{
-		if ( int_val != card->vpc_freq )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vpc_freq: %d\n", int_val );
-			}
-			card->vpc_freq = int_val;
-		}
+		return ( &table->fields[i] );
 	}
-	else if ( strcmp(elem, ("vfib_amplitude" ) ) == 0 )
-	{
-		if ( strcmp(value, card->vfib_amplitude ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac vfib_amplitude: %s\n", value );
-			}
-			sprintf(card->vfib_amplitude, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, ("pwave" ) ) == 0 )
+	return ( NULL );
+}
+
+static int
+pulseStrength(const char *value )
+{
+	if ( strcmp(value, "none" ) == 0 )
 	{
-		if ( strcmp(value, card->pwave ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pwave: %s\n", value );
-			}
-			sprintf(card->pwave, "%s", value );
-		}
+		return ( 0 );
 	}
-	else if ( strcmp(elem, ("rate" ) ) == 0 )
+	else if ( strcmp(value, "weak" ) == 0 )
 	{
-		if ( int_val != card->rate )
-		{
-			if ( debug )
-			{
-				printf("Cardiac rate: %d\n", int_val );
-			}
-			card->rate = int_val;
-		}
+		return ( 1 );
 	}
-	else if ( strcmp(elem, ("pr_interval" ) ) == 0 )
+	else if ( strcmp(value, "medium" ) == 0 )
 	{
-		if ( int_val != card->pr_interval )
-		{
-			if ( debug )
-			{
-				printf("Cardiac pr_interval: %d\n", int_val );
-			}
-			card->pr_interval = int_val;
-		}
+		return ( 2 );
 	}
-	else if ( strcmp(elem, ("qrs_interval" ) ) == 0 )
+	else if ( strcmp(value, "strong" ) == 0 )
 	{
-		if ( int_val != card->qrs_interval )
-		{
-			if ( debug )
-			{
-				printf("Cardiac qrs_interval: %d\n", int_val );
-			}
-			card->qrs_interval = int_val;
-		}
+		return ( 3 );
 	}
-	else if ( strcmp(elem, ("bps_sys" ) ) == 0 )
+	return ( -1 );
+}
+
+/*
+ * Function: simFieldStore
+ *
+ * Store value into a field of the struct at base, if it differs. *changed is set
+ * when the stored value was replaced.
+ *
+ * Returns: 0 on success, 3 for an invalid pulse strength
+ */
+static int
+simFieldStore(const struct simFieldTable *table, const struct simField *field, void *base,
+			  const char *value, int *changed )
+{
+	char *str;
+	int *ip;
+	int int_val;
+
+	*changed = 0;
+	switch ( field->type )
 	{
-		if ( int_val != card->bps_sys )
-		{
-			if ( debug )
+		case FIELD_STR:
+			str = (char *)base + field->offset;
+			if ( strcmp(value, str ) != 0 )
 			{
-				printf("Cardiac bps_sys: %d\n", int_val );
+				if ( debug && ( field->flags & FIELD_LOG ) )
+				{
+					printf("%s %s: %s (old %s)\n", table->section, field->name, value, str );
+				}
+				snprintf(str, STR_SIZE, "%s", value );
+				*changed = 1;
 			}
-			card->bps_sys = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("bps_dia" ) ) == 0 )
-	{
-		if ( int_val != card->bps_dia )
-		{
-			if ( debug )
+			break;
+
+		case FIELD_PULSE:
+		case FIELD_INT:
+			if ( field->type == FIELD_PULSE )
 			{
-				printf("Cardiac bps_dia: %d\n", int_val );
+				int_val = pulseStrength(value );
+				if ( int_val < 0 )
+				{
+					return ( 3 );
+				}
 			}
-			card->bps_dia = int_val;
-		}
-	}
-	else if ( strcmp(elem, ("nibp_rate" ) ) == 0 )
-	{
-		if ( int_val != card->nibp_rate )
-		{
-			if ( debug )
+			else
 			{
-				printf("Cardiac nibp_rate: %d\n", int_val );
+				int_val = atoi(value );
 			}
-			card->nibp_rate = int_val;
-		}
-	}
-	else if ( strcmp(elem, "nibp_read" ) == 0 )
-	{
-		if ( int_val != card->nibp_read )
-		{
-			if ( debug )
+			ip = (int *)((char *)base + field->offset );
+			if ( *ip != int_val )
 			{
-				printf("Cardiac nibp_read: %d\n", int_val );
+				if ( debug && ( field->flags & FIELD_LOG ) )
+				{
+					printf("%s %s: %d\n", table->section, field->name, int_val );
+				}
+				*ip = int_val;
+				*changed = 1;
 			}
-			card->nibp_read = int_val;
-		}
+			break;
 	}
-	else if ( strcmp(elem, "nibp_freq" ) == 0 )
-	{
-		if ( int_val != card->nibp_freq )
-		{
-			if ( debug )
-			{
-				printf("Cardiac nibp_freq: %d\n", int_val );
-			}
-			card->nibp_freq = int_val;
-		}
-	}
-	
-	
-	else if ( strcmp(elem, ("heart_sound_volume" ) ) == 0 )
+	return ( 0 );
+}
+
+/*
+ * Function: simFieldApply
+ *
+ * Store value into the named field of the struct at base, if it differs.
+ *
+ * Returns: 0 on success, 1 for an unknown name, 3 for an invalid pulse strength
+ */
+int
+simFieldApply(const struct simFieldTable *table, void *base, const char *elem, const char *value )
+{
+	const struct simField *field;
+	int changed;
+
+	field = simFieldFind(table, elem );
+	if ( ! field )
 	{
-		if ( int_val != card->heart_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound_volume: %d\n", int_val );
-			}
-			card->heart_sound_volume = int_val;
-		}
+		return ( 1 );
 	}
-	
-	else if ( strcmp(elem, ("heart_sound_mute" ) ) == 0 )
+	return ( simFieldStore(table, field, base, value, &changed ) );
+}
+
+/*
+ * Function: simFieldApplyChanged
+ *
+ * As simFieldApply, but skipped when the value text is byte for byte the same as
+ * the last one applied to the field. value must be NULL terminated at valueLen.
+ * The field's bit is set in *dirty when the stored value changes.
+ *
+ * Returns: 0 on success or no change, 1 for an unknown name, 3 for an invalid pulse strength
+ */
+int
+simFieldApplyChanged(const struct simFieldTable *table, struct simFieldCache *cache, void *base,
+					 const char *elem, const char *value, int valueLen, unsigned int *dirty )
+{
+	const struct simField *field;
+	int i;
+	int sts;
+	int changed;
+
+	field = simFieldFind(table, elem );
+	if ( ! field )
 	{
-		if ( int_val != card->heart_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound_mute: %d\n", int_val );
-			}
-			card->heart_sound_mute = int_val;
-		}
-		card->heart_sound_mute = atoi(value );
+		return ( 1 );
 	}
-	else if ( strcmp(elem, ("heart_sound" ) ) == 0 )
+	i = field - table->fields;
+	if ( ! ( field->flags & FIELD_ALWAYS ) &&
+		 cache->len[i] == valueLen + 1 &&
+		 memcmp(cache->value[i], value, valueLen ) == 0 )
 	{
-		if ( strcmp(value, card->heart_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Cardiac heart_sound: %s\n", value );
-			}
-		}
-		sprintf(card->heart_sound, "%s", value );
+		return ( 0 );
 	}
-	else if ( strcmp(elem, ("right_dorsal_pulse_strength" ) ) == 0 )
+	sts = simFieldStore(table, field, base, value, &changed );
+	if ( changed )
 	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->right_dorsal_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
-			{
-				printf("Cardiac right_dorsal_pulse_strength: %d\n", pulse_val );
-			}
-			card->right_dorsal_pulse_strength = pulse_val;
-		}
+		*dirty |= 1u << i;
 	}
-	else if ( strcmp(elem, ("left_dorsal_pulse_strength" ) ) == 0 )
+	if ( sts == 0 && valueLen < STR_SIZE )
 	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->left_dorsal_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
-			{
-				printf("Cardiac left_dorsal_pulse_strength: %d\n", pulse_val );
-			}
-			card->left_dorsal_pulse_strength = pulse_val;
-		}
+		memcpy(cache->value[i], value, valueLen );
+		cache->len[i] = valueLen + 1;
 	}
-	else if ( strcmp(elem, ("right_femoral_pulse_strength" ) ) == 0 )
+	else
 	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->right_femoral_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
-			{
-				printf("Cardiac right_femoral_pulse_strength: %d\n", pulse_val );
-			}
-			card->right_femoral_pulse_strength = pulse_val;
-		}
+		cache->len[i] = 0;
 	}
-	else if ( strcmp(elem, ("left_femoral_pulse_strength" ) ) == 0 )
+	return ( sts );
+}
+
+void
+simFieldCacheClear(struct simFieldCache *cache )
+{
+	memset(cache->len, 0, sizeof(cache->len) );
+}
+
+/*
+ * Function: simFieldFormat
+ *
+ * Format the current value of a field as text, for status output.
+ *
+ * Returns: the snprintf length
+ */
+int
+simFieldFormat(const struct simField *field, const void *base, char *buf, int len )
+{
+	const char *ptr = (const char *)base + field->offset;
+
+	if ( field->type == FIELD_STR )
 	{
-		if ( (strcmp(value, "none" ) ) == 0 )
-		{
-			pulse_val = 0;
-		}
-		else if ( (strcmp(value, "weak" ) ) == 0 )
-		{
-			pulse_val = 1;
-		}
-		else if ( (strcmp(value, "medium" ) ) == 0 )
-		{
-			pulse_val = 2;
-		}
-		else if ( (strcmp(value, "strong" ) ) == 0 )
-		{
-			pulse_val = 3;
-		}
-		else
-		{
-			sts = 3;
-		}
-		if ( ( sts != 3 ) && ( card->left_femoral_pulse_strength != pulse_val ) )
-		{
-			if ( debug )
-			{
-				printf("Cardiac left_femoral_pulse_strength: %d\n", pulse_val );
-			}
-			card->left_femoral_pulse_strength = pulse_val;
-		}
+		return ( snprintf(buf, len, "%s", ptr ) );
 	}
-	else
+	return ( snprintf(buf, len, "%d", *(const int *)ptr ) );
+}
+
+int
+cardiac_parse(const char *elem,  const char *value, struct cardiac *card )
+{
+	if ( ( ! elem ) || ( ! value) || ( ! card ) )
 	{
-		sts = 1;
+		return ( -11 );
 	}
-	return ( sts );
+	return ( simFieldApply(&cardiacTable, card, elem, value ) );
 }
 
 int
 respiration_parse(const char *elem,  const char *value, struct respiration *resp )
 {
-	int sts = 0;
-	int int_val = atoi(value );
-	
 	if ( ( ! elem ) || ( ! value) || ( ! resp ) )
 	{
 		return ( -12 );
 	}
-	if ( strcmp(elem, "inhalation_duration" ) == 0 )
-	{
-		if ( int_val != resp->inhalation_duration )
-		{
-			if ( debug )
-			{
-				printf("Respiration inhalation_duration: %d\n", int_val );
-			}
-			resp->inhalation_duration = int_val;
-		}
-	}
-	else if ( strcmp(elem, "exhalation_duration" ) == 0 )
-	{
-		if ( int_val != resp->exhalation_duration )
-		{
-			if ( debug )
-			{
-				printf("Respiration exhalation_duration: %d\n", int_val );
-			}
-		}
-		resp->exhalation_duration = int_val;
-	}
-	
-	else if ( strcmp(elem, "left_lung_sound_volume" ) == 0 )
-	{
-		if ( int_val != resp->left_lung_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound_volume: %d\n", int_val );
-			}
-		}
-		resp->left_lung_sound_volume = int_val;
-	}
-	
-	else if ( strcmp(elem, "left_lung_sound_mute" ) == 0 )
-	{
-		if ( int_val != resp->left_lung_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound_mute: %d\n", int_val );
-			}
-			resp->left_lung_sound_mute = int_val;
-		}
-	}
-	
-	else if ( strcmp(elem, "right_lung_sound_volume" ) == 0 )
-	{
-		if ( int_val != resp->right_lung_sound_volume )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound_volume: %d\n", int_val );
-			}
-			resp->right_lung_sound_volume = int_val;
-		}
-	}
-	
-	else if ( strcmp(elem, "right_lung_sound_mute" ) == 0 )
-	{
-		if ( int_val != resp->right_lung_sound_mute )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound_mute: %d\n", int_val );
-			}
-			resp->right_lung_sound_mute = int_val;
-		}
-	}
-	else if ( strcmp(elem, "left_lung_sound" ) == 0 )
-	{
-		if ( strcmp(value, resp->left_lung_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Respiration left_lung_sound: %s\n", value );
-			}
-			sprintf(resp->left_lung_sound, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, "right_lung_sound" ) == 0 )
-	{
-		if ( strcmp(value, resp->right_lung_sound ) != 0 )
-		{
-			if ( debug )
-			{
-				printf("Respiration right_lung_sound: %s\n", value );
-			}
-			sprintf(resp->right_lung_sound, "%s", value );
-		}
-	}
-	else if ( strcmp(elem, "rate" ) == 0 )
-	{
-		if ( int_val != resp->rate )
-		{
-			if ( debug )
-			{
-				printf("Respiration rate: %d\n", int_val );
-			}
-			resp->rate = int_val;
-		}
-	}
-	else if ( strcmp(elem, "awRR" ) == 0 )
-	{
-		if ( int_val != resp->awRR )
-		{
-			if ( debug )
-			{
-				printf("Respiration awRR: %d\n", int_val );
-			}
-			resp->awRR = int_val;
-		}
-	}
-	else if ( strcmp(elem, "chest_movement" ) == 0 )
-	{
-		if ( int_val != resp->chest_movement )
-		{
-			if ( debug )
-			{
-				printf("Respiration chest_movement: %d\n", int_val );
-			}
-			resp->chest_movement = int_val;
-		}
-	}
-	else
-	{
-		sts = 1;
-	}
-	return ( sts );
+	return ( simFieldApply(&respirationTable, resp, elem, value ) );
 }
 
 int
 eyes_parse(const char *elem, const char *value, struct eyes *eyes)
 {
-	int sts = 0;
-	int int_val = atoi(value);
-
 	if ((!elem) || (!value) || (!eyes))
 	{
 		return (-13);
 	}
-	if (strcmp(elem, "right_state") == 0)
-	{
-		eyes->right_state = int_val;
-	}
-	else if (strcmp(elem, "right_lid") == 0)
-	{
-		eyes->right_lid = int_val;
-	}
-	else if (strcmp(elem, "right_move") == 0)
-	{
-		eyes->right_move = int_val;
-	}
-	else if (strcmp(elem, "right_position") == 0)
-	{
-		eyes->right_position = int_val;
-	}
-	else if (strcmp(elem, "right_blink") == 0)
-	{
-		eyes->right_blink = int_val;
-	}
-	else if (strcmp(elem, "right_pupil") == 0)
-	{
-		eyes->right_pupil = int_val;
-	}
-	else if (strcmp(elem, "left_state") == 0)
-	{
-		eyes->left_state = int_val;
-	}
-	else if (strcmp(elem, "left_lid") == 0)
-	{
-		eyes->left_lid = int_val;
-	}
-	else if (strcmp(elem, "left_move") == 0)
-	{
-		eyes->left_move = int_val;
-	}
-	else if (strcmp(elem, "left_position") == 0)
-	{
-		eyes->left_position = int_val;
-	}
-	else if (strcmp(elem, "left_blink") == 0)
-	{
-		eyes->left_blink = int_val;
-	}
-	else if (strcmp(elem, "left_pupil") == 0)
-	{
-		eyes->left_pupil = int_val;
-	}
-	else if (strcmp(elem, "right_plr_exposed") == 0)
-	{
-		eyes->right_plr_exposed = int_val;
-	}
-	else if (strcmp(elem, "right_plr_consensual") == 0)
-	{
-		eyes->right_plr_consensual = int_val;
-	}
-	else if (strcmp(elem, "right_menace") == 0)
-	{
-		eyes->right_menace = int_val;
-	}
-	else if (strcmp(elem, "right_palpebral") == 0)
-	{
-		eyes->right_palpebral = int_val;
-	}
-	else if (strcmp(elem, "right_nystagmus") == 0)
-	{
-		eyes->right_nystagmus = int_val;
-	}
-	else if (strcmp(elem, "left_plr_exposed") == 0)
-	{
-		eyes->left_plr_exposed = int_val;
-	}
-	else if (strcmp(elem, "left_plr_consensual") == 0)
-	{
-		eyes->left_plr_consensual = int_val;
-	}
-	else if (strcmp(elem, "left_menace") == 0)
-	{
-		eyes->left_menace = int_val;
-	}
-	else if (strcmp(elem, "left_palpebral") == 0)
-	{
-		eyes->left_palpebral = int_val;
-	}
-	else if (strcmp(elem, "left_nystagmus") == 0)
-	{
-		eyes->left_nystagmus = int_val;
-	}
-	else if (strcmp(elem, "send_command") == 0)
-	{
-		eyes->send_command = int_val;
-	}
-	else if (strcmp(elem, "send_input_response") == 0)
-	{
-		eyes->send_input_response = int_val;
-	}
-	else
-	{
-		sts = 1;
-	}
-	return (sts);
+	return ( simFieldApply(&eyesTable, eyes, elem, value ) );
 }
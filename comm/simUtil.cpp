@@ -39,9 +39,15 @@
 #include <execinfo.h>
 #include <string.h>
 #include <libgen.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
 
 #include "simUtil.h"
 #include "shmData.h"
+#include "simFields.h"
 
 extern int debug;
 int findAINPath(void );
@@ -66,6 +72,9 @@ extern char *program_invocation_short_name;
 #define RUNNING_DIR			"/"
 #define LOCK_FILE_DIR       "/var/run/"
 
+// Set by simRuntime, which hosts the daemons as threads of one process
+int simHosted = 0;
+
 void daemonize(void )
 {
     pid_t pid;
@@ -73,6 +82,10 @@ void daemonize(void )
 	char str[16];
 	char buffer[128];
 	
+	if ( simHosted )
+	{
+		return;	/* the runtime has already daemonized */
+	}
 	if ( getppid()==1 )
 	{
 		return; /* already a daemon */
@@ -189,6 +202,11 @@ void log_message(const char *filename, const char* message)
  *
  * Returns: none
  */
+// Set on SIGTERM. A process that is inside a shmWriteBegin/shmWriteEnd pair exits
+// when the write ends, so the seqlock count is not left odd in the segment.
+volatile sig_atomic_t simStopRequested = 0;
+static int shmWritesOpen = 0;
+
 void signal_handler(int sig )
 {
 	switch(sig) {
@@ -196,8 +214,12 @@ void signal_handler(int sig )
 		log_message("","hangup signal catched");
 		break;
 	case SIGTERM:
-		log_message("","terminate signal catched");
-		exit(0);
+		simStopRequested = 1;
+		if ( __atomic_load_n(&shmWritesOpen, __ATOMIC_ACQUIRE ) == 0 )
+		{
+			log_message("","terminate signal catched");
+			exit(0);
+		}
 		break;
 	}
 }
@@ -261,6 +283,10 @@ initSHM(int create )
 	int mode;
 	int perm;
 	
+	if ( simHosted && shmData )
+	{
+		return ( 0 );	// Mapped by the first subsystem of the runtime
+	}
 	mmapSize = sizeof(struct shmData );
 	// Round up size to integral number of pages
 	pageSize = getpagesize();
@@ -312,6 +338,310 @@ initSHM(int create )
 	return ( 0 );
 }
 
+#define FUTEX_WAKE_ALL	0x7fffffff
+
+/*
+ * Location of each SHM_* sub-struct in struct shmData
+ */
+static const struct
+{
+	size_t offset;
+	size_t size;
+	const struct simField *fields;	// Field order gives the dirty bits
+	int count;
+} shmSections[SHM_SECTIONS] =
+{
+	{ offsetof(struct shmData, cardiac),		sizeof(struct cardiac),		cardiacFields,		FIELD_COUNT(cardiacFields) },
+	{ offsetof(struct shmData, respiration),	sizeof(struct respiration),	respirationFields,	FIELD_COUNT(respirationFields) },
+	{ offsetof(struct shmData, auscultation),	sizeof(struct auscultation), auscultationFields, FIELD_COUNT(auscultationFields) },
+	{ offsetof(struct shmData, pulse),			sizeof(struct pulse),		pulseFields,		FIELD_COUNT(pulseFields) },
+	{ offsetof(struct shmData, cpr),			sizeof(struct cpr),			cprFields,			FIELD_COUNT(cprFields) },
+	{ offsetof(struct shmData, eyes),			sizeof(struct eyes),		eyesFields,			FIELD_COUNT(eyesFields) },
+};
+
+/*
+ * Function: shmFieldBit
+ *
+ * Dirty bit of the field at addr, which is in the SHM_* section. Used where the
+ * field is passed by address, the SHM_BIT macro is the compile time equivalent.
+ */
+static unsigned int
+shmFieldBit(int section, const void *addr )
+{
+	int offset = (const char *)addr - ( (const char *)shmData + shmSections[section].offset );
+	int i;
+	
+	for ( i = 0 ; i < shmSections[section].count ; i++ )
+	{
+		if ( shmSections[section].fields[i].offset == offset )
+		{
+			return ( 1u << i );
+		}
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: shmSensorNotify
+ *
+ * Advance the sensor sequence number and wake any process waiting in shmSensorWait.
+ * The futex is not process private, as the word lives in the shared segment.
+ */
+void
+shmSensorNotify(void )
+{
+	__atomic_add_fetch(&shmData->sensorSeq, 1, __ATOMIC_RELEASE );
+	syscall(SYS_futex, &shmData->sensorSeq, FUTEX_WAKE, FUTEX_WAKE_ALL, NULL, NULL, 0 );
+}
+
+/*
+ * Function: shmSensorUpdate
+ *
+ * Store a sensor value in the SHM_* section that holds it and notify, but only when
+ * the value changes. Loops that rewrite the same value on every pass do not wake
+ * the waiter.
+ *
+ * Returns: 1 if the value changed, 0 if not
+ */
+int
+shmSensorUpdate(int section, int *field, int value )
+{
+	if ( *field == value )
+	{
+		return ( 0 );
+	}
+	shmWriteBegin(section );
+	*field = value;
+	shmWriteEnd(section, shmFieldBit(section, field ) );
+	shmSensorNotify();
+	return ( 1 );
+}
+
+unsigned int
+shmSensorSeq(void )
+{
+	return ( __atomic_load_n(&shmData->sensorSeq, __ATOMIC_ACQUIRE ) );
+}
+
+/*
+ * Function: shmSensorWait
+ *
+ * Sleep until the sensor sequence moves past seq, or timeoutMs expires.
+ *
+ * Returns: 1 if the sequence changed, 0 on timeout
+ */
+int
+shmSensorWait(unsigned int seq, int timeoutMs )
+{
+	struct timespec ts;
+	
+	if ( shmSensorSeq() != seq )
+	{
+		return ( 1 );
+	}
+	if ( timeoutMs > 0 )
+	{
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = ( timeoutMs % 1000 ) * 1000000;
+		// EAGAIN (seq already moved), EINTR and ETIMEDOUT are all resolved by the recheck
+		syscall(SYS_futex, &shmData->sensorSeq, FUTEX_WAIT, seq, &ts, NULL, 0 );
+	}
+	return ( shmSensorSeq() != seq );
+}
+
+/*
+ * Function: shmStatusNotify
+ *
+ * Record a sim-mgr status change notice and wake simController. The wake uses the
+ * sensor futex, as that is what simController sleeps on.
+ */
+void
+shmStatusNotify(void )
+{
+	__atomic_add_fetch(&shmData->simMgrStatusSeq, 1, __ATOMIC_RELEASE );
+	shmSensorNotify();
+}
+
+/*
+ * Function: shmWriteBegin
+ *
+ * Start an update of a shmData sub-struct. The seqlock count is made odd, so a
+ * reader that overlaps the update retries. Readers never hold the lock, so a writer
+ * only waits when another writer of the same struct is mid-update.
+ *
+ * Returns: The count before the update, the value shmWriteEnd returned to the last writer
+ */
+unsigned int
+shmWriteBegin(int section )
+{
+	unsigned int *seq = &shmData->dataSeq[section];
+	unsigned int cur;
+	
+	__atomic_add_fetch(&shmWritesOpen, 1, __ATOMIC_ACQ_REL );
+	while ( 1 )
+	{
+		cur = __atomic_load_n(seq, __ATOMIC_RELAXED );
+		if ( ( cur & 1 ) == 0 &&
+			 __atomic_compare_exchange_n(seq, &cur, cur + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+		{
+			break;
+		}
+		sched_yield();
+	}
+	// Keep the field stores after the count change
+	__atomic_thread_fence(__ATOMIC_RELEASE );
+	return ( cur );
+}
+
+/*
+ * Function: shmWriteEnd
+ *
+ * Finish an update started with shmWriteBegin. The count is even again, and differs
+ * from the value any reader saw before the update. dirty is the mask of fields that
+ * were changed, 0 if the update only rewrote the same values.
+ *
+ * Returns: The count after the update. A writer that keeps it can tell, at its next
+ * shmWriteBegin, whether another writer has been in the struct since.
+ */
+unsigned int
+shmWriteEnd(int section, unsigned int dirty )
+{
+	unsigned int seq;
+	
+	seq = __atomic_add_fetch(&shmData->dataSeq[section], 1, __ATOMIC_RELEASE );
+	if ( dirty )
+	{
+		shmMarkDirty(section, dirty );
+	}
+	if ( __atomic_sub_fetch(&shmWritesOpen, 1, __ATOMIC_ACQ_REL ) == 0 && simStopRequested )
+	{
+		log_message("","terminate signal catched");
+		exit(0);
+	}
+	return ( seq );
+}
+
+/*
+ * Function: shmMarkDirty
+ *
+ * Set the dirty bits of a section for every reader.
+ */
+void
+shmMarkDirty(int section, unsigned int dirty )
+{
+	int reader;
+	
+	for ( reader = 0 ; reader < SHM_READERS ; reader++ )
+	{
+		__atomic_or_fetch(&shmData->dataDirty[reader][section], dirty, __ATOMIC_RELEASE );
+	}
+}
+
+/*
+ * Function: shmDirtyTake
+ *
+ * Fetch and clear the reader's dirty mask for a section. A write that lands after
+ * the take sets its bits again, so no change is lost. Walk the result with ctz:
+ *
+ *	while ( dirty ) { i = __builtin_ctz(dirty ); dirty &= dirty - 1; ... fields[i] ... }
+ *
+ * Returns: The mask of fields changed since the last take
+ */
+unsigned int
+shmDirtyTake(int reader, int section )
+{
+	if ( __atomic_load_n(&shmData->dataDirty[reader][section], __ATOMIC_RELAXED ) == 0 )
+	{
+		return ( 0 );	// Common case, no locked instruction
+	}
+	return ( __atomic_exchange_n(&shmData->dataDirty[reader][section], 0, __ATOMIC_ACQUIRE ) );
+}
+
+/*
+ * Function: shmDirtyReset
+ *
+ * Mark every field dirty for a reader, so its first pass sees the full state.
+ */
+void
+shmDirtyReset(int reader )
+{
+	int section;
+	
+	for ( section = 0 ; section < SHM_SECTIONS ; section++ )
+	{
+		__atomic_store_n(&shmData->dataDirty[reader][section], ~0u, __ATOMIC_RELEASE );
+	}
+}
+
+/*
+ * Function: shmFieldSet
+ *
+ * Store an int field of a section inside a shmWriteBegin/shmWriteEnd pair.
+ *
+ * Returns: The field's dirty bit if the value changed, 0 if not
+ */
+unsigned int
+shmFieldSet(int section, int *field, int value )
+{
+	if ( *field == value )
+	{
+		return ( 0 );
+	}
+	*field = value;
+	return ( shmFieldBit(section, field ) );
+}
+
+/*
+ * Function: shmPublish
+ *
+ * Replace a whole sub-struct with the caller's copy.
+ */
+void
+shmPublish(int section, const void *src )
+{
+	shmWriteBegin(section );
+	memcpy((char *)shmData + shmSections[section].offset, src, shmSections[section].size );
+	shmWriteEnd(section, ~0u );
+}
+
+/*
+ * Function: shmSnapshot
+ *
+ * Copy a sub-struct into dest, retrying until the copy was not overlapped by a
+ * write. The copy is consistent: every field is from the same update.
+ *
+ * Returns: The seqlock count of the copy. A caller that keeps it can tell if the
+ * struct has been written since, see shmDataSeq.
+ */
+unsigned int
+shmSnapshot(int section, void *dest )
+{
+	unsigned int *seq = &shmData->dataSeq[section];
+	unsigned int before;
+	
+	while ( 1 )
+	{
+		before = __atomic_load_n(seq, __ATOMIC_ACQUIRE );
+		if ( before & 1 )
+		{
+			sched_yield();
+			continue;
+		}
+		memcpy(dest, (char *)shmData + shmSections[section].offset, shmSections[section].size );
+		__atomic_thread_fence(__ATOMIC_ACQUIRE );
+		if ( __atomic_load_n(seq, __ATOMIC_RELAXED ) == before )
+		{
+			return ( before );
+		}
+	}
+}
+
+unsigned int
+shmDataSeq(int section )
+{
+	return ( __atomic_load_n(&shmData->dataSeq[section], __ATOMIC_ACQUIRE ) );
+}
+
 #define PATH_MAX	512
 char ain_path[PATH_MAX];
 int ain_path_found = 0;
@@ -374,83 +704,791 @@ int findAINPath(void )
 	
 #define NAME_LEN (PATH_MAX+32)
 
+// Open sysfs file for each AIN channel, as fd + 1 so 0 means not open. Under
+// simRuntime, pulse and breathSense open channels from their own threads, so the
+// path search and the slots are set up under ainLock. Reads need no lock.
+static int ainFds[AIN_CHANNELS_MAX];
+static pthread_mutex_t ainLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: ainOpen
+ *
+ * Open the sysfs file of an AIN channel. The file is opened once and kept open;
+ * later calls for the same channel return the same descriptor.
+ *
+ * Returns: A handle for ainRead, or -1 if the channel can not be opened
+ */
 int
-read_ain(int chan )
+ainOpen(int chan )
 {
-	int fd;
-	int val = 0;
 	char name[NAME_LEN];
-	int sts;
-	char buf[8];
-	FILE *fp;
-	size_t bytes;
+	int fd;
 	
+	if ( ( chan < 0 ) || ( chan >= AIN_CHANNELS_MAX ) )
+	{
+		return ( -1 );
+	}
+	pthread_mutex_lock(&ainLock );
+	if ( ainFds[chan] )
+	{
+		fd = ainFds[chan] - 1;
+		pthread_mutex_unlock(&ainLock );
+		return ( fd );
+	}
 	if ( ain_path_found == 0 )
 	{
 		findAINPath();
 	}
-	if ( ain_path_found == 1 )
+	if ( ain_path_found == 0 )
+	{
+		pthread_mutex_unlock(&ainLock );
+		return ( -1 );
+	}
+	if ( ain_new_names )
 	{
-		if ( ain_new_names )
+		snprintf(name, NAME_LEN, "%s/in_voltage%d_raw", ain_path, chan );
+	}
+	else
+	{
+		snprintf(name, NAME_LEN, "%s/AIN%d", ain_path, chan);
+	}
+	fd = open(name, O_RDONLY | O_CLOEXEC );
+	if ( fd < 0 )
+	{
+		pthread_mutex_unlock(&ainLock );
+		if ( debug )
 		{
-			snprintf(name, NAME_LEN, "%s/in_voltage%d_raw", ain_path, chan );
+			fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno) );
 		}
 		else
 		{
-			snprintf(name, NAME_LEN, "%s/AIN%d", ain_path, chan);
+			syslog(LOG_DAEMON | LOG_ERR, "Failed to open %s: %s", name, strerror(errno) );
+		}
+		return ( -1 );
+	}
+	__atomic_store_n(&ainFds[chan], fd + 1, __ATOMIC_RELEASE );
+	pthread_mutex_unlock(&ainLock );
+	return ( fd );
+}
+
+void
+ainClose(int chan )
+{
+	if ( ( chan < 0 ) || ( chan >= AIN_CHANNELS_MAX ) )
+	{
+		return;
+	}
+	pthread_mutex_lock(&ainLock );
+	if ( ainFds[chan] )
+	{
+		close(ainFds[chan] - 1 );
+		__atomic_store_n(&ainFds[chan], 0, __ATOMIC_RELEASE );
+	}
+	pthread_mutex_unlock(&ainLock );
+}
+
+/*
+ * Function: ainRead
+ *
+ * Take a sample from a handle returned by ainOpen. sysfs produces a new value
+ * for each read at offset 0, so a single pread is the whole cost of a sample.
+ * While ainCapture has the IIO buffer on, the driver refuses sysfs reads, and the
+ * sample is the channel's newest frame in the ring instead.
+ *
+ * Returns: The sample, or 0 if the read fails
+ */
+int
+ainRead(int handle )
+{
+	static int lastErrno = 0;
+	char buf[16];
+	ssize_t bytes;
+	int val = 0;
+	int chan;
+	int i;
+	
+	for ( chan = 0 ; handle >= 0 && chan < AIN_CHANNELS_MAX ; chan++ )
+	{
+		if ( __atomic_load_n(&ainFds[chan], __ATOMIC_ACQUIRE ) == handle + 1 )
+		{
+			if ( ainRingLatest(chan, &val ) )
+			{
+				return ( val );
+			}
+			break;
 		}
-		
-		fp = fopen (name, "r" );
-		
-		if ( ! fp )
+	}
+	bytes = pread(handle, buf, sizeof(buf), 0 );
+	if ( bytes < 1 )
+	{
+		// Logged once for each new error, as a failing channel is read many times a second
+		if ( errno != lastErrno )
 		{
+			lastErrno = errno;
 			if ( debug )
 			{
-				fprintf(stderr, "Failed to open %s", name );
+				printf("pread failed for AIN fd %d, bytes %zd, Error %s\n", handle, bytes, strerror(errno));
 			}
-			perror("fopen" );
+			else
+			{
+				syslog(LOG_DAEMON | LOG_ERR, "pread failed for AIN fd %d, bytes %zd msg: %s", handle, bytes, strerror(errno));
+			}
+		}
+		return ( 0 );
+	}
+	lastErrno = 0;
+	for ( i = 0 ; i < bytes && buf[i] >= '0' && buf[i] <= '9' ; i++ )
+	{
+		val = ( val * 10 ) + ( buf[i] - '0' );
+	}
+	return ( val );
+}
+
+/*
+ * Function: read_ain
+ *
+ * Read an AIN channel by number, from the capture ring while ainCapture is running,
+ * otherwise through the channel's persistent handle.
+ */
+int
+read_ain(int chan )
+{
+	int handle;
+	int val;
+	
+	if ( ainRingLatest(chan, &val ) )
+	{
+		return ( val );
+	}
+	handle = ainOpen(chan );
+	if ( handle < 0 )
+	{
+		if ( ain_path_found == 1 )
+		{
+			perror("open" );
 			exit ( -2 );
 		}
-		fd = fileno(fp );
-		fd_set set;
-		struct timeval timeout;
+		return ( 0 );
+	}
+	return ( ainRead(handle ) );
+}
+
+/*
+ * Function: ainNow
+ *
+ * CLOCK_MONOTONIC in nsec, the time base of the ainRing frames
+ */
+long long
+ainNow(void )
+{
+	struct timespec ts;
 	
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-  
-		sts = select(fd + 1, &set, NULL, NULL, &timeout);
-		if(sts == -1)
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( ( (long long)ts.tv_sec * 1000000000LL ) + ts.tv_nsec );
+}
+
+/*
+ * Function: ainRingPush
+ *
+ * Producer side of the AIN ring. The frames are written, then published with a
+ * single release store of head. count must not exceed AIN_RING_BATCH.
+ */
+void
+ainRingPush(const struct ainFrame *frames, int count )
+{
+	struct ainRing *ring = &shmData->ainRing;
+	unsigned long long head = ring->head;
+	int i;
+	
+	// Order the last head store before the slot writes, so a reader that sees a
+	// new frame also sees the head that makes it invalid
+	__atomic_thread_fence(__ATOMIC_RELEASE );
+	for ( i = 0 ; i < count ; i++ )
+	{
+		ring->frames[( head + i ) & ( AIN_RING_FRAMES - 1 )] = frames[i];
+	}
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE );
+	__atomic_store_n(&ring->lastPush, ainNow(), __ATOMIC_RELAXED );
+	__atomic_add_fetch(&ring->seq, 1, __ATOMIC_RELEASE );
+	syscall(SYS_futex, &ring->seq, FUTEX_WAKE, FUTEX_WAKE_ALL, NULL, NULL, 0 );
+}
+
+/*
+ * Function: ainRingLive
+ *
+ * Returns: 1 if ainCapture is running and has pushed frames recently
+ */
+int
+ainRingLive(void )
+{
+	struct ainRing *ring;
+	
+	if ( ! shmData )
+	{
+		return ( 0 );	// Not attached, as in the pulse debug mode
+	}
+	ring = &shmData->ainRing;
+	if ( ! __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE ) )
+	{
+		return ( 0 );
+	}
+	return ( ( ainNow() - __atomic_load_n(&ring->lastPush, __ATOMIC_RELAXED ) ) < AIN_RING_STALE_NS );
+}
+
+unsigned long long
+ainRingHead(void )
+{
+	if ( ! shmData )
+	{
+		return ( 0 );
+	}
+	return ( __atomic_load_n(&shmData->ainRing.head, __ATOMIC_ACQUIRE ) );
+}
+
+/*
+ * Function: ainRingGet
+ *
+ * Copy the frame at *tail and advance *tail. A reader that has fallen more than
+ * a ring behind skips ahead to the oldest frame that is still safe to read.
+ *
+ * Returns: 1 if a frame was copied, 0 if the reader is caught up
+ */
+int
+ainRingGet(unsigned long long *tail, struct ainFrame *frame )
+{
+	struct ainRing *ring = &shmData->ainRing;
+	unsigned long long head;
+	
+	while ( 1 )
+	{
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE );
+		if ( *tail >= head )
 		{
-			syslog(LOG_DAEMON | LOG_ERR, "Select failed for AIN");
-			exit ( -1 );
+			return ( 0 );
 		}
-		else if(sts == 0)
+		// The producer may be writing up to AIN_RING_BATCH frames past head
+		if ( head - *tail > AIN_RING_FRAMES - AIN_RING_BATCH )
 		{
-			syslog(LOG_DAEMON | LOG_ERR, "Select timeout for AIN");
-			exit ( -1 );
+			*tail = head - ( AIN_RING_FRAMES - AIN_RING_BATCH );
 		}
-		bytes = fread(buf, 1, 4, fp );
-		if ( bytes < 1 )
+		*frame = ring->frames[*tail & ( AIN_RING_FRAMES - 1 )];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE );
+		head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED );
+		if ( head - *tail <= AIN_RING_FRAMES - AIN_RING_BATCH )
 		{
-			if ( debug )
-			{
-				printf("fread failed for AIN%d, bytes %d, Error %s\n", chan, bytes, strerror(errno));
-			}
-			else
+			*tail += 1;
+			return ( 1 );
+		}
+		// Overwritten while copying, try again from further on
+	}
+}
+
+/*
+ * Function: ainRingLatest
+ *
+ * The newest ring value of a channel, for single reads while ainCapture owns the
+ * ADC. Just after ainCapture starts, the first frames are waited for.
+ *
+ * Returns: 1 with *value set, or 0 if ainCapture is not capturing the channel or
+ * has stopped pushing frames without clearing active (logged once)
+ */
+int
+ainRingLatest(int chan, int *value )
+{
+	static int ringStaleLogged = 0;
+	struct ainRing *ring;
+	struct ainFrame frame;
+	unsigned long long tail;
+	char msg[64];
+	
+	if ( ! shmData || chan < 0 || chan >= AIN_CHANNELS_MAX )
+	{
+		return ( 0 );
+	}
+	ring = &shmData->ainRing;
+	if ( ! __atomic_load_n(&ring->active, __ATOMIC_ACQUIRE ) ||
+		 ! ( __atomic_load_n(&ring->chanMask, __ATOMIC_RELAXED ) & ( 1u << chan ) ) )
+	{
+		return ( 0 );
+	}
+	// The driver stops answering sysfs as soon as the buffer is on
+	while ( ! ainRingLive() &&
+			( ainNow() - __atomic_load_n(&ring->started, __ATOMIC_RELAXED ) ) < AIN_RING_START_NS )
+	{
+		ainRingWait(ainRingSeq(), 10 );
+	}
+	if ( ! ainRingLive() )
+	{
+		// ainCapture died without clearing active. Its last frame is not a reading.
+		if ( ! __atomic_exchange_n(&ringStaleLogged, 1, __ATOMIC_RELAXED ) )
+		{
+			snprintf(msg, sizeof(msg), "AIN ring is stale, ainCapture is not running" );
+			log_message("", msg );
+		}
+		return ( 0 );
+	}
+	__atomic_store_n(&ringStaleLogged, 0, __ATOMIC_RELAXED );
+	tail = ainRingHead();
+	if ( tail == 0 )
+	{
+		return ( 0 );
+	}
+	tail--;
+	if ( ! ainRingGet(&tail, &frame ) )
+	{
+		return ( 0 );
+	}
+	*value = frame.value[chan];
+	return ( 1 );
+}
+
+unsigned int
+ainRingSeq(void )
+{
+	return ( __atomic_load_n(&shmData->ainRing.seq, __ATOMIC_ACQUIRE ) );
+}
+
+/*
+ * Function: ainRingWait
+ *
+ * Sleep until the producer pushes past seq, or timeoutMs expires.
+ */
+void
+ainRingWait(unsigned int seq, int timeoutMs )
+{
+	struct timespec ts;
+	
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = ( timeoutMs % 1000 ) * 1000000;
+	syscall(SYS_futex, &shmData->ainRing.seq, FUTEX_WAIT, seq, &ts, NULL, 0 );
+}
+
+/*
+ * Function: ainStreamRing
+ *
+ * Returns: 1 if the stream's channel is in the scan of a live ring
+ */
+static int
+ainStreamRing(struct ainStream *st )
+{
+	return ( ainRingLive() &&
+			 ( __atomic_load_n(&shmData->ainRing.chanMask, __ATOMIC_RELAXED ) & ( 1u << st->chan ) ) );
+}
+
+/*
+ * Function: ainStreamOpen
+ *
+ * Set up a stream of samples from one AIN channel at a fixed period. Samples come
+ * from the ainCapture ring when it is running, and from the sysfs file when not.
+ *
+ * Returns: 0 on success, -1 if the channel can not be opened
+ */
+int
+ainStreamOpen(struct ainStream *st, int chan, int periodUs )
+{
+	memset(st, 0, sizeof(struct ainStream) );
+	st->chan = chan;
+	st->period = (long long)periodUs * 1000;
+	st->handle = ainOpen(chan );
+	if ( st->handle < 0 )
+	{
+		return ( -1 );
+	}
+	st->tail = ainRingHead();
+	st->next = ainNow() + st->period;
+	
+	// A first value, for a sample taken before any new frames
+	ainRingLatest(chan, &st->last );
+	return ( 0 );
+}
+
+/*
+ * Function: ainStreamNext
+ *
+ * Wait for the next sample on the stream's period grid. From the ring, that is the
+ * first frame at or after the grid time, so the samples are evenly spaced however
+ * late the caller runs. If the caller has fallen more than a period behind, the
+ * grid restarts from the frame.
+ *
+ * Returns: The sample. *ts, if not NULL, is set to its time.
+ */
+int
+ainStreamNext(struct ainStream *st, long long *ts )
+{
+	struct ainFrame frame;
+	struct timespec wake;
+	unsigned int seq;
+	long long now;
+	int value;
+	
+	while ( ainStreamRing(st ) )
+	{
+		seq = ainRingSeq();
+		while ( ainRingGet(&st->tail, &frame ) )
+		{
+			if ( frame.ts >= st->next )
 			{
-				syslog(LOG_DAEMON | LOG_ERR, "fread failed for AIN%d, bytes %d msg: %s", chan, bytes, strerror(errno));
+				st->next += st->period;
+				if ( st->next <= frame.ts )
+				{
+					st->next = frame.ts + st->period;
+				}
+				if ( ts )
+				{
+					*ts = frame.ts;
+				}
+				st->last = frame.value[st->chan];
+				return ( st->last );
 			}
 		}
-		else
+		ainRingWait(seq, 100 );
+	}
+	
+	// No capture running, sample the sysfs file on the same grid
+	wake.tv_sec = st->next / 1000000000LL;
+	wake.tv_nsec = st->next % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL );
+	value = ainRead(st->handle );
+	now = ainNow();
+	st->next += st->period;
+	if ( st->next <= now )
+	{
+		st->next = now + st->period;
+	}
+	st->tail = ainRingHead();
+	if ( ts )
+	{
+		*ts = now;
+	}
+	st->last = value;
+	return ( value );
+}
+
+/*
+ * Function: ainStreamSample
+ *
+ * Non-blocking read for slow loops. From the ring, the mean of the frames since
+ * the last call (or the last value if there are none); otherwise a sysfs read.
+ *
+ * Returns: The sample
+ */
+int
+ainStreamSample(struct ainStream *st )
+{
+	struct ainFrame frame;
+	long long sum = 0;
+	int count = 0;
+	
+	if ( ! ainStreamRing(st ) )
+	{
+		st->tail = ainRingHead();
+		st->last = ainRead(st->handle );
+		return ( st->last );
+	}
+	while ( ainRingGet(&st->tail, &frame ) )
+	{
+		sum += frame.value[st->chan];
+		count++;
+	}
+	if ( count )
+	{
+		st->last = sum / count;
+	}
+	return ( st->last );
+}
+
+/*
+ * Function: loopTimerStart
+ *
+ * Register a daemon's loop period and start its grid one period from now. Also
+ * used to restart the grid after the loop has been held up on purpose, as
+ * in a device reconnect wait.
+ */
+void
+loopTimerStart(struct loopTimer *lt, int slot, int periodUs )
+{
+	memset(lt, 0, sizeof(struct loopTimer) );
+	lt->slot = slot;
+	lt->period = (long long)periodUs * 1000;
+	lt->windowStart = ainNow();
+	lt->next = lt->windowStart + lt->period;
+	if ( shmData && slot >= 0 && slot < LOOP_TIMERS )
+	{
+		shmData->loopStats[slot].period = periodUs;
+	}
+}
+
+/*
+ * Function: loopTimerMark
+ *
+ * Account for one period that ran at ts. loopTimerWait calls this; a loop paced by
+ * something else (breathSense, by its sample stream) calls it directly with
+ * lt->next set to the time the period was due.
+ */
+void
+loopTimerMark(struct loopTimer *lt, long long ts )
+{
+	struct loopStats *stats;
+	long long late = ts - lt->next;
+	long long elapsed;
+	
+	if ( late < 0 )
+	{
+		late = 0;
+	}
+	lt->windowTicks++;
+	lt->windowLate += late;
+	if ( late > lt->windowLateMax )
+	{
+		lt->windowLateMax = late;
+	}
+	if ( ! shmData || lt->slot < 0 || lt->slot >= LOOP_TIMERS )
+	{
+		return;
+	}
+	stats = &shmData->loopStats[lt->slot];
+	stats->ticks++;
+	if ( late >= lt->period )
+	{
+		// Only seen from callers that pace themselves, loopTimerWait skips first
+		stats->overruns += late / lt->period;
+	}
+	elapsed = ts - lt->windowStart;
+	if ( elapsed >= 1000000000LL )
+	{
+		stats->rate = ( (long long)lt->windowTicks * 1000000000000LL ) / elapsed;
+		stats->lateMax = lt->windowLateMax / 1000;
+		stats->lateAvg = ( lt->windowLate / lt->windowTicks ) / 1000;
+		lt->windowStart = ts;
+		lt->windowTicks = 0;
+		lt->windowLate = 0;
+		lt->windowLateMax = 0;
+	}
+}
+
+/*
+ * Function: loopTimerWait
+ *
+ * Sleep until the next period on the grid. If the loop has run past one or more
+ * whole periods, they are skipped and counted as overruns, so the grid keeps its
+ * phase rather than running a burst of late periods.
+ *
+ * Returns: The number of periods missed
+ */
+int
+loopTimerWait(struct loopTimer *lt )
+{
+	struct timespec wake;
+	long long now;
+	int missed = 0;
+	
+	now = ainNow();
+	if ( now >= lt->next + lt->period )
+	{
+		missed = ( now - lt->next ) / lt->period;
+		lt->next += missed * lt->period;
+		if ( shmData && lt->slot >= 0 && lt->slot < LOOP_TIMERS )
 		{
-			val = atoi(buf );
+			shmData->loopStats[lt->slot].overruns += missed;
 		}
-		fclose(fp);
 	}
+	wake.tv_sec = lt->next / 1000000000LL;
+	wake.tv_nsec = lt->next % 1000000000LL;
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL ) == EINTR )
+	{
+		;
+	}
+	loopTimerMark(lt, ainNow() );
+	lt->next += lt->period;
+	return ( missed );
+}
 
-	return ( val );
+/*
+ * Function: clockSyncPublish
+ *
+ * Store a new clock offset estimate. There is one writer, soundSense's sync thread.
+ */
+void
+clockSyncPublish(const struct clockSync *cs )
+{
+	struct clockSync *dest;
+	unsigned int seq;
+	
+	if ( ! shmData )
+	{
+		return;
+	}
+	dest = &shmData->clockSync;
+	seq = dest->seq;
+	__atomic_store_n(&dest->seq, seq + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence(__ATOMIC_RELEASE );
+	dest->valid = cs->valid;
+	dest->offset = cs->offset;
+	dest->updated = cs->updated;
+	dest->drift = cs->drift;
+	dest->rtt = cs->rtt;
+	dest->rttMin = cs->rttMin;
+	dest->samples = cs->samples;
+	__atomic_store_n(&dest->seq, seq + 2, __ATOMIC_RELEASE );
+}
+
+/*
+ * Function: clockSyncGet
+ *
+ * Copy the clock offset estimate.
+ *
+ * Returns: Non zero if the estimate is valid
+ */
+int
+clockSyncGet(struct clockSync *cs )
+{
+	struct clockSync *src;
+	unsigned int before;
+	
+	if ( ! shmData )
+	{
+		memset(cs, 0, sizeof(struct clockSync) );
+		return ( 0 );
+	}
+	src = &shmData->clockSync;
+	while ( 1 )
+	{
+		before = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE );
+		if ( before & 1 )
+		{
+			sched_yield();
+			continue;
+		}
+		memcpy(cs, src, sizeof(struct clockSync) );
+		__atomic_thread_fence(__ATOMIC_ACQUIRE );
+		if ( __atomic_load_n(&src->seq, __ATOMIC_RELAXED ) == before )
+		{
+			return ( cs->valid );
+		}
+	}
+}
+
+/*
+ * Function: clockSyncLocal
+ *
+ * Convert a sim-mgr sync clock time, in usec, to our CLOCK_MONOTONIC in nsec.
+ *
+ * Returns: The local time, or -1 if there is no offset estimate
+ */
+long long
+clockSyncLocal(long long mgrTime )
+{
+	struct clockSync cs;
+	long long local;
+	
+	if ( ! clockSyncGet(&cs ) )
+	{
+		return ( -1 );
+	}
+	// First order inverse of mgr = t + offset + ( t - updated ) * drift
+	local = mgrTime - cs.offset;
+	local -= ( ( local - cs.updated ) * cs.drift ) / 1000000000LL;
+	return ( local * 1000 );
+}
+
+/*
+ * Function: ainHistoryPush
+ *
+ * Append a sample to the channel's history. Called only by the daemon that owns
+ * the channel, so there is a single producer for each ring.
+ */
+void
+ainHistoryPush(int chan, long long ts, int value )
+{
+	struct ainHistory *hist;
+	struct ainSample *sample;
+	unsigned long long head;
+	
+	if ( ! shmData || chan < 0 || chan >= AIN_CHANNELS_MAX )
+	{
+		return;
+	}
+	hist = &shmData->ainHistory[chan];
+	head = hist->head;
+	__atomic_thread_fence(__ATOMIC_RELEASE );
+	sample = &hist->samples[head & ( AIN_HISTORY_LEN - 1 )];
+	sample->ts = ts;
+	sample->value = value;
+	__atomic_store_n(&hist->head, head + 1, __ATOMIC_RELEASE );
+}
+
+unsigned long long
+ainHistoryHead(int chan )
+{
+	if ( ! shmData || chan < 0 || chan >= AIN_CHANNELS_MAX )
+	{
+		return ( 0 );
+	}
+	return ( __atomic_load_n(&shmData->ainHistory[chan].head, __ATOMIC_ACQUIRE ) );
+}
+
+/*
+ * Function: ainHistoryGet
+ *
+ * Copy the sample at *tail and advance *tail, as ainRingGet does for the capture
+ * ring. The slot at head may be in the middle of a write, so a reader more than
+ * AIN_HISTORY_LEN - 1 behind skips ahead.
+ *
+ * Returns: 1 if a sample was copied, 0 if the reader is caught up
+ */
+int
+ainHistoryGet(int chan, unsigned long long *tail, struct ainSample *sample )
+{
+	struct ainHistory *hist;
+	unsigned long long head;
+	
+	if ( ! shmData || chan < 0 || chan >= AIN_CHANNELS_MAX )
+	{
+		return ( 0 );
+	}
+	hist = &shmData->ainHistory[chan];
+	while ( 1 )
+	{
+		head = __atomic_load_n(&hist->head, __ATOMIC_ACQUIRE );
+		if ( *tail >= head )
+		{
+			return ( 0 );
+		}
+		if ( head - *tail > AIN_HISTORY_LEN - 1 )
+		{
+			*tail = head - ( AIN_HISTORY_LEN - 1 );
+		}
+		*sample = hist->samples[*tail & ( AIN_HISTORY_LEN - 1 )];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE );
+		head = __atomic_load_n(&hist->head, __ATOMIC_RELAXED );
+		if ( head - *tail <= AIN_HISTORY_LEN - 1 )
+		{
+			*tail += 1;
+			return ( 1 );
+		}
+	}
+}
+
+/*
+ * Function: ainHistoryRecent
+ *
+ * Copy up to max of the most recent samples of a channel, oldest first.
+ *
+ * Returns: The number of samples copied
+ */
+int
+ainHistoryRecent(int chan, struct ainSample *samples, int max )
+{
+	unsigned long long head = ainHistoryHead(chan );
+	unsigned long long tail;
+	int count = 0;
+	
+	tail = ( head > (unsigned long long)max ) ? head - max : 0;
+	while ( count < max && ainHistoryGet(chan, &tail, &samples[count] ) )
+	{
+		count++;
+	}
+	return ( count );
 }
 
 /**
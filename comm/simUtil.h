@@ -21,13 +21,40 @@
 #ifndef SIMUTIL_H_
 #define SIMUTIL_H_
 
+#include <signal.h>
+
+// Defined by each daemon, or once by simRuntime when built with SIM_RUNTIME
+extern struct shmData *shmData;
+extern int debug;
+
+extern int simHosted;	// Running as a thread of simRuntime
 void daemonize(void );
 void log_message(const char *filename, const char* message);
 void signal_handler(int sig );
+extern volatile sig_atomic_t simStopRequested;	// SIGTERM seen, exit pending the open shm write
 void catchFaults(void );
 
 int initSHM(int create );
 
+// Sensor change notification (see shmData.sensorSeq)
+void shmSensorNotify(void );
+int shmSensorUpdate(int section, int *field, int value );
+unsigned int shmSensorSeq(void );
+int shmSensorWait(unsigned int seq, int timeoutMs );
+void shmStatusNotify(void );
+
+// Seqlock access to the shmData sub-structs (SHM_CARDIAC ... SHM_EYES). The
+// dirty mask given to shmWriteEnd names the changed fields, see SHM_BIT.
+unsigned int shmWriteBegin(int section );
+unsigned int shmWriteEnd(int section, unsigned int dirty );
+unsigned int shmFieldSet(int section, int *field, int value );
+void shmPublish(int section, const void *src );
+unsigned int shmSnapshot(int section, void *dest );
+unsigned int shmDataSeq(int section );
+void shmMarkDirty(int section, unsigned int dirty );
+unsigned int shmDirtyTake(int reader, int section );
+void shmDirtyReset(int reader );
+
 // Analog Input Assignments
 #define BREATH_AIN_CHANNEL			0
 #define TOUCH_SENSE_AIN_CHANNEL_1	1
@@ -37,6 +64,73 @@ int initSHM(int create );
 #define TOUCH_SENSE_AIN_CHANNEL_4	5
 
 int read_ain(int chan );		// Read Analog Input Channel
+
+// AIN channel handles. The channel's sysfs file is opened once and each sample
+// is a single pread, for the loops that sample every few msec.
+int ainOpen(int chan );
+int ainRead(int handle );
+void ainClose(int chan );
+
+// AIN capture ring (shmData.ainRing), filled by ainCapture from the IIO buffer
+#define AIN_RING_BATCH		64			// Most frames published by one ainRingPush
+#define AIN_RING_STALE_NS	1000000000LL	// Ring is ignored if nothing is pushed for this long
+#define AIN_RING_START_NS	200000000LL		// Single reads wait this long for the first frames
+
+long long ainNow(void );
+void ainRingPush(const struct ainFrame *frames, int count );
+int ainRingLive(void );
+unsigned long long ainRingHead(void );
+int ainRingGet(unsigned long long *tail, struct ainFrame *frame );
+int ainRingLatest(int chan, int *value );
+unsigned int ainRingSeq(void );
+void ainRingWait(unsigned int seq, int timeoutMs );
+
+// A sample stream from one channel, from the ring when ainCapture is running and
+// from sysfs when not. The caller does not need to know which.
+struct ainStream
+{
+	int chan;
+	int handle;					// sysfs handle from ainOpen
+	long long period;			// nsec
+	long long next;				// Time of the next sample on the period grid
+	unsigned long long tail;	// Ring read position
+	int last;					// Last sample returned
+};
+
+int ainStreamOpen(struct ainStream *st, int chan, int periodUs );
+int ainStreamNext(struct ainStream *st, long long *ts );
+int ainStreamSample(struct ainStream *st );
+
+// Periodic loop timer. Wakes on a fixed grid of CLOCK_MONOTONIC times, so the rate
+// does not drift with the time spent in the loop. The achieved rate, lateness and
+// overruns are kept in shmData->loopStats[slot].
+struct loopTimer
+{
+	int slot;					// LOOP_* index in shmData->loopStats
+	long long period;			// nsec
+	long long next;				// Time of the next period
+	long long windowStart;		// Start of the current one second statistics window
+	int windowTicks;
+	long long windowLate;		// Sum of lateness in the window, nsec
+	long long windowLateMax;
+};
+
+void loopTimerStart(struct loopTimer *lt, int slot, int periodUs );
+int loopTimerWait(struct loopTimer *lt );
+void loopTimerMark(struct loopTimer *lt, long long ts );
+
+// AIN sample history (shmData.ainHistory). Only the channel's owner may push.
+void ainHistoryPush(int chan, long long ts, int value );
+unsigned long long ainHistoryHead(int chan );
+int ainHistoryGet(int chan, unsigned long long *tail, struct ainSample *sample );
+int ainHistoryRecent(int chan, struct ainSample *samples, int max );
+
+// sim-mgr clock offset (shmData.clockSync). clockSyncLocal converts a sim-mgr time
+// (usec) to our CLOCK_MONOTONIC (nsec, as ainNow), or returns -1 with no estimate.
+void clockSyncPublish(const struct clockSync *cs );
+int clockSyncGet(struct clockSync *cs );
+long long clockSyncLocal(long long mgrTime );
+
 int getI2CLock(void );
 void releaseI2CLock(void );
 void cleanString(char *strIn );
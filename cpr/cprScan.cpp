@@ -62,17 +62,43 @@ VL6180X tof;
 
 using namespace std;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 
-char msgbuf[2048];
+static char msgbuf[2048];
 
+#ifndef SIM_RUNTIME
 int debug = 0;
+#endif
 #define Z_IDLE		16000
 #define Z_COMPRESS	19000
 #define Z_RELEASE	5000
 #define X_Y_LIMIT	10000
 #define CPR_HOLD	20
 
+/*
+ * Function: cprSet
+ *
+ * Publish the compression/release pair as one update, so a reader never sees
+ * the new compression with the old release.
+ */
+static void
+cprSet(int compression, int release )
+{
+	unsigned int dirty;
+	
+	if ( ( shmData->cpr.compression == compression ) && ( shmData->cpr.release == release ) )
+	{
+		return;
+	}
+	shmWriteBegin(SHM_CPR );
+	dirty  = shmFieldSet(SHM_CPR, &shmData->cpr.compression, compression );
+	dirty |= shmFieldSet(SHM_CPR, &shmData->cpr.release, release );
+	shmWriteEnd(SHM_CPR, dirty );
+	shmSensorNotify();
+}
+
 int main(int argc, char *argv[])
 {
 	int sts;
@@ -83,6 +109,8 @@ int main(int argc, char *argv[])
 	int count = 0;
 	int compressed = 0;
 	int loop = 0;
+	unsigned int dirty;
+	struct loopTimer loopTimer;
 	
 	if ( ! debug )
 	{
@@ -124,19 +152,21 @@ int main(int argc, char *argv[])
 	
 	//printf("%3d:\t%05d:\t%05d\t%05d\t: %05d  %d\n", count, loop, lastZ, diffZ, cummZ, compressed );
 	printf("%05d\t%05d\t%05d\t%05d  %d\n", loop, lastX, lastY, lastZ, compressed );
-	usleep(10000);
+	loopTimerStart(&loopTimer, LOOP_CPR, 20000 );
 	while ( 1 )
 	{
 		if ( cprSense.present == 0 )
 		{
 			usleep(10000000);	// Delay for 10 seconds
 			cprSense.scanForSensor();
+			loopTimerStart(&loopTimer, LOOP_CPR, 20000 );
 		}
 		else
 		{
 			newData = cprSense.readSensor();
 			if ( newData <= 0 )
 			{
+				loopTimerWait(&loopTimer );
 				continue;
 			}
 			//while ( ! ( newData = cprSense.readSensor() ) )
@@ -184,8 +214,7 @@ int main(int argc, char *argv[])
 				if ( ( abs(lastX ) > X_Y_LIMIT ) || ( abs(lastY ) > X_Y_LIMIT ) ||  abs(lastZ) > Z_COMPRESS )
 				{
 					compressed = 1;
-					shmData->cpr.compression = 1;
-					shmData->cpr.release = 0;
+					cprSet(1, 0 );
 					count = 0;
 				}
 				else
@@ -195,8 +224,7 @@ int main(int argc, char *argv[])
 					if ( count > CPR_HOLD )
 					{
 						compressed = 0;
-						shmData->cpr.compression = 0;
-						shmData->cpr.release = 50;
+						cprSet(0, 50 );
 					}
 				}
 			}
@@ -205,11 +233,13 @@ int main(int argc, char *argv[])
 				//printf("%3d:\t%05d:\t%05d\t%05d\t: %05d  %d\n", count, loop, lastZ, diffZ, cummZ, compressed );
 				printf("%05d\t%05d\t%05d\t%05d  %d\n", loop, lastX, lastY, lastZ, compressed );
 			}
-			shmData->cpr.x = lastX;
-			shmData->cpr.y = lastY;
-			shmData->cpr.z = lastZ;
+			shmWriteBegin(SHM_CPR );
+			dirty  = shmFieldSet(SHM_CPR, &shmData->cpr.x, lastX );
+			dirty |= shmFieldSet(SHM_CPR, &shmData->cpr.y, lastY );
+			dirty |= shmFieldSet(SHM_CPR, &shmData->cpr.z, lastZ );
+			shmWriteEnd(SHM_CPR, dirty );
+			loopTimerWait(&loopTimer );
 		}
-		usleep(20000);
 	}
 
 	return 0;
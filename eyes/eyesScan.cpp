@@ -40,164 +40,67 @@
 #include "../comm/simCtlComm.h"
 #include "../comm/simUtil.h"
 #include "../comm/shmData.h"
+#include "../comm/simFields.h"
 
 using namespace std;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
-char msgbuf[2048];
+#endif
+static char msgbuf[2048];
+#ifndef SIM_RUNTIME
 int debug = 0;
+#endif
 
-// Track previous values to detect changes
-struct {
-    int right_state;
-    int right_lid;
-    int right_move;
-    int right_position;
-    int right_blink;
-    int right_pupil;
-    int left_state;
-    int left_lid;
-    int left_move;
-    int left_position;
-    int left_blink;
-    int left_pupil;
-} prevEyes;
+// Fields carried by each eyes command. The shmData dirty masks for the eyes
+// section say when one of them has been written by simController.
+#define EYES_STATE_BITS ( \
+    SHM_BIT(eyes, right_state) | SHM_BIT(eyes, right_lid) | SHM_BIT(eyes, right_move) | \
+    SHM_BIT(eyes, right_position) | SHM_BIT(eyes, right_blink) | SHM_BIT(eyes, right_pupil) | \
+    SHM_BIT(eyes, left_state) | SHM_BIT(eyes, left_lid) | SHM_BIT(eyes, left_move) | \
+    SHM_BIT(eyes, left_position) | SHM_BIT(eyes, left_blink) | SHM_BIT(eyes, left_pupil) )
 
-// Track previous input response values to detect changes
-struct {
-    int right_plr_exposed;
-    int right_plr_consensual;
-    int right_menace;
-    int right_palpebral;
-    int right_nystagmus;
-    int left_plr_exposed;
-    int left_plr_consensual;
-    int left_menace;
-    int left_palpebral;
-    int left_nystagmus;
-    int send_input_response;
-} prevInputResponse;
+#define EYES_RESPONSE_BITS ( \
+    SHM_BIT(eyes, right_plr_exposed) | SHM_BIT(eyes, right_plr_consensual) | \
+    SHM_BIT(eyes, right_menace) | SHM_BIT(eyes, right_palpebral) | SHM_BIT(eyes, right_nystagmus) | \
+    SHM_BIT(eyes, left_plr_exposed) | SHM_BIT(eyes, left_plr_consensual) | \
+    SHM_BIT(eyes, left_menace) | SHM_BIT(eyes, left_palpebral) | SHM_BIT(eyes, left_nystagmus) )
 
-// Initialize previous values from shared memory
-void initPrevEyes(void)
+// Check if an eye state command is needed. send_command only counts when set.
+int eyesChanged(unsigned int dirty, const struct eyes *eyes)
 {
-    prevEyes.right_state = shmData->eyes.right_state;
-    prevEyes.right_lid = shmData->eyes.right_lid;
-    prevEyes.right_move = shmData->eyes.right_move;
-    prevEyes.right_position = shmData->eyes.right_position;
-    prevEyes.right_blink = shmData->eyes.right_blink;
-    prevEyes.right_pupil = shmData->eyes.right_pupil;
-    prevEyes.left_state = shmData->eyes.left_state;
-    prevEyes.left_lid = shmData->eyes.left_lid;
-    prevEyes.left_move = shmData->eyes.left_move;
-    prevEyes.left_position = shmData->eyes.left_position;
-    prevEyes.left_blink = shmData->eyes.left_blink;
-    prevEyes.left_pupil = shmData->eyes.left_pupil;
-}
-
-// Check if any eye values have changed
-int eyesChanged(void)
-{
-    if (shmData->eyes.send_command)
-        return 1;
-    if (prevEyes.right_state != shmData->eyes.right_state)
-        return 1;
-    if (prevEyes.right_lid != shmData->eyes.right_lid)
-        return 1;
-    if (prevEyes.right_move != shmData->eyes.right_move)
-        return 1;
-    if (prevEyes.right_position != shmData->eyes.right_position)
-        return 1;
-    if (prevEyes.right_blink != shmData->eyes.right_blink)
+    if (dirty & EYES_STATE_BITS)
         return 1;
-    if (prevEyes.right_pupil != shmData->eyes.right_pupil)
-        return 1;
-    if (prevEyes.left_state != shmData->eyes.left_state)
-        return 1;
-    if (prevEyes.left_lid != shmData->eyes.left_lid)
-        return 1;
-    if (prevEyes.left_move != shmData->eyes.left_move)
-        return 1;
-    if (prevEyes.left_position != shmData->eyes.left_position)
-        return 1;
-    if (prevEyes.left_blink != shmData->eyes.left_blink)
-        return 1;
-    if (prevEyes.left_pupil != shmData->eyes.left_pupil)
+    if ((dirty & SHM_BIT(eyes, send_command)) && eyes->send_command)
         return 1;
     return 0;
 }
 
-// Update previous values after sending command
-void updatePrevEyes(void)
+// Check if an input response command is needed
+int inputResponseChanged(unsigned int dirty, const struct eyes *eyes)
 {
-    prevEyes.right_state = shmData->eyes.right_state;
-    prevEyes.right_lid = shmData->eyes.right_lid;
-    prevEyes.right_move = shmData->eyes.right_move;
-    prevEyes.right_position = shmData->eyes.right_position;
-    prevEyes.right_blink = shmData->eyes.right_blink;
-    prevEyes.right_pupil = shmData->eyes.right_pupil;
-    prevEyes.left_state = shmData->eyes.left_state;
-    prevEyes.left_lid = shmData->eyes.left_lid;
-    prevEyes.left_move = shmData->eyes.left_move;
-    prevEyes.left_position = shmData->eyes.left_position;
-    prevEyes.left_blink = shmData->eyes.left_blink;
-    prevEyes.left_pupil = shmData->eyes.left_pupil;
-    shmData->eyes.send_command = 0;
-}
-
-// Initialize input response previous values from shared memory
-void initPrevInputResponse(void)
-{
-    prevInputResponse.right_plr_exposed    = shmData->eyes.right_plr_exposed;
-    prevInputResponse.right_plr_consensual = shmData->eyes.right_plr_consensual;
-    prevInputResponse.right_menace         = shmData->eyes.right_menace;
-    prevInputResponse.right_palpebral      = shmData->eyes.right_palpebral;
-    prevInputResponse.right_nystagmus      = shmData->eyes.right_nystagmus;
-    prevInputResponse.left_plr_exposed     = shmData->eyes.left_plr_exposed;
-    prevInputResponse.left_plr_consensual  = shmData->eyes.left_plr_consensual;
-    prevInputResponse.left_menace          = shmData->eyes.left_menace;
-    prevInputResponse.left_palpebral       = shmData->eyes.left_palpebral;
-    prevInputResponse.left_nystagmus       = shmData->eyes.left_nystagmus;
-    prevInputResponse.send_input_response  = 0;
-}
-
-// Check if any input response values have changed
-int inputResponseChanged(void)
-{
-    if (shmData->eyes.send_input_response)
+    if (dirty & EYES_RESPONSE_BITS)
+        return 1;
+    if ((dirty & SHM_BIT(eyes, send_input_response)) && eyes->send_input_response)
         return 1;
-    if (prevInputResponse.right_plr_exposed    != shmData->eyes.right_plr_exposed)    return 1;
-    if (prevInputResponse.right_plr_consensual != shmData->eyes.right_plr_consensual) return 1;
-    if (prevInputResponse.right_menace         != shmData->eyes.right_menace)         return 1;
-    if (prevInputResponse.right_palpebral      != shmData->eyes.right_palpebral)      return 1;
-    if (prevInputResponse.right_nystagmus      != shmData->eyes.right_nystagmus)      return 1;
-    if (prevInputResponse.left_plr_exposed     != shmData->eyes.left_plr_exposed)     return 1;
-    if (prevInputResponse.left_plr_consensual  != shmData->eyes.left_plr_consensual)  return 1;
-    if (prevInputResponse.left_menace          != shmData->eyes.left_menace)          return 1;
-    if (prevInputResponse.left_palpebral       != shmData->eyes.left_palpebral)       return 1;
-    if (prevInputResponse.left_nystagmus       != shmData->eyes.left_nystagmus)       return 1;
     return 0;
 }
 
-// Update input response previous values after sending command
-void updatePrevInputResponse(void)
+// Clear a command flag once the command has been sent. Not marked dirty, as
+// only eyesScan acts on the flags.
+void clearCommandFlag(int *flag)
 {
-    prevInputResponse.right_plr_exposed    = shmData->eyes.right_plr_exposed;
-    prevInputResponse.right_plr_consensual = shmData->eyes.right_plr_consensual;
-    prevInputResponse.right_menace         = shmData->eyes.right_menace;
-    prevInputResponse.right_palpebral      = shmData->eyes.right_palpebral;
-    prevInputResponse.right_nystagmus      = shmData->eyes.right_nystagmus;
-    prevInputResponse.left_plr_exposed     = shmData->eyes.left_plr_exposed;
-    prevInputResponse.left_plr_consensual  = shmData->eyes.left_plr_consensual;
-    prevInputResponse.left_menace          = shmData->eyes.left_menace;
-    prevInputResponse.left_palpebral       = shmData->eyes.left_palpebral;
-    prevInputResponse.left_nystagmus       = shmData->eyes.left_nystagmus;
-    shmData->eyes.send_input_response = 0;
+    shmWriteBegin(SHM_EYES);
+    *flag = 0;
+    shmWriteEnd(SHM_EYES, 0);
 }
 
 int main(int argc, char *argv[])
 {
     int sts;
+    unsigned int dirty = 0;
+    struct loopTimer loopTimer;
+    struct eyes eyes;
 
     // Check for debug flag
     if (argc > 1 && strcmp(argv[1], "-d") == 0)
@@ -224,7 +127,8 @@ int main(int argc, char *argv[])
     }
 
     // Initialize eyes state in shared memory
-    shmData->eyes.connected = 0;
+    shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 0);
+    shmWriteBegin(SHM_EYES);
     shmData->eyes.right_state = EYE_STATE_NORMAL;
     shmData->eyes.right_lid = EYE_LID_OPEN;
     shmData->eyes.right_move = EYE_MOVE_NORMAL;
@@ -251,6 +155,7 @@ int main(int argc, char *argv[])
     shmData->eyes.left_palpebral       = EYE_BLINK_RESP_NORMAL;
     shmData->eyes.left_nystagmus       = EYE_NYST_NORMAL;
     shmData->eyes.send_input_response  = 0;
+    shmWriteEnd(SHM_EYES, 0);
 
     // Scan for eyes controller
     eyesI2C eyesCtl;
@@ -262,7 +167,7 @@ int main(int argc, char *argv[])
     else
     {
         log_message("", "Eyes controller found");
-        shmData->eyes.connected = 1;
+        shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 1);
 
         // Send initial state
         eyesCtl.sendFullCommand(
@@ -284,8 +189,9 @@ int main(int argc, char *argv[])
         );
     }
 
-    initPrevEyes();
-    initPrevInputResponse();
+    // The initial state has been sent. Changes from here on are in the dirty mask.
+    shmDirtyTake(SHM_READER_EYES, SHM_EYES);
+    loopTimerStart(&loopTimer, LOOP_EYES, 50000);
 
     // Main loop
     while (1)
@@ -293,21 +199,33 @@ int main(int argc, char *argv[])
         if (eyesCtl.present == 0)
         {
             // Device not present - try to reconnect every 10 seconds
-            shmData->eyes.connected = 0;
+            shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 0);
             usleep(10000000);  // 10 seconds
             eyesCtl.scanForDevice();
             if (eyesCtl.present)
             {
+                loopTimerStart(&loopTimer, LOOP_EYES, 50000);
                 log_message("", "Eyes controller reconnected");
-                shmData->eyes.connected = 1;
-                shmData->eyes.send_command = 1;          // Force resend of current state
-                shmData->eyes.send_input_response = 1;   // Force resend of input responses
+                shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 1);
+                dirty = EYES_STATE_BITS | EYES_RESPONSE_BITS;   // Force resend of state and input responses
             }
         }
         else
         {
+            // Bits stay set until the command that carries the field is sent
+            dirty |= shmDirtyTake(SHM_READER_EYES, SHM_EYES);
+            if (dirty)
+            {
+                shmSnapshot(SHM_EYES, &eyes);
+                // A command flag written as 0 needs no action
+                if (!eyes.send_command)
+                    dirty &= ~SHM_BIT(eyes, send_command);
+                if (!eyes.send_input_response)
+                    dirty &= ~SHM_BIT(eyes, send_input_response);
+            }
+
             // Check if any values have changed
-            if (eyesChanged())
+            if (eyesChanged(dirty, &eyes))
             {
                 if (debug)
                 {
@@ -315,12 +233,12 @@ int main(int argc, char *argv[])
                 }
 
                 sts = eyesCtl.sendFullCommand(
-                    shmData->eyes.right_state, shmData->eyes.left_state,
-                    shmData->eyes.right_lid, shmData->eyes.left_lid,
-                    shmData->eyes.right_move, shmData->eyes.left_move,
-                    shmData->eyes.right_position, shmData->eyes.left_position,
-                    shmData->eyes.right_blink, shmData->eyes.left_blink,
-                    shmData->eyes.right_pupil, shmData->eyes.left_pupil
+                    eyes.right_state, eyes.left_state,
+                    eyes.right_lid, eyes.left_lid,
+                    eyes.right_move, eyes.left_move,
+                    eyes.right_position, eyes.left_position,
+                    eyes.right_blink, eyes.left_blink,
+                    eyes.right_pupil, eyes.left_pupil
                 );
 
                 if (sts < 0)
@@ -329,17 +247,21 @@ int main(int argc, char *argv[])
                     if (eyesCtl.present == 0)
                     {
                         log_message("", "Eyes controller disconnected");
-                        shmData->eyes.connected = 0;
+                        shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 0);
                     }
                 }
                 else
                 {
-                    updatePrevEyes();
+                    dirty &= ~( EYES_STATE_BITS | SHM_BIT(eyes, send_command) );
+                    if (eyes.send_command)
+                    {
+                        clearCommandFlag(&shmData->eyes.send_command);
+                    }
                 }
             }
 
             // Check if any input response values have changed
-            if (inputResponseChanged())
+            if (inputResponseChanged(dirty, &eyes))
             {
                 if (debug)
                 {
@@ -347,11 +269,11 @@ int main(int argc, char *argv[])
                 }
 
                 sts = eyesCtl.sendInputResponseCommand(
-                    shmData->eyes.right_plr_exposed, shmData->eyes.right_plr_consensual,
-                    shmData->eyes.left_plr_exposed, shmData->eyes.left_plr_consensual,
-                    shmData->eyes.right_menace, shmData->eyes.left_menace,
-                    shmData->eyes.right_palpebral, shmData->eyes.left_palpebral,
-                    shmData->eyes.right_nystagmus, shmData->eyes.left_nystagmus
+                    eyes.right_plr_exposed, eyes.right_plr_consensual,
+                    eyes.left_plr_exposed, eyes.left_plr_consensual,
+                    eyes.right_menace, eyes.left_menace,
+                    eyes.right_palpebral, eyes.left_palpebral,
+                    eyes.right_nystagmus, eyes.left_nystagmus
                 );
 
                 if (sts < 0)
@@ -359,16 +281,20 @@ int main(int argc, char *argv[])
                     if (eyesCtl.present == 0)
                     {
                         log_message("", "Eyes controller disconnected");
-                        shmData->eyes.connected = 0;
+                        shmSensorUpdate(SHM_EYES, &shmData->eyes.connected, 0);
                     }
                 }
                 else
                 {
-                    updatePrevInputResponse();
+                    dirty &= ~( EYES_RESPONSE_BITS | SHM_BIT(eyes, send_input_response) );
+                    if (eyes.send_input_response)
+                    {
+                        clearCommandFlag(&shmData->eyes.send_input_response);
+                    }
                 }
             }
 
-            usleep(50000);  // 50ms polling interval
+            loopTimerWait(&loopTimer);  // 50ms polling interval
         }
     }
 
@@ -54,17 +54,20 @@
 
 using namespace std;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 
 void init_touch_sensors(void );
 void read_touch_sensors(void );
 void read_touch_sensor(int chan );
 
-char msgbuf[2048];
+static char msgbuf[2048];
 
-int type = 0;
+#ifndef SIM_RUNTIME
 int debug = 0;
-int isDaemon = 0;
+#endif
+static int isDaemon = 0;
 
 /*
  * Auto Calibration for Pulse Touch Sensors
@@ -91,6 +94,7 @@ struct senseChans
 	int last;
 	int ain;
 	int baseline;
+	struct ainStream stream;	// Set in init_touch_sensors
 };
 
 struct senseChans senseChannels [] =
@@ -103,11 +107,13 @@ int main(int argc, char *argv[])
 {
 	int sts;
 	int c;
-	int loops;
+	int loops = 0;
+	struct loopTimer loop;
 	
 	opterr = 0;
 	
-	while (( c = getopt(argc, argv, "hD" ) ) != -1 )
+	// Under simRuntime the options were taken by the runtime, and getopt is not thread safe
+	while ( ! simHosted && ( c = getopt(argc, argv, "hD" ) ) != -1 )
 	{
 		switch ( c )
 		{
@@ -157,6 +163,7 @@ int main(int argc, char *argv[])
 	{
 		printf("Starting Loop\n");
 	}
+	loopTimerStart(&loop, LOOP_PULSE, 200000 );
 	
 	while ( 1 )
 	{
@@ -176,7 +183,7 @@ int main(int argc, char *argv[])
 	
 			loops = 0;
 		}
-		usleep(200000 );
+		loopTimerWait(&loop );
 	}
 	if ( isDaemon )
 	{
@@ -195,7 +202,13 @@ init_touch_sensors(void )
 	
 	for ( chan = 0 ; chan < 2 ; chan++ )
 	{
-		sensor = read_ain(senseChannels[chan].ainChannel );
+		if ( ainStreamOpen(&senseChannels[chan].stream, senseChannels[chan].ainChannel, 200000 ) < 0 )
+		{
+			sprintf(msgbuf, "Can not open touch sensor AIN%d - Exiting", senseChannels[chan].ainChannel );
+			log_message("", msgbuf );
+			exit ( -2 );
+		}
+		sensor = ainStreamSample(&senseChannels[chan].stream );
 		position = senseChannels[chan].position;
 		if ( ! debug )
 		{
@@ -241,10 +254,10 @@ read_touch_sensors(void )
 			switch ( senseChannels[chan].position )
 			{
 				case PULSE_RIGHT_FEMORAL:
-					shmData->pulse.right_femoral = pressure;
+					shmSensorUpdate(SHM_PULSE, &shmData->pulse.right_femoral, pressure );
 					break;
 				case PULSE_LEFT_FEMORAL:
-					shmData->pulse.left_femoral = pressure;
+					shmSensorUpdate(SHM_PULSE, &shmData->pulse.left_femoral, pressure );
 					break;
 				default:
 					break;
@@ -258,15 +271,16 @@ read_touch_sensor(int chan )
 	int sensor;
 	int diff;
 	int on;
-	int ainChan = senseChannels[chan].ainChannel ;
 	int position = senseChannels[chan].position ;
 	
-	sensor = read_ain(ainChan );
+	// The mean of the captured frames since the last pass, when ainCapture is running
+	sensor = ainStreamSample(&senseChannels[chan].stream );
 	senseChannels[chan].ain = sensor;
 	
 	if ( ! debug )
 	{
 		shmData->pulse.ain[position] = sensor;
+		ainHistoryPush(senseChannels[chan].ainChannel, ainNow(), sensor );
 	}
 	if ( ( sensor > 4096 ) || ( sensor < 0 ) )
 	{
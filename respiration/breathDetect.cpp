@@ -0,0 +1,197 @@
+/*
+ * breathDetect.cpp
+ *
+ * Streaming detector for manual breaths on the breath pressure sensor
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Each sample goes through:
+ *	1: A one pole low-pass, to remove ADC noise
+ *	2: A smoothed derivative, used to find where the rise of a breath started
+ *	3: A baseline that follows a low percentile of the signal. It rises slowly and
+ *	   falls quickly, so it tracks the sensor's resting level and drift without
+ *	   being pulled up by the breaths. It is held while a breath is in progress.
+ *	4: Hysteresis on the level above the baseline. A breath starts when the level
+ *	   stays above the threshold for BREATH_ONSET_MS, and ends when it stays below
+ *	   a lower release level for BREATH_END_MS.
+ *
+ * The onset time is taken from the start of the rise, not the threshold crossing.
+ * The area under the level above the baseline is kept as the breath volume.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "breathDetect.h"
+
+#define NSEC_PER_MSEC	1000000LL
+
+void
+breathDetectInit(struct breathDetect *det, int periodUs )
+{
+	double period = periodUs / 1000000.0;
+
+	memset(det, 0, sizeof(struct breathDetect) );
+	det->lowAlpha = 1.0 - exp(-2.0 * M_PI * BREATH_LOWPASS_HZ * period );
+	det->slopeAlpha = 1.0 - exp(-2.0 * M_PI * BREATH_SLOPE_HZ * period );
+	det->state = BREATH_STATE_IDLE;
+}
+
+/*
+ * Function: breathDetectSample
+ *
+ * Run one sample through the detector.
+ *
+ * Parameters: ts - sample time, CLOCK_MONOTONIC nsec
+ *             ain - raw ADC sample. Samples of 0 or less are read failures and are skipped.
+ *             threshold - level above the baseline that starts a breath
+ *
+ * Returns: BREATH_EVENT_ONSET when a breath is confirmed, BREATH_EVENT_END when it ends,
+ *			otherwise BREATH_EVENT_NONE. det->onset, end and area describe the breath.
+ */
+int
+breathDetectSample(struct breathDetect *det, long long ts, int ain, int threshold )
+{
+	double release = (double)threshold / BREATH_RELEASE_DIV;
+	double above;
+	double prev;
+	double dt;
+
+	if ( ain <= 0 )
+	{
+		return ( BREATH_EVENT_NONE );
+	}
+	if ( ! det->primed )
+	{
+		det->level = ain;
+		det->baseline = ain;
+		det->slope = 0;
+		det->lastTs = ts;
+		det->primed = 1;
+		return ( BREATH_EVENT_NONE );
+	}
+	dt = ( ts - det->lastTs ) / 1000000000.0;
+	det->lastTs = ts;
+	if ( dt <= 0 )
+	{
+		return ( BREATH_EVENT_NONE );
+	}
+
+	prev = det->level;
+	det->level += det->lowAlpha * ( ain - det->level );
+	det->slope += det->slopeAlpha * ( ( ( det->level - prev ) / dt ) - det->slope );
+
+	if ( det->state == BREATH_STATE_IDLE )
+	{
+		if ( det->level > det->baseline )
+		{
+			det->baseline += BREATH_BASE_STEP * BREATH_BASE_PERCENTILE;
+		}
+		else
+		{
+			det->baseline -= BREATH_BASE_STEP * ( 1.0 - BREATH_BASE_PERCENTILE );
+		}
+	}
+	above = det->level - det->baseline;
+
+	if ( det->slope > BREATH_SLOPE_MIN )
+	{
+		if ( det->riseStart == 0 )
+		{
+			det->riseStart = ts;
+		}
+	}
+	else if ( det->slope <= 0 && det->state == BREATH_STATE_IDLE )
+	{
+		det->riseStart = 0;
+	}
+
+	switch ( det->state )
+	{
+		case BREATH_STATE_IDLE:
+			if ( above > threshold )
+			{
+				det->state = BREATH_STATE_RISING;
+				det->stateTs = ts;
+				det->area = above * dt;
+				det->peak = above;
+			}
+			break;
+
+		case BREATH_STATE_RISING:
+			if ( above <= threshold )
+			{
+				// A spike, not a breath. Its rise must not become the onset of the next one.
+				det->state = BREATH_STATE_IDLE;
+				det->riseStart = 0;
+				break;
+			}
+			det->area += above * dt;
+			if ( above > det->peak )
+			{
+				det->peak = above;
+			}
+			if ( ts - det->stateTs >= BREATH_ONSET_MS * NSEC_PER_MSEC )
+			{
+				det->state = BREATH_STATE_ACTIVE;
+				det->onset = det->riseStart ? det->riseStart : det->stateTs;
+				det->end = 0;
+				return ( BREATH_EVENT_ONSET );
+			}
+			break;
+
+		case BREATH_STATE_ACTIVE:
+		case BREATH_STATE_FALLING:
+			if ( above > 0 )
+			{
+				det->area += above * dt;
+			}
+			if ( above > det->peak )
+			{
+				det->peak = above;
+			}
+			if ( ts - det->onset >= BREATH_MAX_MS * NSEC_PER_MSEC )
+			{
+				// Held high for too long, take it as a shift of the resting level
+				det->end = ts;
+				det->baseline = det->level;
+				det->state = BREATH_STATE_IDLE;
+				det->riseStart = 0;
+				return ( BREATH_EVENT_END );
+			}
+			if ( above >= release )
+			{
+				det->state = BREATH_STATE_ACTIVE;
+			}
+			else if ( det->state == BREATH_STATE_ACTIVE )
+			{
+				det->state = BREATH_STATE_FALLING;
+				det->stateTs = ts;
+			}
+			else if ( ts - det->stateTs >= BREATH_END_MS * NSEC_PER_MSEC )
+			{
+				det->end = det->stateTs;
+				det->state = BREATH_STATE_IDLE;
+				det->riseStart = 0;
+				return ( BREATH_EVENT_END );
+			}
+			break;
+	}
+	return ( BREATH_EVENT_NONE );
+}
@@ -0,0 +1,71 @@
+/*
+ * breathDetect.h
+ *
+ * Streaming detector for manual breaths on the breath pressure sensor
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BREATHDETECT_H_
+#define BREATHDETECT_H_
+
+#define BREATH_LOWPASS_HZ		15.0	// Low-pass corner on the raw samples
+#define BREATH_SLOPE_HZ			5.0		// Smoothing of the derivative
+#define BREATH_BASE_PERCENTILE	0.10	// Baseline follows this percentile of the signal
+#define BREATH_BASE_STEP		0.5		// Baseline step per sample, in ADC counts
+#define BREATH_RELEASE_DIV		4		// End when below baseline + threshold / BREATH_RELEASE_DIV
+#define BREATH_SLOPE_MIN		200.0	// Rise rate (counts/sec) that starts a possible breath
+#define BREATH_ONSET_MS			20		// Time above the threshold to confirm a breath
+#define BREATH_END_MS			30		// Time below the release level to end a breath
+#define BREATH_MAX_MS			5000	// Longest breath, ended regardless of the level
+
+#define BREATH_EVENT_NONE		0
+#define BREATH_EVENT_ONSET		1
+#define BREATH_EVENT_END		2
+
+#define BREATH_STATE_IDLE		0
+#define BREATH_STATE_RISING		1	// Above threshold, waiting for BREATH_ONSET_MS
+#define BREATH_STATE_ACTIVE		2
+#define BREATH_STATE_FALLING	3	// Below release, waiting for BREATH_END_MS
+
+struct breathDetect
+{
+	// Filter coefficients, from the sample period
+	double lowAlpha;
+	double slopeAlpha;
+
+	int primed;
+	double level;				// Low-passed signal
+	double slope;				// Smoothed derivative of level, counts/sec
+	double baseline;			// Moving low percentile of level
+	long long lastTs;
+
+	int state;
+	long long riseStart;		// Start of the current rise, 0 if not rising
+	long long stateTs;			// Time the state last changed
+
+	// The current or last breath
+	long long onset;			// CLOCK_MONOTONIC nsec
+	long long end;
+	double area;				// Integral of level above baseline, count-sec
+	double peak;				// Highest level above baseline
+};
+
+void breathDetectInit(struct breathDetect *det, int periodUs );
+int breathDetectSample(struct breathDetect *det, long long ts, int ain, int threshold );
+
+#endif /* BREATHDETECT_H_ */
@@ -42,30 +42,39 @@
 #include <string.h>
 #include "../comm/simUtil.h"
 #include "../comm/shmData.h"
+#include "breathDetect.h"
+
+#define BREATH_SAMPLE_US	2000
+#define DEFAULT_THREASHOLD	50
 
 using namespace std;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 
-char msgbuf[2048];
+static char msgbuf[2048];
 
-int type = 0;
+#ifndef SIM_RUNTIME
 int debug = 0;
-int isDaemon = 0;
-int baseline = 0;
-int monitor = 0;
+#endif
+static int isDaemon = 0;
+static int monitor = 0;
 
 int main(int argc, char *argv[])
 {
 	int c;
 	int ain;
-	int sense = 0;
-	int activeLoops;
-	int senseCount = 0;
+	struct ainStream breathAin;
+	struct breathDetect detect;
+	struct loopTimer loop;
+	long long ts;
+	int threshold;
+	unsigned int dirty;
 	opterr = 0;
-	int baselineLoopCount = 0;
 	
-	while (( c = getopt(argc, argv, "vDm" ) ) != -1 )
+	// Under simRuntime the options were taken by the runtime, and getopt is not thread safe
+	while ( ! simHosted && ( c = getopt(argc, argv, "vDm" ) ) != -1 )
 	{
 		switch ( c )
 		{
@@ -110,79 +119,89 @@ int main(int argc, char *argv[])
 		while ( 1 )
 		{
 			usleep(250000 );
-			printf("AIN %d, Base %d, Manual %d\n",
+			printf("AIN %d, Base %d, Manual %d, Active %d, Breaths %d, Last %dms %d\n",
 				shmData->manual_breath_ain,
 				shmData->manual_breath_baseline,
-				shmData->respiration.manual_breath );
+				shmData->respiration.manual_breath,
+				shmData->respiration.active,
+				shmData->respiration.breath_count,
+				shmData->respiration.breath_duration,
+				shmData->respiration.breath_volume );
 		}
 	}
-	while ( baseline == 0 )
+	// Samples every 2ms, from the ainCapture ring when it is running
+	if ( ainStreamOpen(&breathAin, BREATH_AIN_CHANNEL, BREATH_SAMPLE_US ) < 0 )
+	{
+		log_message("", "Can not open breath sensor AIN - Exiting" );
+		exit ( -2 );
+	}
+	breathDetectInit(&detect, BREATH_SAMPLE_US );
+	while ( ! detect.primed )
 	{
-		baseline = read_ain(BREATH_AIN_CHANNEL );
+		ain = ainStreamNext(&breathAin, &ts );
+		breathDetectSample(&detect, ts, ain, DEFAULT_THREASHOLD );
 	}
-	sprintf(msgbuf, "Breath baseline: %d", baseline );
+	sprintf(msgbuf, "Breath baseline: %d", (int)detect.baseline );
 	log_message("", msgbuf); 
-	shmData->manual_breath_baseline = baseline;
-	
-#define DEFAULT_THREASHOLD 50
+	shmData->manual_breath_baseline = (int)detect.baseline;
 	shmData->manual_breath_threashold = DEFAULT_THREASHOLD;
-	shmData->manual_breath_count = senseCount;
+	shmData->manual_breath_count = 0;
+	shmWriteBegin(SHM_RESPIRATION );
+	dirty = shmFieldSet(SHM_RESPIRATION, &shmData->respiration.breath_count, 0 );
+	dirty |= shmFieldSet(SHM_RESPIRATION, &shmData->respiration.active, 0 );
+	shmWriteEnd(SHM_RESPIRATION, dirty );
 	
+	// The stream sets the pace, the timer only keeps the statistics
+	loopTimerStart(&loop, LOOP_BREATH, BREATH_SAMPLE_US );
 	while ( 1 )
 	{
-		usleep(2000 );	
-		ain = read_ain(BREATH_AIN_CHANNEL );
+		loop.next = breathAin.next;
+		ain = ainStreamNext(&breathAin, &ts );
+		loopTimerMark(&loop, ainNow() );
 		shmData->manual_breath_ain = ain;
-		if ( ain == 0 )
+		ainHistoryPush(BREATH_AIN_CHANNEL, ts, ain );
+		
+		// The threshold may be tuned in shared memory while running
+		threshold = shmData->manual_breath_threashold;
+		if ( threshold <= 0 )
 		{
-			senseCount = 0;
-			continue;
+			threshold = DEFAULT_THREASHOLD;
 		}
-		if ( ain < baseline ) 
+		switch ( breathDetectSample(&detect, ts, ain, threshold ) )
 		{
-			baseline = ain - 10;
-			shmData->manual_breath_baseline = baseline;
-		}
-		switch ( sense )
-		{
-			case 0:
-				if ( ain > (baseline + shmData->manual_breath_threashold ) )
-				{
-					senseCount++;
-					if ( senseCount >= 100 )
-					{
-						sense = 1;
-						shmData->respiration.active = 1;
-						senseCount = 0;
-					}
-				}
-				else if ( senseCount )
-				{
-					senseCount -= 1;
-				}
+			case BREATH_EVENT_ONSET:
+				shmWriteBegin(SHM_RESPIRATION );
+				dirty = shmFieldSet(SHM_RESPIRATION, &shmData->respiration.active, 1 );
+				shmData->respiration.breath_onset = detect.onset;
+				shmData->respiration.breath_end = 0;
+				shmWriteEnd(SHM_RESPIRATION, dirty );
+				// Sent to the sim-mgr at the start of the breath, not after it
+				shmSensorUpdate(SHM_RESPIRATION, &shmData->respiration.manual_breath, 1 );
 				break;
-			case 1:
-				if ( (ain < ( baseline+2 )) || 
-					(activeLoops++ > 100) )
+				
+			case BREATH_EVENT_END:
+				shmWriteBegin(SHM_RESPIRATION );
+				dirty = shmFieldSet(SHM_RESPIRATION, &shmData->respiration.active, 0 );
+				dirty |= shmFieldSet(SHM_RESPIRATION, &shmData->respiration.breath_count,
+									 shmData->respiration.breath_count + 1 );
+				dirty |= shmFieldSet(SHM_RESPIRATION, &shmData->respiration.breath_duration,
+									 (int)( ( detect.end - detect.onset ) / 1000000 ) );
+				dirty |= shmFieldSet(SHM_RESPIRATION, &shmData->respiration.breath_volume, (int)detect.area );
+				shmData->respiration.breath_end = detect.end;
+				shmWriteEnd(SHM_RESPIRATION, dirty );
+				shmData->manual_breath_count = shmData->respiration.breath_count;
+				if ( debug )
 				{
-					shmData->respiration.manual_breath = 1;
-					//sprintf(msgbuf, "Breath: %d, Baseline %d", ain, baseline );
-					//log_message("", msgbuf); 
-					sense = 0;
-					shmData->respiration.active = 0;
-					senseCount = 0;
-					activeLoops = 0;
+					printf("Breath: %dms, volume %d, peak %d\n",
+						shmData->respiration.breath_duration,
+						shmData->respiration.breath_volume,
+						(int)detect.peak );
 				}
 				break;
+				
+			default:
+				break;
 		}
-		if ( (baselineLoopCount++ > 100) && (ain > (baseline+15)) )
-		{
-			baseline += 1;
-			baselineLoopCount = 0;
-			shmData->manual_breath_baseline = baseline;
-		}
-
-		shmData->manual_breath_threashold = DEFAULT_THREASHOLD;
-		shmData->manual_breath_count = senseCount;
+		shmData->manual_breath_baseline = (int)detect.baseline;
 	}
 }
@@ -0,0 +1,192 @@
+/*
+ * simRuntime.cpp
+ *
+ * Runs the sim-ctl daemons as threads of a single process
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Each daemon's source is built here with -DSIM_RUNTIME and its main() renamed,
+ * and is started on its own thread. The daemons share this process's shmData
+ * mapping and debug flag; daemonize(), the later initSHM() calls and the daemons'
+ * own option parsing are skipped once simHosted is set. The shared memory segment is still created, so
+ * ctlstatus and the test tools work as before.
+ *
+ * The separate daemons, started by initialization/simctl, remain the default.
+ * A daemon that calls exit() ends the whole runtime.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "../comm/shmData.h"
+#include "../comm/simUtil.h"
+
+int simControllerMain(int argc, char *argv[] );
+int soundSenseMain(int argc, char *argv[] );
+int rfidScanMain(int argc, char *argv[] );
+int pulseMain(int argc, char *argv[] );
+int breathSenseMain(int argc, char *argv[] );
+int cprScanMain(int argc, char *argv[] );
+int eyesScanMain(int argc, char *argv[] );
+
+struct shmData *shmData;
+int debug = 0;
+
+static char msgbuf[256];
+
+// simctl waits this long after simController, which creates and fills shmData
+#define RUNTIME_START_DELAY	2
+
+struct subsystem
+{
+	const char *name;
+	int (*entry)(int argc, char *argv[] );
+	int enabled;
+	pthread_t thread;
+};
+
+static struct subsystem subsystems[] =
+{
+	{ "simController",	simControllerMain,	1 },	// Must be first
+	{ "pulse",			pulseMain,			1 },
+	{ "rfidScan",		rfidScanMain,		1 },
+	{ "soundSense",		soundSenseMain,		1 },
+	{ "breathSense",	breathSenseMain,	1 },
+	{ "cprScan",		cprScanMain,		1 },
+	{ "eyesScan",		eyesScanMain,		1 },
+};
+#define SUBSYSTEMS	( sizeof(subsystems) / sizeof(subsystems[0]) )
+
+static void *
+subsystemThread(void *arg )
+{
+	struct subsystem *ss = (struct subsystem *)arg;
+	char *argv[2];
+	int sts;
+
+	argv[0] = (char *)ss->name;
+	argv[1] = NULL;
+	sts = ss->entry(1, argv );
+
+	snprintf(msgbuf, sizeof(msgbuf), "simRuntime: %s returned %d", ss->name, sts );
+	log_message("", msgbuf );
+	return ( NULL );
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int found;
+	int c;
+
+	opterr = 0;
+
+	while (( c = getopt(argc, argv, "hDx:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 'D':
+				debug++;
+				break;
+
+			case 'x':
+				found = 0;
+				for ( i = 0 ; i < SUBSYSTEMS ; i++ )
+				{
+					if ( strcmp(subsystems[i].name, optarg ) == 0 )
+					{
+						subsystems[i].enabled = 0;
+						found = 1;
+					}
+				}
+				if ( ! found )
+				{
+					fprintf(stderr, "Unknown subsystem '%s'\n", optarg );
+					return 1;
+				}
+				break;
+
+			case 'h':
+				printf("Usage: %s [-D] [-x subsystem]...\n", argv[0] );
+				printf("\t-D : Enable debug\n" );
+				printf("\t-x : Do not run a subsystem. One of:" );
+				for ( i = 0 ; i < SUBSYSTEMS ; i++ )
+				{
+					printf(" %s", subsystems[i].name );
+				}
+				printf("\n" );
+				exit ( 0 );
+				break;
+
+			case '?':
+				if ( optopt == 'x' )
+				  fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint (optopt))
+				  fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+				else
+				  fprintf (stderr,
+						   "Unknown option character `\\x%x'.\n",
+						   optopt);
+				return 1;
+
+			 default:
+				fprintf (stderr, "Unhandled option `-%c'.\n", c);
+				abort ();
+		}
+	}
+
+	// simHosted is set before any thread starts, so the daemons skip their own getopt
+	if ( ! debug )
+	{
+		daemonize();
+	}
+	simHosted = 1;
+
+	for ( i = 0 ; i < SUBSYSTEMS ; i++ )
+	{
+		if ( ! subsystems[i].enabled )
+		{
+			continue;
+		}
+		if ( pthread_create(&subsystems[i].thread, NULL, subsystemThread, &subsystems[i] ) != 0 )
+		{
+			snprintf(msgbuf, sizeof(msgbuf), "simRuntime: Can not start %s - Exiting", subsystems[i].name );
+			log_message("", msgbuf );
+			exit ( -1 );
+		}
+		if ( i == 0 )
+		{
+			sleep(RUNTIME_START_DELAY );
+		}
+	}
+	for ( i = 0 ; i < SUBSYSTEMS ; i++ )
+	{
+		if ( subsystems[i].enabled )
+		{
+			pthread_join(subsystems[i].thread, NULL );
+		}
+	}
+	return ( 0 );
+}
@@ -39,6 +39,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <string.h>
+#include "../comm/shmData.h"
 #include "../comm/simUtil.h"
 
 using namespace std;
@@ -92,6 +93,12 @@ int main(int argc, char *argv[])
 		}	
 	}
 	
+	// While ainCapture has the ADC, the AIN values come from its ring
+	if ( initSHM(SHM_OPEN ) )
+	{
+		shmData = NULL;
+	}
+	
 	// Controls for Chest Rise/Fall
 	tankPin = gpioPinOpen(45, GPIO_OUTPUT );
 	riseLPin = gpioPinOpen(23, GPIO_OUTPUT );
@@ -36,76 +36,44 @@
 
 #include <string.h>
 
-int debug = 1;
-
-#define PATH_MAX	512
-char ain_path[PATH_MAX];
-int ain_path_found = 0;
-
-int findAINPath(void )
-{
-	FILE *fp;
-	
-	fp = popen("find /sys/devices -name AIN0", "r" );
-	
-	while ( fgets(ain_path, PATH_MAX, fp) != NULL)
-	{
-		snprintf(ain_path, PATH_MAX, "%s", dirname(ain_path ) );	// Return the directory
-		if ( debug > 1 )
-		{
-			printf("%s\n", ain_path);
-		}
-	}
-	pclose(fp );
-	
-	if ( strlen(ain_path ) > 0 )
-	{
-		ain_path_found = 1;
-		if ( debug )
-		{
-			printf("AIN Path is %s\n", ain_path );
-		}
-	}
-	return ( 0 );
-}
+#include "../comm/shmData.h"
+#include "../comm/simUtil.h"
 
+struct shmData *shmData;
+int debug = 1;
+char msgbuf[2048];
 
-int
-read_ain(int chan )
+/*
+ * Function: ainTail
+ *
+ * Print each sample of a channel's shared memory history as it arrives
+ */
+static void
+ainTail(int chan )
 {
-	int fd;
-	int val = 0;
-	char name[1024];
-	int sts;
-	char buf[8];
+	struct ainSample sample;
+	unsigned long long tail;
+	long long start = 0;
 	
-	if ( ain_path_found == 0 )
+	if ( initSHM(SHM_OPEN ) )
 	{
-		findAINPath();
+		fprintf(stderr, "Can not open shared memory\n" );
+		exit ( -2 );
 	}
-	if ( ain_path_found == 1 )
+	tail = ainHistoryHead(chan );
+	while ( 1 )
 	{
-		snprintf(name, 1024, "%s/AIN%d", ain_path, chan);
-		fd = open (name, O_RDONLY );
-		if ( fd < 0 )
+		while ( ainHistoryGet(chan, &tail, &sample ) )
 		{
-			if ( debug )
+			if ( start == 0 )
 			{
-				fprintf(stderr, "Failed to open %s", name );
+				start = sample.ts;
 			}
-			perror("open" );
-			exit ( -2 );
-		}
-		
-		sts = read(fd, buf, 4 );
-		if ( sts == 4 )
-		{
-			val = atoi(buf );
+			printf("%10.3f, %5d\n", ( sample.ts - start ) / 1000000000.0, sample.value );
 		}
-		close(fd);
+		fflush(stdout );
+		usleep(20000 );
 	}
-
-	return ( val );
 }
 
 int
@@ -117,14 +85,53 @@ main(int argc, char *argv[] )
 	int ain3;
 	int ain4;
 	int ain5;
+	int handle[6];
+	int chan;
+	int c;
+	
+	while (( c = getopt(argc, argv, "ht:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+			case 't':
+				chan = atoi(optarg );
+				if ( chan < 0 || chan >= AIN_CHANNELS_MAX )
+				{
+					fprintf(stderr, "Bad channel %d\n", chan );
+					exit ( -1 );
+				}
+				ainTail(chan );
+				break;
+				
+			case 'h':
+			default:
+				printf("Usage: %s [-t chan]\n", argv[0] );
+				printf("\t-t : Follow the sample history of one channel, as stored by its daemon\n" );
+				exit ( 0 );
+		}
+	}
+	// While ainCapture has the ADC, the values come from its ring
+	if ( initSHM(SHM_OPEN ) )
+	{
+		shmData = NULL;
+	}
+	for ( chan = 0 ; chan < 6 ; chan++ )
+	{
+		handle[chan] = ainOpen(chan );
+		if ( handle[chan] < 0 )
+		{
+			fprintf(stderr, "Can not open AIN%d\n", chan );
+			exit ( -2 );
+		}
+	}
 	while ( 1 )
 	{
-		ain0 = read_ain(0 );
-		ain1 = read_ain(1 );
-		ain2 = read_ain(2 );
-		ain3 = read_ain(3 );
-		ain4 = read_ain(4 );
-		ain5 = read_ain(5 );
+		ain0 = ainRead(handle[0] );
+		ain1 = ainRead(handle[1] );
+		ain2 = ainRead(handle[2] );
+		ain3 = ainRead(handle[3] );
+		ain4 = ainRead(handle[4] );
+		ain5 = ainRead(handle[5] );
 		printf("%5d, %5d, %5d, %5d, %5d, %5d\n", ain0, ain1, ain2, ain3, ain4, ain5 );
 		
 		usleep(1000000 );
@@ -0,0 +1,154 @@
+/*
+ * beat_sched_test.cpp
+ *
+ * Check of the heart beat scheduler against on time, late, early and missing syncs
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the scheduler on a simulated clock. The sim-mgr beats at a fixed rate, and
+ * each beat's sync is delivered, with the text protocol's receive time, at the beat
+ * time plus the offset a scenario gives it, in proportion to the interval. Every lub
+ * played is recorded, and a scenario fails if two are closer than half an interval,
+ * or the count is off.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../wav-trig/beatSched.h"
+
+#define MS				1000000LL
+#define SOUND_DELAY		( 50 * MS )
+#define TEST_BEATS		60
+#define SYNC_DROPPED	-1000000000LL		// Offset of a sync that never arrives
+
+typedef long long (*syncOffset)(int beat, long long ibi );
+
+static long long
+onTime(int beat, long long ibi )
+{
+	return ( ( beat % 2 ) ? 3 * MS : -3 * MS );
+}
+
+// Every third sync is held up past the match window, after its beat has played
+static long long
+late(int beat, long long ibi )
+{
+	return ( ( beat % 3 ) == 2 ? ibi * 2 / 5 : 0 );
+}
+
+// Every third sync arrives early, inside and then outside the match window
+static long long
+early(int beat, long long ibi )
+{
+	if ( ( beat % 3 ) != 2 )
+	{
+		return ( 0 );
+	}
+	return ( ( beat % 6 ) == 2 ? -ibi / 5 : -ibi * 3 / 10 );
+}
+
+// Random jitter of up to a tenth of the interval either way
+static long long
+jitter(int beat, long long ibi )
+{
+	return ( ( rand() % 201 ) - 100 ) * ( ibi / 1000 );
+}
+
+// Syncs stop for 10 beats in the middle
+static long long
+missing(int beat, long long ibi )
+{
+	return ( ( beat >= 20 && beat < 30 ) ? SYNC_DROPPED : 0 );
+}
+
+/*
+ * Function: runScenario
+ *
+ * Returns: 0 if the beats were played as expected, 1 if not
+ */
+static int
+runScenario(const char *name, int rate, syncOffset offset, int expected )
+{
+	struct beatSched bs;
+	long long ibi = 60000000000LL / rate;
+	long long start = 1000 * MS;
+	long long end = start + TEST_BEATS * ibi;
+	long long now;
+	long long delay;
+	long long syncAt[TEST_BEATS];
+	long long lastSound = 0;
+	long long minGap = ibi;
+	int sounds = 0;
+	int beat;
+	int fail;
+
+	beatSchedInit(&bs, SOUND_DELAY );
+	beatSchedRate(&bs, rate );
+	for ( beat = 0 ; beat < TEST_BEATS ; beat++ )
+	{
+		delay = offset(beat, ibi );
+		syncAt[beat] = ( delay == SYNC_DROPPED ) ? 0 : start + beat * ibi + delay;
+	}
+	for ( now = start - ibi ; now < end ; now += MS )
+	{
+		// Syncs in the order they arrive
+		for ( beat = 0 ; beat < TEST_BEATS ; beat++ )
+		{
+			if ( syncAt[beat] > 0 && syncAt[beat] <= now )
+			{
+				beatSchedSync(&bs, syncAt[beat], 0 );
+				syncAt[beat] = 0;
+			}
+		}
+		if ( beatSchedRun(&bs, now ) & BEAT_SOUND )
+		{
+			if ( lastSound && now - lastSound < minGap )
+			{
+				minGap = now - lastSound;
+			}
+			lastSound = now;
+			sounds++;
+		}
+	}
+	fail = ( minGap < ibi / 2 ) || ( sounds < expected - 1 ) || ( sounds > expected + 1 );
+	printf("%-8s %3d bpm: %2d beats played, expected %2d, closest %3lld ms, %u predicted: %s\n",
+		name, rate, sounds, expected, minGap / MS, bs.predicted, fail ? "FAIL" : "ok" );
+	return ( fail );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	int failed = 0;
+	int rate;
+
+	srand(1 );
+	for ( rate = 60 ; rate <= 180 ; rate += 60 )
+	{
+		failed += runScenario("on time", rate, onTime, TEST_BEATS );
+		failed += runScenario("late", rate, late, TEST_BEATS );
+		failed += runScenario("early", rate, early, TEST_BEATS );
+		failed += runScenario("jitter", rate, jitter, TEST_BEATS );
+		// Coasting covers BEAT_COAST_MAX of the missing beats
+		failed += runScenario("missing", rate, missing, TEST_BEATS - 10 + BEAT_COAST_MAX );
+	}
+	printf("%s\n", failed ? "FAILED" : "PASSED" );
+	return ( failed ? 1 : 0 );
+}
@@ -0,0 +1,180 @@
+/*
+ * breath_detect_test.cpp
+ *
+ * Check of the breath detector against synthetic sensor waveforms
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Each waveform is a run of straight segments above the sensor's resting level, with
+ * an optional drift of the resting level and a little ADC noise. It is sampled at the
+ * breathSense rate and threshold, and the breaths found are checked against where
+ * the waveform's rises and falls start.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../respiration/breathDetect.h"
+
+#define SAMPLE_US		2000		// As breathSense
+#define THRESHOLD		50
+#define REST_LEVEL		1000		// ADC counts
+#define NOISE			4			// +/- ADC counts
+#define ONSET_ERR_MS	50			// Allowed lateness of the onset after the rise starts
+#define END_ERR_MS		60			// Allowed error of the end from where the fall ends
+#define TEST_SEGMENTS	32
+#define TEST_BREATHS	8
+
+#define NSEC_PER_MSEC	1000000LL
+
+struct segment
+{
+	int ms;						// Length; 0 ends the waveform
+	int level;					// Level above rest at the end, ramped from the last one
+};
+
+struct breath
+{
+	int onsetMs;
+	int endMs;
+};
+
+struct testCase
+{
+	const char *name;
+	double drift;				// Of the resting level, counts/sec
+	struct segment wave[TEST_SEGMENTS];
+	int count;
+	struct breath expect[TEST_BREATHS];
+};
+
+// One breath: 400 ms rise of 300 counts, 800 ms held, 400 ms fall, 2400 ms rest
+#define BREATH_WAVE		{ 400, 300 }, { 800, 300 }, { 400, 0 }, { 2400, 0 }
+
+static const struct testCase cases[] =
+{
+	{ "ramp", 0,
+		{ { 2000, 0 }, BREATH_WAVE, { 0, 0 } },
+		1, { { 2000, 3600 } } },
+	{ "plateau", 0,
+		{ { 2000, 0 }, { 400, 300 }, { 8000, 300 }, { 400, 0 }, { 3000, 0 }, { 0, 0 } },
+		1, { { 2000, 2000 + BREATH_MAX_MS } } },
+	{ "drift, no breaths", 15,
+		{ { 20000, 0 }, { 0, 0 } },
+		0, { } },
+	{ "drift", 5,
+		{ { 2000, 0 }, BREATH_WAVE, BREATH_WAVE, BREATH_WAVE, BREATH_WAVE, { 0, 0 } },
+		4, { { 2000, 3600 }, { 6000, 7600 }, { 10000, 11600 }, { 14000, 15600 } } },
+	{ "falling drift", -5,
+		{ { 2000, 0 }, BREATH_WAVE, BREATH_WAVE, BREATH_WAVE, { 0, 0 } },
+		3, { { 2000, 3600 }, { 6000, 7600 }, { 10000, 11600 } } },
+	{ "short spike", 0,
+		{ { 2000, 0 }, { 2, 150 }, { 8, 150 }, { 2, 0 }, { 200, 0 }, BREATH_WAVE, { 0, 0 } },
+		1, { { 2212, 3812 } } },
+	{ "spikes on a breath", 0,
+		{ { 2000, 0 }, { 400, 300 }, { 2, 450 }, { 8, 450 }, { 2, 300 }, { 788, 300 },
+		  { 400, 0 }, { 2400, 0 }, { 0, 0 } },
+		1, { { 2000, 3600 } } },
+};
+
+/*
+ * Function: runCase
+ *
+ * Returns: 0 if the breaths found match the expected ones, else 1
+ */
+static int
+runCase(const struct testCase *tc )
+{
+	struct breathDetect det;
+	struct breath got[TEST_BREATHS];
+	const struct segment *seg;
+	long long ts = 0;
+	double start = 0;
+	double level;
+	int elapsed;
+	int count = 0;
+	int ends = 0;
+	int ain;
+	int i;
+
+	srand(1 );
+	breathDetectInit(&det, SAMPLE_US );
+	for ( seg = tc->wave ; seg->ms > 0 ; seg++ )
+	{
+		for ( elapsed = 0 ; elapsed < seg->ms * 1000 ; elapsed += SAMPLE_US )
+		{
+			level = start + ( seg->level - start ) * elapsed / ( seg->ms * 1000.0 );
+			ain = REST_LEVEL + (int)( level + tc->drift * ts / 1000000000.0 ) + ( rand() % ( 2 * NOISE + 1 ) ) - NOISE;
+
+			switch ( breathDetectSample(&det, ts, ain, THRESHOLD ) )
+			{
+				case BREATH_EVENT_ONSET:
+					if ( count < TEST_BREATHS )
+					{
+						got[count].onsetMs = det.onset / NSEC_PER_MSEC;
+						got[count].endMs = -1;
+					}
+					count++;
+					break;
+
+				case BREATH_EVENT_END:
+					if ( count > 0 && count <= TEST_BREATHS )
+					{
+						got[count - 1].endMs = det.end / NSEC_PER_MSEC;
+					}
+					ends++;
+					break;
+			}
+			ts += SAMPLE_US * 1000LL;
+		}
+		start = seg->level;
+	}
+
+	if ( count != tc->count || ends != tc->count )
+	{
+		printf("%-20s %d onsets and %d ends, expected %d: FAIL\n", tc->name, count, ends, tc->count );
+		return ( 1 );
+	}
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( got[i].onsetMs < tc->expect[i].onsetMs || got[i].onsetMs > tc->expect[i].onsetMs + ONSET_ERR_MS ||
+			 abs(got[i].endMs - tc->expect[i].endMs ) > END_ERR_MS )
+		{
+			printf("%-20s breath %d at %d to %d ms, expected %d to %d: FAIL\n", tc->name, i,
+				got[i].onsetMs, got[i].endMs, tc->expect[i].onsetMs, tc->expect[i].endMs );
+			return ( 1 );
+		}
+	}
+	printf("%-20s %d breaths: ok\n", tc->name, count );
+	return ( 0 );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	unsigned int i;
+	int failed = 0;
+
+	for ( i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++ )
+	{
+		failed += runCase(&cases[i] );
+	}
+	printf("%s\n", failed ? "FAILED" : "PASSED" );
+	return ( failed ? 1 : 0 );
+}
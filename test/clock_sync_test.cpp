@@ -0,0 +1,188 @@
+/*
+ * clock_sync_test.cpp
+ *
+ * Check of the sim-mgr clock offset estimate against a scripted peer
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The peer's clock runs at an offset and a drift from ours. One clock exchange is
+ * made each heartbeat, and each direction of the exchange has the base network
+ * delay plus, in some exchanges, a queueing delay. The estimate is then checked
+ * against the peer's true clock: the offset and the drift on a clean link and on a
+ * jittered one, holding the offset through a run of delayed exchanges, and a
+ * restart after the peer's clock is stepped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../comm/simCtlComm.h"
+
+struct shmData *shmData;
+int debug = 0;
+char msgbuf[1024];		// Used by simCtlComm for its log messages
+
+#define US				1LL
+#define SEC				1000000LL
+#define EXCHANGE_US		( SYNC_HEARTBEAT_MS * 1000LL )
+#define BASE_DELAY_US	200			// Each way
+#define PEER_TURN_US	50			// From the peer's receive to its send
+#define OFFSET_ERR_US	300			// Allowed error of the estimated peer time
+#define DRIFT_ERR_PPB	5000		// Allowed error of the drift
+
+struct peer
+{
+	long long offset;			// Peer time minus ours at local 0, usec
+	long long drift;			// ppb
+};
+
+static long long
+peerTime(struct peer *pr, long long local )
+{
+	return ( local + pr->offset + ( local * pr->drift ) / 1000000000LL );
+}
+
+/*
+ * Function: exchange
+ *
+ * One clock exchange at local time t1, with extra delays on the way out and back
+ */
+static void
+exchange(simCtlComm *comm, struct peer *pr, long long t1, long long upExtra, long long downExtra )
+{
+	long long arrive = t1 + BASE_DELAY_US + upExtra;
+	long long t2 = peerTime(pr, arrive );
+	long long t3 = t2 + PEER_TURN_US;
+	long long t4 = arrive + PEER_TURN_US + BASE_DELAY_US + downExtra;
+
+	comm->clockUpdate(t1, t2, t3, t4 );
+}
+
+/*
+ * Function: offsetError
+ *
+ * Returns: The estimated peer time at local less the true one, usec
+ */
+static long long
+offsetError(simCtlComm *comm, struct peer *pr, long long local )
+{
+	long long estimate;
+
+	estimate = local + comm->clockOffset + ( ( local - comm->clockUpdated ) * comm->clockDrift ) / 1000000000LL;
+	return ( estimate - peerTime(pr, local ) );
+}
+
+/*
+ * Function: queueing
+ *
+ * Returns: A queueing delay of 1 to 30 ms for about a third of the exchanges, else 0
+ */
+static long long
+queueing(void )
+{
+	return ( ( rand() % 3 ) == 0 ? ( 1000 + rand() % 29000 ) * US : 0 );
+}
+
+static int
+check(const char *name, int ok, long long value, long long limit )
+{
+	printf("%-34s %8lld (limit %lld): %s\n", name, value, limit, ok ? "ok" : "FAIL" );
+	return ( ok ? 0 : 1 );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	simCtlComm comm;
+	struct peer pr;
+	long long t = 10 * SEC;
+	long long err;
+	long long worst;
+	int failed = 0;
+	int i;
+
+	srand(1 );
+	pr.offset = 5 * SEC;
+	pr.drift = 50000;		// 50 ppm
+	comm.clockReset();
+
+	// No queueing: every exchange has the lowest round trip
+	for ( i = 0 ; i < 60 ; i++, t += EXCHANGE_US )
+	{
+		exchange(&comm, &pr, t, 0, 0 );
+	}
+	failed += check("drift error, clean, ppb", llabs(comm.clockDrift - pr.drift ) <= DRIFT_ERR_PPB,
+					comm.clockDrift - pr.drift, DRIFT_ERR_PPB );
+
+	// Queueing delays either way. The lowest round trip exchanges set the offset.
+	worst = 0;
+	for ( i = 0 ; i < 120 ; i++, t += EXCHANGE_US )
+	{
+		exchange(&comm, &pr, t, queueing(), queueing() );
+		err = llabs(offsetError(&comm, &pr, t + EXCHANGE_US ) );
+		if ( i >= 10 && err > worst )
+		{
+			worst = err;
+		}
+	}
+	failed += check("offset error, jittered, usec", worst <= OFFSET_ERR_US, worst, OFFSET_ERR_US );
+	failed += check("drift error, ppb", llabs(comm.clockDrift - pr.drift ) <= DRIFT_ERR_PPB,
+					comm.clockDrift - pr.drift, DRIFT_ERR_PPB );
+
+	// Every exchange delayed one way for a while: the last good offset is held, and
+	// runs on with the drift
+	worst = 0;
+	for ( i = 0 ; i < 20 ; i++, t += EXCHANGE_US )
+	{
+		exchange(&comm, &pr, t, 20000 * US, 0 );
+		err = llabs(offsetError(&comm, &pr, t + EXCHANGE_US ) );
+		if ( err > worst )
+		{
+			worst = err;
+		}
+	}
+	failed += check("offset error, all delayed, usec", worst <= OFFSET_ERR_US, worst, OFFSET_ERR_US );
+
+	// The peer's clock is stepped by 2 s
+	pr.offset += 2 * SEC;
+	worst = 0;
+	for ( i = 0 ; i < 20 ; i++, t += EXCHANGE_US )
+	{
+		exchange(&comm, &pr, t, 0, 0 );
+		err = llabs(offsetError(&comm, &pr, t + EXCHANGE_US ) );
+		if ( i >= 2 && err > worst )
+		{
+			worst = err;
+		}
+	}
+	failed += check("offset error, after a step, usec", worst <= OFFSET_ERR_US, worst, OFFSET_ERR_US );
+
+	// And settles on the drift again
+	for ( i = 0 ; i < 60 ; i++, t += EXCHANGE_US )
+	{
+		exchange(&comm, &pr, t, queueing(), queueing() );
+	}
+	failed += check("drift error, after a step, ppb", llabs(comm.clockDrift - pr.drift ) <= DRIFT_ERR_PPB,
+					comm.clockDrift - pr.drift, DRIFT_ERR_PPB );
+	failed += check("offset error, after a step, usec", llabs(offsetError(&comm, &pr, t ) ) <= OFFSET_ERR_US,
+					offsetError(&comm, &pr, t ), OFFSET_ERR_US );
+
+	printf("%s\n", failed ? "FAILED" : "PASSED" );
+	return ( failed ? 1 : 0 );
+}
@@ -0,0 +1,213 @@
+/*
+ * sound_catalog_test.cpp
+ *
+ * Check of the sound catalog lookup against a scan of the sound list
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * soundSense used to scan the sound list in order and take the first line with the
+ * type and name whose limits held the rate. For each list below, the catalog must
+ * give the same sound as that scan for every type and name, at each line's
+ * low_limit - 1, low_limit, high_limit and high_limit + 1, and at every rate
+ * across the list's limits.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../wav-trig/soundCatalog.h"
+
+#define TEST_SOUNDS		16
+#define SWEEP_MARGIN	5
+
+struct testCase
+{
+	const char *name;
+	int count;
+	struct sound list[TEST_SOUNDS];
+};
+
+static const struct testCase cases[] =
+{
+	{ "disjoint", 3,
+		{ { SOUND_TYPE_HEART, 1, "normal", 0, 60 },
+		  { SOUND_TYPE_HEART, 2, "normal", 61, 120 },
+		  { SOUND_TYPE_HEART, 3, "normal", 121, 300 } } },
+	{ "first line wins", 3,
+		{ { SOUND_TYPE_HEART, 1, "normal", 0, 200 },
+		  { SOUND_TYPE_HEART, 2, "normal", 50, 100 },
+		  { SOUND_TYPE_HEART, 3, "normal", 150, 250 } } },
+	{ "inside a later line", 2,
+		{ { SOUND_TYPE_HEART, 1, "normal", 50, 100 },
+		  { SOUND_TYPE_HEART, 2, "normal", 0, 300 } } },
+	{ "same limits", 2,
+		{ { SOUND_TYPE_LUNG, 1, "normal", 0, 100 },
+		  { SOUND_TYPE_LUNG, 2, "normal", 0, 100 } } },
+	{ "single rates and gaps", 5,
+		{ { SOUND_TYPE_HEART, 1, "normal", 0, 59 },
+		  { SOUND_TYPE_HEART, 2, "normal", 60, 60 },
+		  { SOUND_TYPE_HEART, 3, "normal", 61, 100 },
+		  { SOUND_TYPE_HEART, 4, "normal", 110, 110 },
+		  { SOUND_TYPE_HEART, 5, "normal", 120, 200 } } },
+	{ "chained overlaps", 4,
+		{ { SOUND_TYPE_HEART, 1, "normal", 40, 80 },
+		  { SOUND_TYPE_HEART, 2, "normal", 60, 120 },
+		  { SOUND_TYPE_HEART, 3, "normal", 100, 160 },
+		  { SOUND_TYPE_HEART, 4, "normal", 0, 200 } } },
+	{ "types and names", 9,
+		{ { SOUND_TYPE_HEART, 1, "normal", 0, 100 },
+		  { SOUND_TYPE_HEART, 2, "murmur", 0, 80 },
+		  { SOUND_TYPE_LUNG, 3, "normal", 0, 40 },
+		  { SOUND_TYPE_LUNG, 4, "wheeze", 20, 60 },
+		  { SOUND_TYPE_PULSE, 5, "normal", 0, 300 },
+		  { SOUND_TYPE_UNUSED, 6, "normal", 0, 300 },
+		  { SOUND_TYPE_HEART, 7, "normal", 101, 300 },
+		  { SOUND_TYPE_HEART, 8, "murmur", 50, 300 },
+		  { SOUND_TYPE_GENERAL, 9, "cough", 0, 0 } } },
+	{ "inverted limits", 2,
+		{ { SOUND_TYPE_HEART, 1, "normal", 100, 50 },
+		  { SOUND_TYPE_HEART, 2, "normal", 70, 90 } } },
+};
+
+/*
+ * Function: scanFind
+ *
+ * The lookup soundSense made before the catalog
+ *
+ * Returns: The first sound in the list for the type, name and rate, or NULL
+ */
+static struct sound *
+scanFind(struct sound *list, int count, int type, const char *name, int rate )
+{
+	int i;
+
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( list[i].type == type && strcmp(list[i].name, name ) == 0 &&
+			 list[i].low_limit <= rate && list[i].high_limit >= rate )
+		{
+			return ( &list[i] );
+		}
+	}
+	return ( NULL );
+}
+
+/*
+ * Function: probe
+ *
+ * Returns: 0 if the catalog and the scan give the same sound, else 1
+ */
+static int
+probe(const char *caseName, struct soundCatalog *cat, struct sound *list, int count, int type, const char *name, int rate )
+{
+	struct sound *want = scanFind(list, count, type, name, rate );
+	struct sound *got = soundCatalogFind(cat, type, soundCatalogName(cat, name ), rate );
+
+	if ( got != want )
+	{
+		printf("%-22s type %d %s rate %d: index %d, expected %d: FAIL\n", caseName, type, name, rate,
+			got ? got->index : -1, want ? want->index : -1 );
+		return ( 1 );
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: runCase
+ *
+ * Returns: The number of probes that gave the wrong sound
+ */
+static int
+runCase(const struct testCase *tc )
+{
+	struct sound list[TEST_SOUNDS];
+	struct soundCatalog cat;
+	const char *name;
+	int low = 0;
+	int high = 0;
+	int probes = 0;
+	int failed = 0;
+	int type;
+	int rate;
+	int i;
+	int j;
+
+	memcpy(list, tc->list, sizeof(list) );
+	if ( soundCatalogBuild(&cat, list, tc->count ) != 0 )
+	{
+		printf("%-22s build failed: FAIL\n", tc->name );
+		return ( 1 );
+	}
+	for ( i = 0 ; i < tc->count ; i++ )
+	{
+		if ( i == 0 || list[i].low_limit < low )
+		{
+			low = list[i].low_limit;
+		}
+		if ( i == 0 || list[i].high_limit > high )
+		{
+			high = list[i].high_limit;
+		}
+	}
+
+	// Each name in the list, and one that is not
+	for ( j = 0 ; j <= tc->count ; j++ )
+	{
+		name = ( j < tc->count ) ? list[j].name : "absent";
+		for ( type = SOUND_TYPE_UNUSED + 1 ; type <= SOUND_TYPE_GENERAL ; type++ )
+		{
+			for ( i = 0 ; i < tc->count ; i++ )
+			{
+				failed += probe(tc->name, &cat, list, tc->count, type, name, list[i].low_limit - 1 );
+				failed += probe(tc->name, &cat, list, tc->count, type, name, list[i].low_limit );
+				failed += probe(tc->name, &cat, list, tc->count, type, name, list[i].high_limit );
+				failed += probe(tc->name, &cat, list, tc->count, type, name, list[i].high_limit + 1 );
+				probes += 4;
+			}
+			for ( rate = low - SWEEP_MARGIN ; rate <= high + SWEEP_MARGIN ; rate++ )
+			{
+				failed += probe(tc->name, &cat, list, tc->count, type, name, rate );
+				probes++;
+			}
+		}
+	}
+	if ( failed == 0 )
+	{
+		printf("%-22s %d ranges, %d probes: ok\n", tc->name, cat.rangeCount, probes );
+	}
+	free(cat.names );
+	free(cat.groups );
+	free(cat.ranges );
+	return ( failed );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	unsigned int i;
+	int failed = 0;
+
+	for ( i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++ )
+	{
+		failed += runCase(&cases[i] );
+	}
+	printf("%s\n", failed ? "FAILED" : "PASSED" );
+	return ( failed ? 1 : 0 );
+}
@@ -0,0 +1,171 @@
+/*
+ * sync_text_test.cpp
+ *
+ * Check of the sync socket's text protocol decode against messages split across reads
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Each stream is fed to syncTextDecode in reads of every size from one byte up to
+ * the whole stream, buffered as rxParse does. The end of the stream is a pause, so
+ * the bytes left are decoded once more as final. Every read size must give the same
+ * messages.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../comm/simCtlComm.h"
+
+struct shmData *shmData;
+int debug = 0;
+char msgbuf[1024];		// Used by simCtlComm for its log messages
+
+#define TEST_MESSAGES	16
+
+struct message
+{
+	int flags;
+	int port;
+};
+
+struct testCase
+{
+	const char *name;
+	const char *stream;
+	int count;
+	struct message expect[TEST_MESSAGES];
+};
+
+static const struct testCase cases[] =
+{
+	{ "pulseVPC", "pulseVPC", 1, { { SYNC_PULSE | SYNC_PULSE_VPC, 0 } } },
+	{ "pulse at the end", "pulse", 1, { { SYNC_PULSE, 0 } } },
+	{ "status port", "statusPort:50200", 1, { { SYNC_STATUS_PORT, 50200 } } },
+	{ "run together", "pulsebreathpulseVPCstatusPort:50200statusChangepulse", 6,
+		{ { SYNC_PULSE, 0 }, { SYNC_BREATH, 0 }, { SYNC_PULSE | SYNC_PULSE_VPC, 0 },
+		  { SYNC_STATUS_PORT, 50200 }, { SYNC_STATUS_CHANGE, 0 }, { SYNC_PULSE, 0 } } },
+	{ "garbage", "xxpulsePbreath", 2, { { SYNC_PULSE, 0 }, { SYNC_BREATH, 0 } } },
+	{ "version", "versionpulse", 2, { { SYNC_NONE, 0 }, { SYNC_PULSE, 0 } } },
+};
+
+/*
+ * Function: decode
+ *
+ * Decode the buffered bytes, as rxParse does, and drop the ones used
+ */
+static void
+decode(unsigned char *buf, int *len, int final, struct message *out, int *count )
+{
+	int pos = 0;
+	int used;
+	int flags;
+	int port;
+
+	while ( pos < *len )
+	{
+		flags = SYNC_NONE;
+		port = 0;
+		used = syncTextDecode(&buf[pos], *len - pos, final, &flags, &port );
+		if ( used == 0 )
+		{
+			break;
+		}
+		if ( used < 0 )
+		{
+			pos++;
+			continue;
+		}
+		if ( *count < TEST_MESSAGES )
+		{
+			out[*count].flags = flags;
+			out[*count].port = port;
+		}
+		(*count)++;
+		pos += used;
+	}
+	*len -= pos;
+	memmove(buf, &buf[pos], *len );
+}
+
+/*
+ * Function: runCase
+ *
+ * Returns: The number of read sizes that gave the wrong messages
+ */
+static int
+runCase(const struct testCase *tc )
+{
+	unsigned char buf[SYNC_RX_MAX];
+	struct message got[TEST_MESSAGES];
+	int streamLen = strlen(tc->stream );
+	int chunk;
+	int pos;
+	int n;
+	int len;
+	int count;
+	int i;
+	int failed = 0;
+
+	for ( chunk = 1 ; chunk <= streamLen ; chunk++ )
+	{
+		len = 0;
+		count = 0;
+		for ( pos = 0 ; pos < streamLen ; pos += n )
+		{
+			n = ( streamLen - pos < chunk ) ? streamLen - pos : chunk;
+			memcpy(&buf[len], &tc->stream[pos], n );
+			len += n;
+			decode(buf, &len, 0, got, &count );
+		}
+		decode(buf, &len, 1, got, &count );
+
+		for ( i = 0 ; i < count && i < tc->count ; i++ )
+		{
+			if ( got[i].flags != tc->expect[i].flags || got[i].port != tc->expect[i].port )
+			{
+				break;
+			}
+		}
+		if ( count != tc->count || i != tc->count || len != 0 )
+		{
+			printf("%-16s reads of %2d: %d messages, expected %d, first wrong %d: FAIL\n",
+				tc->name, chunk, count, tc->count, i );
+			failed++;
+		}
+	}
+	if ( failed == 0 )
+	{
+		printf("%-16s %d messages at every read size: ok\n", tc->name, tc->count );
+	}
+	return ( failed );
+}
+
+int
+main(int argc, char *argv[] )
+{
+	unsigned int i;
+	int failed = 0;
+
+	for ( i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++ )
+	{
+		failed += runCase(&cases[i] );
+	}
+	printf("%s\n", failed ? "FAILED" : "PASSED" );
+	return ( failed ? 1 : 0 );
+}
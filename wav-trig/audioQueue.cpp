@@ -0,0 +1,153 @@
+/*
+ * audioQueue.cpp
+ *
+ * Lock-free event queue to the soundSense audio dispatch thread
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A bounded ring with a sequence number in each slot. Any thread may push: a producer
+ * claims a slot by moving head with a compare and swap, fills it, and then publishes
+ * it by setting the slot's sequence. Only the dispatch thread pops. Neither side ever
+ * blocks on the other, so a producer can not be held up by the real-time thread and
+ * the real-time thread never waits on a lock held by a lower priority one.
+ *
+ * Each push also bumps the eventfd, which the consumer watches with epoll.
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "audioQueue.h"
+
+#define AUDIO_QUEUE_MASK	( AUDIO_QUEUE_LEN - 1 )
+
+/*
+ * Function: audioQueueInit
+ *
+ * Returns: 0 on success, -1 if the eventfd can not be created
+ */
+int
+audioQueueInit(struct audioQueue *q )
+{
+	unsigned int i;
+
+	memset(q, 0, sizeof(struct audioQueue) );
+	for ( i = 0 ; i < AUDIO_QUEUE_LEN ; i++ )
+	{
+		q->slots[i].seq = i;
+	}
+	q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC );
+	return ( q->fd < 0 ? -1 : 0 );
+}
+
+/*
+ * Function: audioQueuePush
+ *
+ * Add an event. Safe from any thread.
+ *
+ * Returns: 0 on success, -1 if the queue is full and the event was dropped
+ */
+int
+audioQueuePush(struct audioQueue *q, int type, int value, long long ts )
+{
+	struct audioSlot *slot;
+	unsigned int pos;
+	unsigned int seq;
+	uint64_t one = 1;
+	int diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED );
+	while ( 1 )
+	{
+		slot = &q->slots[pos & AUDIO_QUEUE_MASK];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE );
+		diff = (int)( seq - pos );
+		if ( diff == 0 )
+		{
+			if ( __atomic_compare_exchange_n(&q->head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			{
+				break;
+			}
+			// pos now holds the head another producer moved it to
+		}
+		else if ( diff < 0 )
+		{
+			// The consumer has not yet taken the event a lap ago
+			__atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED );
+			return ( -1 );
+		}
+		else
+		{
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED );
+		}
+	}
+	slot->ev.type = type;
+	slot->ev.value = value;
+	slot->ev.ts = ts;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE );
+
+	if ( write(q->fd, &one, sizeof(one) ) < 0 )
+	{
+		// The counter can only overflow if the consumer has stopped
+	}
+	return ( 0 );
+}
+
+/*
+ * Function: audioQueuePop
+ *
+ * Take the oldest event. Only the dispatch thread may call this.
+ *
+ * Returns: 1 if an event was taken, 0 if the queue is empty
+ */
+int
+audioQueuePop(struct audioQueue *q, struct audioEvent *ev )
+{
+	struct audioSlot *slot;
+	unsigned int pos = q->tail;
+
+	slot = &q->slots[pos & AUDIO_QUEUE_MASK];
+	if ( (int)( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE ) - ( pos + 1 ) ) < 0 )
+	{
+		return ( 0 );
+	}
+	*ev = slot->ev;
+	__atomic_store_n(&slot->seq, pos + AUDIO_QUEUE_LEN, __ATOMIC_RELEASE );
+	q->tail = pos + 1;
+	return ( 1 );
+}
+
+/*
+ * Function: audioQueueClear
+ *
+ * Reset the eventfd once the consumer has been woken, before it pops. Anything
+ * pushed after this wakes it again.
+ */
+void
+audioQueueClear(struct audioQueue *q )
+{
+	uint64_t count;
+
+	if ( read(q->fd, &count, sizeof(count) ) < 0 )
+	{
+		// Nothing pending
+	}
+}
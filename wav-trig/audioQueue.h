@@ -0,0 +1,61 @@
+/*
+ * audioQueue.h
+ *
+ * Lock-free event queue to the soundSense audio dispatch thread
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AUDIOQUEUE_H_
+#define AUDIOQUEUE_H_
+
+#define AUDIO_QUEUE_LEN		32		// Must be a power of 2
+
+// Event types
+#define AUDIO_EV_BEAT		1		// Pulse sync. ts is the beat time, value is 1 if ts is exact
+#define AUDIO_EV_BREATH		2		// Breath sync. ts is when it was read
+#define AUDIO_EV_RATE		3		// New heart rate in value
+#define AUDIO_EV_AIR		4		// Main loop pass: set the air valves between breaths. value is the respiration rate
+
+struct audioEvent
+{
+	int type;
+	int value;
+	long long ts;				// CLOCK_MONOTONIC nsec
+};
+
+struct audioSlot
+{
+	unsigned int seq;			// Tells which lap of the ring the slot is ready for
+	struct audioEvent ev;
+};
+
+struct audioQueue
+{
+	unsigned int head;			// Next slot to fill, shared by the producers
+	unsigned int tail;			// Next slot to take, used only by the consumer
+	unsigned int dropped;		// Events lost to a full queue
+	int fd;						// eventfd, readable while events may be queued
+	struct audioSlot slots[AUDIO_QUEUE_LEN];
+};
+
+int audioQueueInit(struct audioQueue *q );
+int audioQueuePush(struct audioQueue *q, int type, int value, long long ts );
+int audioQueuePop(struct audioQueue *q, struct audioEvent *ev );
+void audioQueueClear(struct audioQueue *q );
+
+#endif /* AUDIOQUEUE_H_ */
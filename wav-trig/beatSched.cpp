@@ -0,0 +1,250 @@
+/*
+ * beatSched.cpp
+ *
+ * Heart beat scheduler for soundSense
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The scheduler learns the inter-beat interval from the pulse syncs (the median of
+ * the last few, so a single early or late beat does not move it) and from the
+ * cardiac rate. Once it is known, each beat played sets up the next one, one interval
+ * later. When the sync for a predicted beat arrives, the beat is moved toward the
+ * sync time: all the way when the time came from the sim-mgr clock, and part of the
+ * way when it is only the time the sync was read, so network jitter is smoothed out.
+ * A sync that comes after its predicted beat has played, up to half an interval
+ * late, corrects the next beat and is not played again. A sync far from any
+ * predicted beat is played as it is.
+ *
+ * If the syncs stop, BEAT_COAST_MAX predicted beats are played, which covers a
+ * briefly lagging network, and then the scheduler waits for the next sync.
+ *
+ * All times are CLOCK_MONOTONIC nsec.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "beatSched.h"
+
+void
+beatSchedInit(struct beatSched *bs, long long delay )
+{
+	memset(bs, 0, sizeof(struct beatSched) );
+	bs->delay = delay;
+}
+
+/*
+ * Function: beatSchedLearn
+ *
+ * Add a sync to sync interval and take the median of the recent ones as the interval
+ */
+static void
+beatSchedLearn(struct beatSched *bs, long long interval )
+{
+	long long sorted[BEAT_IBI_HISTORY];
+	long long v;
+	int i;
+	int j;
+
+	if ( bs->ibiCount == BEAT_IBI_HISTORY )
+	{
+		memmove(&bs->ibiHistory[0], &bs->ibiHistory[1], sizeof(long long) * ( BEAT_IBI_HISTORY - 1 ) );
+		bs->ibiCount--;
+	}
+	bs->ibiHistory[bs->ibiCount++] = interval;
+
+	for ( i = 0 ; i < bs->ibiCount ; i++ )
+	{
+		v = bs->ibiHistory[i];
+		for ( j = i ; j > 0 && sorted[j-1] > v ; j-- )
+		{
+			sorted[j] = sorted[j-1];
+		}
+		sorted[j] = v;
+	}
+	bs->ibi = sorted[bs->ibiCount / 2];
+}
+
+/*
+ * Function: beatSchedPlan
+ *
+ * Set up the predicted beat after the one just played
+ */
+static void
+beatSchedPlan(struct beatSched *bs )
+{
+	if ( bs->ibi > 0 && bs->played > 0 && bs->coast < BEAT_COAST_MAX )
+	{
+		bs->beat = bs->played + bs->ibi;
+		bs->beatPredicted = 1;
+		bs->beatPulsed = 0;
+	}
+	else
+	{
+		bs->beat = 0;
+	}
+}
+
+/*
+ * Function: beatSchedRate
+ *
+ * Give the heart rate set by the sim-mgr. It is the interval used until syncs have
+ * been seen, and a large change restarts the learning. A rate of 0 stops prediction.
+ */
+void
+beatSchedRate(struct beatSched *bs, int rate )
+{
+	long long nominal;
+
+	if ( rate <= 0 )
+	{
+		bs->ibi = 0;
+		bs->ibiCount = 0;
+		if ( bs->beatPredicted )
+		{
+			bs->beat = 0;
+		}
+		return;
+	}
+	nominal = 60000000000LL / rate;
+	if ( bs->ibiCount == 0 || llabs(bs->ibi - nominal ) > nominal / BEAT_RATE_SLACK )
+	{
+		bs->ibiCount = 0;
+		bs->ibi = nominal;
+	}
+}
+
+/*
+ * Function: beatSchedInterval
+ *
+ * Learn from the interval since the last sync
+ */
+static void
+beatSchedInterval(struct beatSched *bs, long long ts )
+{
+	long long interval;
+
+	if ( bs->lastSync > 0 )
+	{
+		interval = ts - bs->lastSync;
+		if ( interval >= BEAT_IBI_MIN && interval <= BEAT_IBI_MAX )
+		{
+			beatSchedLearn(bs, interval );
+		}
+	}
+	bs->lastSync = ts;
+}
+
+/*
+ * Function: beatSchedSync
+ *
+ * Take a pulse sync from the sim-mgr.
+ *
+ * Parameters: ts - time of the beat
+ *             exact - ts is from the sim-mgr clock, not the time the sync was read
+ */
+void
+beatSchedSync(struct beatSched *bs, long long ts, int exact )
+{
+	double gain = exact ? BEAT_GAIN_EXACT : BEAT_GAIN_RX;
+	long long window;
+
+	bs->syncs++;
+	window = bs->ibi / BEAT_MATCH_DIV;
+
+	if ( bs->beat > 0 && bs->beatPredicted && llabs(ts - bs->beat ) <= window )
+	{
+		// The sync for the coming beat
+		bs->phaseError = ts - bs->beat;
+		bs->beat += (long long)( gain * bs->phaseError );
+		bs->beatPredicted = 0;
+		bs->coast = 0;
+		beatSchedInterval(bs, ts );
+		return;
+	}
+	if ( bs->played > 0 && bs->playedPredicted &&
+		 ts - bs->played >= -window && ts - bs->played <= bs->ibi / BEAT_LATE_DIV )
+	{
+		// The sync for a beat already played, or a late one for it. Correct the beat after it.
+		bs->phaseError = ts - bs->played;
+		bs->played += (long long)( gain * bs->phaseError );
+		bs->playedPredicted = 0;
+		bs->coast = 0;
+		beatSchedPlan(bs );
+		// A late sync's own interval is off by its lateness, so count from the beat
+		beatSchedInterval(bs, ts - bs->played > window ? bs->played : ts );
+		return;
+	}
+
+	// Not predicted: the first beat, the first after a pause, or an irregular one
+	bs->beat = ts;
+	bs->beatPredicted = 0;
+	bs->beatPulsed = 0;
+	bs->coast = 0;
+	beatSchedInterval(bs, ts );
+}
+
+/*
+ * Function: beatSchedDue
+ *
+ * Returns: The time beatSchedRun next has something to do, or 0 if no beat is coming
+ */
+long long
+beatSchedDue(struct beatSched *bs )
+{
+	if ( bs->beat == 0 )
+	{
+		return ( 0 );
+	}
+	return ( bs->beatPulsed ? bs->beat + bs->delay : bs->beat );
+}
+
+/*
+ * Function: beatSchedRun
+ *
+ * Returns: BEAT_PULSE_ON and/or BEAT_SOUND for what is due at now
+ */
+int
+beatSchedRun(struct beatSched *bs, long long now )
+{
+	int events = 0;
+
+	if ( bs->beat == 0 )
+	{
+		return ( 0 );
+	}
+	if ( ! bs->beatPulsed && now >= bs->beat )
+	{
+		bs->beatPulsed = 1;
+		events |= BEAT_PULSE_ON;
+	}
+	if ( bs->beatPulsed && now >= bs->beat + bs->delay )
+	{
+		events |= BEAT_SOUND;
+		bs->played = bs->beat;
+		bs->playedPredicted = bs->beatPredicted;
+		if ( bs->beatPredicted )
+		{
+			bs->predicted++;
+			bs->coast++;
+		}
+		beatSchedPlan(bs );
+	}
+	return ( events );
+}
@@ -0,0 +1,67 @@
+/*
+ * beatSched.h
+ *
+ * Heart beat scheduler for soundSense
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEATSCHED_H_
+#define BEATSCHED_H_
+
+#define BEAT_IBI_HISTORY		5			// Intervals the median is taken over
+#define BEAT_IBI_MIN			250000000LL	// 240 bpm
+#define BEAT_IBI_MAX			3000000000LL	// 20 bpm
+#define BEAT_RATE_SLACK			5			// A rate change of more than 1/5 restarts the learning
+#define BEAT_MATCH_DIV			4			// A sync within ibi/4 of a beat is that beat's sync
+#define BEAT_LATE_DIV			2			// or up to ibi/2 after a predicted beat already played
+#define BEAT_COAST_MAX			2			// Beats predicted with no sync before stopping
+#define BEAT_GAIN_EXACT			1.0			// Phase correction, sync time from the sim-mgr clock
+#define BEAT_GAIN_RX			0.25		// Phase correction, sync time from when it was read
+
+// Returned by beatSchedRun
+#define BEAT_PULSE_ON			1			// The beat: turn on the pulse output
+#define BEAT_SOUND				2			// The lub, BEAT delay later: play it, pulse output off
+
+struct beatSched
+{
+	long long delay;			// From the beat to its sound, nsec
+	long long ibi;				// Learned inter-beat interval, nsec. 0 if not known.
+	long long ibiHistory[BEAT_IBI_HISTORY];
+	int ibiCount;
+	long long lastSync;			// Time of the last sync, for the intervals
+
+	long long beat;				// Time of the coming beat, 0 if none
+	int beatPredicted;			// The coming beat has not had its sync
+	int beatPulsed;				// BEAT_PULSE_ON done for the coming beat
+	long long played;			// Time of the last beat that was played
+	int playedPredicted;		// and it had not had its sync
+	int coast;					// Predicted beats played since the last sync
+
+	// Statistics
+	unsigned int syncs;
+	unsigned int predicted;		// Beats played before their sync, or with none
+	long long phaseError;		// Sync time less the predicted time, last matched sync, nsec
+};
+
+void beatSchedInit(struct beatSched *bs, long long delay );
+void beatSchedRate(struct beatSched *bs, int rate );
+void beatSchedSync(struct beatSched *bs, long long ts, int exact );
+long long beatSchedDue(struct beatSched *bs );
+int beatSchedRun(struct beatSched *bs, long long now );
+
+#endif /* BEATSCHED_H_ */
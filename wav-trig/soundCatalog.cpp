@@ -0,0 +1,288 @@
+/*
+ * soundCatalog.cpp
+ *
+ * Index of the sound list, for finding the track for a sound and rate
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The names are interned once, when the list is loaded, so a name is looked up only
+ * when it changes and a rate change is resolved with integer compares alone.
+ *
+ * The sound list may give overlapping rate limits for a name, and the first line that
+ * matches is the one used. Each group is therefore flattened into ranges that do not
+ * overlap, each naming the first sound in the list that covers it, so a binary search
+ * finds the same sound the list order would.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "soundCatalog.h"
+
+static int
+nameCompare(const void *a, const void *b )
+{
+	return ( strncmp((const char *)a, (const char *)b, SOUND_NAME_LENGTH ) );
+}
+
+static int
+intCompare(const void *a, const void *b )
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+
+	return ( x < y ? -1 : x > y ? 1 : 0 );
+}
+
+/*
+ * Function: soundCatalogBuild
+ *
+ * Build the index for a loaded sound list. Entries of SOUND_TYPE_UNUSED are skipped.
+ *
+ * Returns: 0 on success, -1 if memory can not be allocated
+ */
+int
+soundCatalogBuild(struct soundCatalog *cat, struct sound *list, int count )
+{
+	int *nameOf;
+	int *bounds;
+	int *members;
+	int boundCount;
+	struct soundGroup *group;
+	struct soundRange *range;
+	struct sound *match;
+	int type;
+	int low;
+	int high;
+	int i;
+	int j;
+	int k;
+	int n;
+
+	memset(cat, 0, sizeof(struct soundCatalog) );
+	cat->names = (char (*)[SOUND_NAME_LENGTH])calloc(count + 1, SOUND_NAME_LENGTH );
+	cat->groups = (struct soundGroup *)calloc(count + 1, sizeof(struct soundGroup) );
+	cat->ranges = (struct soundRange *)calloc(2 * count + 1, sizeof(struct soundRange) );
+	nameOf = (int *)calloc(count + 1, sizeof(int) );
+	bounds = (int *)calloc(2 * count + 1, sizeof(int) );
+	members = (int *)calloc(count + 1, sizeof(int) );
+	if ( ! cat->names || ! cat->groups || ! cat->ranges || ! nameOf || ! bounds || ! members )
+	{
+		free(cat->names );
+		free(cat->groups );
+		free(cat->ranges );
+		free(nameOf );
+		free(bounds );
+		free(members );
+		memset(cat, 0, sizeof(struct soundCatalog) );
+		return ( -1 );
+	}
+
+	// Intern the names
+	for ( i = 0 ; i < count ; i++ )
+	{
+		if ( list[i].type != SOUND_TYPE_UNUSED )
+		{
+			strncpy(cat->names[cat->nameCount++], list[i].name, SOUND_NAME_LENGTH - 1 );
+		}
+	}
+	qsort(cat->names, cat->nameCount, SOUND_NAME_LENGTH, nameCompare );
+	for ( i = 0, n = 0 ; i < cat->nameCount ; i++ )
+	{
+		if ( n == 0 || nameCompare(cat->names[n-1], cat->names[i] ) != 0 )
+		{
+			memmove(cat->names[n++], cat->names[i], SOUND_NAME_LENGTH );
+		}
+	}
+	cat->nameCount = n;
+	for ( i = 0 ; i < count ; i++ )
+	{
+		nameOf[i] = soundCatalogName(cat, list[i].name );
+	}
+
+	// One group per type and name, in sorted order
+	for ( type = SOUND_TYPE_UNUSED + 1 ; type <= SOUND_TYPE_GENERAL ; type++ )
+	{
+		for ( n = 0 ; n < cat->nameCount ; n++ )
+		{
+			// The group's sounds, in list order
+			k = 0;
+			boundCount = 0;
+			for ( i = 0 ; i < count ; i++ )
+			{
+				if ( list[i].type == type && nameOf[i] == n )
+				{
+					members[k++] = i;
+					bounds[boundCount++] = list[i].low_limit;
+					bounds[boundCount++] = list[i].high_limit + 1;
+				}
+			}
+			if ( k == 0 )
+			{
+				continue;
+			}
+			group = &cat->groups[cat->groupCount++];
+			group->type = type;
+			group->name = n;
+			group->first = cat->rangeCount;
+
+			// Every limit is a bound, so each span between bounds is inside or outside
+			// each sound's limits
+			qsort(bounds, boundCount, sizeof(int), intCompare );
+			for ( j = 0 ; j + 1 < boundCount ; j++ )
+			{
+				low = bounds[j];
+				high = bounds[j+1] - 1;
+				if ( high < low )
+				{
+					continue;
+				}
+				match = NULL;
+				for ( i = 0 ; i < k ; i++ )
+				{
+					if ( list[members[i]].low_limit <= low && list[members[i]].high_limit >= high )
+					{
+						match = &list[members[i]];
+						break;
+					}
+				}
+				if ( match == NULL )
+				{
+					continue;
+				}
+				range = ( cat->rangeCount > group->first ) ? &cat->ranges[cat->rangeCount - 1] : NULL;
+				if ( range && range->sound == match && range->high + 1 == low )
+				{
+					range->high = high;
+				}
+				else
+				{
+					range = &cat->ranges[cat->rangeCount++];
+					range->low = low;
+					range->high = high;
+					range->sound = match;
+				}
+			}
+			group->count = cat->rangeCount - group->first;
+		}
+	}
+	free(nameOf );
+	free(bounds );
+	free(members );
+	return ( 0 );
+}
+
+/*
+ * Function: soundCatalogName
+ *
+ * Returns: The interned id for a sound name, or -1 if no sound has that name
+ */
+int
+soundCatalogName(struct soundCatalog *cat, const char *name )
+{
+	char key[SOUND_NAME_LENGTH];
+	char (*found)[SOUND_NAME_LENGTH];
+
+	memset(key, 0, sizeof(key) );
+	strncpy(key, name, SOUND_NAME_LENGTH - 1 );
+	found = (char (*)[SOUND_NAME_LENGTH])bsearch(key, cat->names, cat->nameCount, SOUND_NAME_LENGTH, nameCompare );
+	if ( found == NULL )
+	{
+		return ( -1 );
+	}
+	return ( (int)( found - cat->names ) );
+}
+
+/*
+ * Function: soundCatalogRange
+ *
+ * Find the range of rates, for a type and interned name, that holds a rate
+ *
+ * Returns: The range, or NULL if none covers the rate
+ */
+struct soundRange *
+soundCatalogRange(struct soundCatalog *cat, int type, int name, int rate )
+{
+	struct soundGroup *group = NULL;
+	struct soundRange *ranges;
+	int lo = 0;
+	int hi = cat->groupCount - 1;
+	int mid;
+
+	while ( lo <= hi )
+	{
+		mid = ( lo + hi ) / 2;
+		if ( cat->groups[mid].type < type ||
+			 ( cat->groups[mid].type == type && cat->groups[mid].name < name ) )
+		{
+			lo = mid + 1;
+		}
+		else if ( cat->groups[mid].type == type && cat->groups[mid].name == name )
+		{
+			group = &cat->groups[mid];
+			break;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	if ( group == NULL )
+	{
+		return ( NULL );
+	}
+
+	// The last range starting at or below the rate
+	ranges = &cat->ranges[group->first];
+	lo = 0;
+	hi = group->count - 1;
+	while ( lo < hi )
+	{
+		mid = ( lo + hi + 1 ) / 2;
+		if ( ranges[mid].low <= rate )
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	if ( group->count == 0 || ranges[lo].low > rate || ranges[lo].high < rate )
+	{
+		return ( NULL );
+	}
+	return ( &ranges[lo] );
+}
+
+/*
+ * Function: soundCatalogFind
+ *
+ * Find the sound of a type and interned name for a rate
+ *
+ * Returns: The sound, or NULL if none covers the rate
+ */
+struct sound *
+soundCatalogFind(struct soundCatalog *cat, int type, int name, int rate )
+{
+	struct soundRange *range;
+
+	range = soundCatalogRange(cat, type, name, rate );
+	return ( range ? range->sound : NULL );
+}
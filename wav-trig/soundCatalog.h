@@ -0,0 +1,74 @@
+/*
+ * soundCatalog.h
+ *
+ * Index of the sound list, for finding the track for a sound and rate
+ *
+ * This file is part of the sim-ctl distribution (https://github.com/OpenVetSimDevelopers/sim-ctl).
+ *
+ * Copyright (c) 2019-2026 VetSim, Cornell University College of Veterinary Medicine Ithaca, NY
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOUNDCATALOG_H_
+#define SOUNDCATALOG_H_
+
+#define SOUND_TYPE_UNUSED	0
+#define SOUND_TYPE_HEART	1
+#define SOUND_TYPE_LUNG		2
+#define SOUND_TYPE_PULSE	3
+#define SOUND_TYPE_GENERAL	4
+
+#define SOUND_NAME_LENGTH	32
+struct sound
+{
+	int type;
+	int index;
+	char name[SOUND_NAME_LENGTH];
+	int low_limit;
+	int high_limit;
+};
+
+// A span of rates played by one sound
+struct soundRange
+{
+	int low;
+	int high;
+	struct sound *sound;
+};
+
+// The ranges for one type and name, in rate order
+struct soundGroup
+{
+	int type;
+	int name;
+	int first;				// Index in ranges
+	int count;
+};
+
+struct soundCatalog
+{
+	char (*names)[SOUND_NAME_LENGTH];	// Interned names, sorted
+	int nameCount;
+	struct soundGroup *groups;			// Sorted by type, then name
+	int groupCount;
+	struct soundRange *ranges;
+	int rangeCount;
+};
+
+int soundCatalogBuild(struct soundCatalog *cat, struct sound *list, int count );
+int soundCatalogName(struct soundCatalog *cat, const char *name );
+struct soundRange *soundCatalogRange(struct soundCatalog *cat, int type, int name, int rate );
+struct sound *soundCatalogFind(struct soundCatalog *cat, int type, int name, int rate );
+
+#endif /* SOUNDCATALOG_H_ */
@@ -36,6 +36,10 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <iomanip>
 #include <iostream>
@@ -50,11 +54,15 @@
 
 
 #include "wavTrigger.h"
+#include "beatSched.h"
+#include "audioQueue.h"
+#include "soundCatalog.h"
 #include "../cardiac/rfidScan.h"
 
 #include "../comm/simCtlComm.h"
 #include "../comm/simUtil.h"
 #include "../comm/shmData.h"
+#include "../comm/simFields.h"
 
 wavTrigger wav;
 wavTrigger wav2;
@@ -62,7 +70,9 @@ wavTrigger *wavPulse;
 
 simCtlComm comm;
 
+#ifndef SIM_RUNTIME
 struct shmData *shmData;
+#endif
 
 char msgbuf[1024];
 
@@ -81,25 +91,33 @@ pthread_t threadInfo3;
 
 /* prototype for thread routines */
 void *sync_thread ( void *ptr );
-void runHeart(void );
+void *audio_thread ( void *ptr );
 void lungFall(int control );
 void lungRise(int control );
 void runLung(void );
-void initialize_timers(void );
-timer_t heart_timer;
-timer_t breath_timer;
-timer_t rise_timer;
-struct sigevent heart_sev;
-struct sigevent breath_sev;
-struct sigevent rise_sev;
-	
-time_t fallStopTime = 0;
-
-#define HEART_TIMER_SIG		(SIGRTMIN+2)
-#define BREATH_TIMER_SIG	(SIGRTMIN+3)
-#define RISE_TIMER_SIG		(SIGRTMIN+4)
+void setHeartVolume(int force );
 
 #define SOUND_LOOP_DELAY	20000	// Delay in usec
+#define BARK_WAIT_MS		5000	// Longest wait for the bark, or the sounds before it, to end
+
+// Heart beats and breaths are played by audio_thread, which runs at real-time priority
+// and sleeps in epoll on audioEvents and its timers. sync_thread passes it the syncs
+// and the main loop passes it the heart rate. beatSched times the heart beats.
+#define AUDIO_THREAD_PRIORITY	40
+#define BREATH_SOUND_DELAY		40000000LL		// From the breath sync to its sound, nsec
+#define AIR_SWITCH_DELAY		10000000LL		// Between closing one air valve and opening the next
+#define FALL_STOP_DELAY			10000000000LL	// The exhale valve is closed after this
+
+// The chest rise/fall sequence of a breath
+#define AIR_IDLE			0
+#define AIR_FALL_OFF		1	// Exhale valve closed, waiting to start the rise
+#define AIR_RISE			2	// Inhaling
+#define AIR_RISE_OFF		3	// Rise valve closed, waiting to open the exhale valve
+#define AIR_FALL_PULSE		4	// No chest movement: exhale valve briefly opened
+
+struct audioQueue audioEvents;
+struct beatSched beats;
+int audioHold = 0;		// Set by the main loop while it plays the bark
 
 using namespace std;
 
@@ -107,9 +125,11 @@ using namespace std;
 
 char sioName[2][MAX_BUF];
 
+#ifndef SIM_RUNTIME
 int debug = 0;
+#endif
 int ldebug = 0;
-int monitor = 0;
+static int monitor = 0;
 int soundTest = 0;
 
 void runMonitor(void );
@@ -174,6 +194,7 @@ struct current
 	int heart_sound_mute;
 	int heart_rate;
 	char heart_sound[32];
+	int heartName;				// Interned in soundCatalog
 	
 	int left_lung_sound_volume;
 	int left_lung_sound_mute;
@@ -181,6 +202,8 @@ struct current
 	int right_lung_sound_volume;
 	int right_lung_sound_mute;
 	char right_lung_sound[32];
+	int leftLungName;
+	int rightLungName;
 	int respiration_rate;
 	
 	unsigned int heartCount;
@@ -203,12 +226,6 @@ int lubdub = 0;
 int inhL = 0;
 int inhR = 0;
 
-#define SOUND_TYPE_UNUSED	0
-#define SOUND_TYPE_HEART	1
-#define SOUND_TYPE_LUNG		2
-#define SOUND_TYPE_PULSE	3
-#define SOUND_TYPE_GENERAL	4
-
 #define SOUND_TYPE_LENGTH	8
 struct soundType
 {
@@ -238,21 +255,12 @@ typeNameToIndex(char *typeName )
 	}
 	return -1;
 }
-#define SOUND_NAME_LENGTH	32
-struct sound
-{
-	int type;
-	int index;
-	char name[SOUND_NAME_LENGTH];
-	int low_limit;
-	int high_limit;
-};
-
 // The Tsunami is capable of supporting up to 4096 tracks
 #define SOUND_NUM_TRACKS		(4096)
 int maxSounds = 0;
 struct sound *soundList;
 int soundIndex = 0;
+struct soundCatalog soundCatalog;
 
 int
 addSoundToList(int type, int index, const char *name, int low_limit, int high_limit )
@@ -359,6 +367,17 @@ initSoundList(void )
 			log_message("", msgbuf);
 		}
 	}
+	fclose(file );
+	if ( soundCatalogBuild(&soundCatalog, soundList, soundIndex ) != 0 )
+	{
+		snprintf(msgbuf, 1024, "Failed to index sound list" );
+		log_message("", msgbuf);
+		exit ( -2 );
+	}
+	// Nothing is selected until the first names are read
+	current.heartName = -1;
+	current.leftLungName = -1;
+	current.rightLungName = -1;
 	return ( 0 );
 }
 
@@ -377,22 +396,146 @@ showSounds(void )
 	}
 }
 
+/*
+ * Look-ahead for the heart and lung tracks. While the rate moves toward the edge of
+ * its band, the track for the band beyond is loaded, paused, with its gain set, from
+ * the main loop. When the rate crosses, the next trigger resumes it, one frame where a
+ * play takes two, and the track it replaces is faded out if it is still sounding.
+*/
+#define AHEAD_STEPS			2		// Rate changes to look ahead
+#define AHEAD_MARGIN_HEART	5		// Look ahead when this close to the edge, bpm
+#define AHEAD_MARGIN_LUNG	2		// Breaths/min
+#define HEART_FADE_MS		30		// Fade out of the last beat under the new one
+#define LUNG_FADE_MS		100
+
+struct trackAhead
+{
+	int type;
+	int margin;
+	int rate;				// Last rate seen, or -1
+	int step;				// Last change of rate
+	int loaded;				// Track loaded for the next band, or -1. Claimed by the audio thread
+	int played;				// Last track triggered. Audio thread only
+};
+
+struct trackAhead heartAhead = { SOUND_TYPE_HEART, AHEAD_MARGIN_HEART, -1, 0, -1, -1 };
+struct trackAhead leftLungAhead = { SOUND_TYPE_LUNG, AHEAD_MARGIN_LUNG, -1, 0, -1, -1 };
+struct trackAhead rightLungAhead = { SOUND_TYPE_LUNG, AHEAD_MARGIN_LUNG, -1, 0, -1, -1 };
+
+/*
+ * Function: lookAhead
+ *
+ * Called from the main loop once track has been chosen for rate. Predict the next band
+ * from the trend of the rate and load its track, or drop a loaded track no longer
+ * expected. other is a track loaded by another trackAhead, which is not loaded twice.
+ */
+static void
+lookAhead(struct trackAhead *ahead, int name, int rate, int track, int gain, int other )
+{
+	struct soundRange *range;
+	struct sound *next = NULL;
+	int reach;
+	int want = -1;
+	int loaded;
+	
+	if ( rate != ahead->rate )
+	{
+		ahead->step = ( ahead->rate < 0 ) ? 0 : rate - ahead->rate;
+		ahead->rate = rate;
+	}
+	reach = abs(ahead->step ) * AHEAD_STEPS;
+	if ( reach < ahead->margin )
+	{
+		reach = ahead->margin;
+	}
+	range = soundCatalogRange(&soundCatalog, ahead->type, name, rate );
+	if ( range && ahead->step > 0 && range->high - rate < reach )
+	{
+		next = soundCatalogFind(&soundCatalog, ahead->type, name, range->high + 1 );
+	}
+	else if ( range && ahead->step < 0 && rate - range->low < reach )
+	{
+		next = soundCatalogFind(&soundCatalog, ahead->type, name, range->low - 1 );
+	}
+	if ( next && next->index != track && next->index != other )
+	{
+		want = next->index;
+	}
+	
+	loaded = __atomic_load_n(&ahead->loaded, __ATOMIC_ACQUIRE );
+	if ( loaded == want || loaded == track )
+	{
+		// Already loaded, or the band was entered and the next trigger takes it
+		return;
+	}
+	if ( loaded >= 0 && __atomic_compare_exchange_n(&ahead->loaded, &loaded, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+	{
+		wav.trackStop(0, loaded );
+	}
+	if ( want >= 0 )
+	{
+		wav.trackGain(want, gain );
+		wav.trackLoop(0, want, false );
+		wav.trackLoad(0, want );
+		__atomic_store_n(&ahead->loaded, want, __ATOMIC_RELEASE );
+	}
+}
+
+/*
+ * Function: dropAhead
+ *
+ * Stop a loaded track, so it is not counted as playing
+ */
+static void
+dropAhead(struct trackAhead *ahead )
+{
+	int loaded;
+	
+	loaded = __atomic_exchange_n(&ahead->loaded, -1, __ATOMIC_ACQ_REL );
+	if ( loaded >= 0 )
+	{
+		wav.trackStop(0, loaded );
+	}
+}
+
+/*
+ * Function: playAhead
+ *
+ * Called from the audio thread to trigger track. A loaded track is resumed, as it is
+ * already open and at its start. The track played before is faded out if the board
+ * reports it still playing.
+ */
+static void
+playAhead(struct trackAhead *ahead, int track, int fadeMs )
+{
+	int loaded = track;
+	
+	if ( __atomic_compare_exchange_n(&ahead->loaded, &loaded, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+	{
+		wav.trackResume(0, track );
+	}
+	else
+	{
+		wav.trackPlayPoly(0, track );
+	}
+	if ( ahead->played >= 0 && ahead->played != track && wav.checkTrack(ahead->played ) )
+	{
+		wav.trackFade(ahead->played, MIN_VOLUME, fadeMs, true );
+	}
+	ahead->played = track;
+}
+
 void
 getHeartFiles(void )
 {
 	int hr = shmData->cardiac.rate;
-	int i;
 	int new_lubdub = -1;
 	struct sound *sound;
 	
-	for ( i = 0 ;  i < maxSounds ; i++ )
+	sound = soundCatalogFind(&soundCatalog, SOUND_TYPE_HEART, current.heartName, hr );
+	if ( sound )
 	{
-		sound = &soundList[i];
-		if ( ( sound->type == SOUND_TYPE_HEART ) && ( strcmp(sound->name, current.heart_sound ) == 0 ) && ( sound->low_limit <= hr ) && ( sound->high_limit >= hr ) )
-		{
-			new_lubdub = sound->index;
-			break;
-		}
+		new_lubdub = sound->index;
 	}
 	if ( new_lubdub == -1 )
 	{
@@ -401,8 +544,14 @@ getHeartFiles(void )
 	}
 	else
 	{
+		if ( new_lubdub != lubdub )
+		{
+			// Set before the switch, as the beat may come before the main loop's volume update
+			wav.trackGain(new_lubdub, current.heartGain );
+		}
 		lubdub = new_lubdub;
 	}
+	lookAhead(&heartAhead, current.heartName, hr, lubdub, current.heartGain, -1 );
 	snprintf(msgbuf, 1024, "Get Heart Files %s : %d", 
 		current.heart_sound, lubdub );
 	log_message("", msgbuf);
@@ -411,28 +560,19 @@ void
 getLungFiles(void )
 {
 	int breathRate = shmData->respiration.rate;
-	int i;
 	int new_inhL = -1;
 	int new_inhR = -1;
 	struct sound *sound;
 	
-	for ( i = 0 ;  i < maxSounds ; i++ )
+	sound = soundCatalogFind(&soundCatalog, SOUND_TYPE_LUNG, current.leftLungName, breathRate );
+	if ( sound )
 	{
-		sound = &soundList[i];
-		if ( ( sound->type == SOUND_TYPE_LUNG ) && (strcmp(sound->name, current.left_lung_sound ) == 0 ) && ( sound->low_limit <= breathRate ) && ( sound->high_limit >= breathRate ) )
-		{
-			new_inhL = sound->index;
-			break;
-		}
+		new_inhL = sound->index;
 	}
-	for ( i = 0 ;  i < maxSounds ; i++ )
+	sound = soundCatalogFind(&soundCatalog, SOUND_TYPE_LUNG, current.rightLungName, breathRate );
+	if ( sound )
 	{
-		sound = &soundList[i];
-		if ( ( sound->type == SOUND_TYPE_LUNG ) && (strcmp(sound->name, current.right_lung_sound ) == 0 ) && ( sound->low_limit <= breathRate ) && ( sound->high_limit >= breathRate ) )
-		{
-			new_inhR = sound->index;
-			break;
-		}
+		new_inhR = sound->index;
 	}
 	if ( new_inhL == -1 )
 	{
@@ -452,13 +592,13 @@ getLungFiles(void )
 	{
 		inhR = new_inhR;
 	}
+	lookAhead(&leftLungAhead, current.leftLungName, breathRate, inhL, current.leftLungGain, -1 );
+	lookAhead(&rightLungAhead, current.rightLungName, breathRate, inhR, current.rightLungGain,
+			  __atomic_load_n(&leftLungAhead.loaded, __ATOMIC_ACQUIRE ) );
 	snprintf(msgbuf, 1024, "Get Lung Files %s : %d, %s : %d", 
 		current.left_lung_sound, inhL, current.right_lung_sound, inhR );
 	log_message("", msgbuf);
 }
-unsigned int heartLast = 0;
-int heartState = 0;
-unsigned int lungLast = 0;
 int lungState = 0;
 
 FILE *riseLPin;
@@ -472,14 +612,18 @@ int fallOnOff;
 
 void doReport(void )
 {
-	snprintf(msgbuf, 1024, "Counts: %d, %d, Heart State %d, Heart Gain %d Lung State %d Lung Gain R-%d L-%d Master Gain %d  heart %d inh R-%d L-%d", 
+	snprintf(msgbuf, 1024, "Counts: %d, %d, Heart IBI %d, Heart Gain %d Lung State %d Lung Gain R-%d L-%d Master Gain %d  heart %d inh R-%d L-%d", 
 				current.heartCount, current.breathCount, 
-				heartState, current.heartGain, 
-				lungState, current.rightLungGain, current.leftLungGain, 
+				(int)( beats.ibi / 1000000 ), current.heartGain, 
+				__atomic_load_n(&lungState, __ATOMIC_RELAXED ), current.rightLungGain, current.leftLungGain, 
 				current.masterGain,
 				lubdub, inhR, inhL );
 	
 	log_message("", msgbuf);
+	
+	snprintf(msgbuf, 1024, "WAV frames %u, coalesced %u, writes %u, suppressed %u (%u bytes)",
+				wav.framesQueued, wav.framesCoalesced, wav.writes, wav.framesSuppressed, wav.bytesSaved );
+	log_message("", msgbuf);
 }
 
 // Volume is a range of 0 to 10, 
@@ -513,8 +657,7 @@ void allAirOff(int quiet )
 	{
 		shmData->respiration.riseState = 0;
 		shmData->respiration.fallState = 0;
-		fallStopTime = 0;
-		lungState = 0;
+		__atomic_store_n(&lungState, 0, __ATOMIC_RELAXED );
 	}
 }
 /*
@@ -560,8 +703,12 @@ main(int argc, char *argv[] )
 	struct sigaction new_action;
 	int changed;
 	int listenState = FALSE;
+	struct cardiac card;
+	struct respiration resp;
+	unsigned int dirty;
 	
-	while (( c = getopt(argc, argv, "smdth" ) ) != -1 )
+	// Under simRuntime the options were taken by the runtime, and getopt is not thread safe
+	while ( ! simHosted && ( c = getopt(argc, argv, "smdth" ) ) != -1 )
 	{
 		switch ( c )
 		{
@@ -694,6 +841,8 @@ main(int argc, char *argv[] )
 			allAirOff(1);
 			return (-1 );
 		}
+		// First pass of the main loop checks the full state
+		shmDirtyReset(SHM_READER_SOUND );
 	}
 	
 	if ( debug > 1 )
@@ -744,14 +893,6 @@ main(int argc, char *argv[] )
 	wav.start(sfd, 0 );
 	usleep(500000);
 	
-	if ( debug < 4 )
-	{
-		if ( debug > 1 )
-		{
-			printf("initialize_timers\n" );
-		}
-		initialize_timers();
-	}
 	if ( sfd < 0 )
 	{
 	}
@@ -856,17 +997,11 @@ main(int argc, char *argv[] )
 	snprintf(msgbuf, 1024, "Initial Bark");
 	log_message("", msgbuf);	
 	wav.trackPlaySolo(0, 5);	// Bark
-	while ( wav.getTracksPlaying() > 0 )
-	{
-		usleep(10000);
-	}
+	wav.waitTrackDone(5, BARK_WAIT_MS );
 	if ( debug == 3 )
 	{
 		wav.trackPlaySolo(0, 1);	// Play Cassiopeia
-		while ( wav.getTracksPlaying() > 0 )
-		{
-			usleep(10000);
-		}
+		wav.waitTrackDone(1, -1 );
 	}
 	if ( debug > 3 )
 	{
@@ -884,10 +1019,7 @@ main(int argc, char *argv[] )
 			wavPulse->trackPlayPoly(4, PULSE_TRACK); // Pulse
 			wavPulse->trackPlayPoly(5, PULSE_TRACK); // Pulse
 			usleep(100000);
-			while ( wavPulse->getTracksPlaying() > 0 )
-			{
-				usleep(10000);
-			}
+			wavPulse->waitAllDone(-1 );
 		
 			switch ( i % 5 )
 			{
@@ -926,6 +1058,14 @@ main(int argc, char *argv[] )
 	current.heartGain = -65;
 	
 	wavPulse->trackGain(PULSE_TRACK, MAX_MAX_VOLUME );
+	
+	if ( audioQueueInit(&audioEvents ) < 0 )
+	{
+		snprintf(msgbuf, 1024, "audioQueueInit fails %s", strerror(errno) );
+		log_message("", msgbuf );
+		exit ( -1 );
+	}
+	pthread_create (&threadInfo2, NULL, &audio_thread,(void *) NULL );
 	pthread_create (&threadInfo1, NULL, &sync_thread,(void *) NULL );
 	
 	// Main loop monitors the volumes and keeps them set
@@ -954,12 +1094,14 @@ main(int argc, char *argv[] )
 				wav.channelGain(0, MAX_VOLUME);
 				current.masterGain = MAX_VOLUME;
 			}
-			shmData->auscultation.col  = 1;
-			shmData->auscultation.row  = 1;
-			shmData->auscultation.side = 1;
-			shmData->auscultation.heartStrength = 10;
-			shmData->auscultation.leftLungStrength = 10;
-			shmData->auscultation.rightLungStrength = 0;
+			shmWriteBegin(SHM_AUSCULTATION );
+			dirty  = shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.col, 1 );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.row, 1 );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.side, 1 );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.heartStrength, 10 );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.leftLungStrength, 10 );
+			dirty |= shmFieldSet(SHM_AUSCULTATION, &shmData->auscultation.rightLungStrength, 0 );
+			shmWriteEnd(SHM_AUSCULTATION, dirty );
 		}
 		else
 		{
@@ -970,22 +1112,21 @@ main(int argc, char *argv[] )
 				if ( listenState == TRUE )
 				{
 					int savedVolume = current.masterGain;
+					__atomic_store_n(&audioHold, 1, __ATOMIC_RELEASE );
 					wav.channelGain(0, 0);
 					current.masterGain = 0;
-					while ( wav.getTracksPlaying() > 0 )
-					{
-						usleep(10000);
-					}
+					dropAhead(&heartAhead );
+					dropAhead(&leftLungAhead );
+					dropAhead(&rightLungAhead );
+					wav.waitAllDone(BARK_WAIT_MS );
 					//wav.trackGain(5, 0 );
 					wav.stopAllTracks();
 					snprintf(msgbuf, 1024, "Enter Listen State Bark");
 					log_message("", msgbuf);
 					wav.trackPlaySolo(0, 5);	// Bark
-					while ( wav.getTracksPlaying() > 0 )
-					{
-						usleep(10000);
-					}
+					wav.waitTrackDone(5, BARK_WAIT_MS );
 					wav.channelGain(0, savedVolume);
+					__atomic_store_n(&audioHold, 0, __ATOMIC_RELEASE );
 				}
 			}
 			if ( ( shmData->auscultation.side == 0 ) && ( current.masterGain != MIN_VOLUME ) )
@@ -1014,18 +1155,31 @@ main(int argc, char *argv[] )
 			}
 		}
 		
+		// Check for heart/lung changes. The dirty masks say which fields were written,
+		// so the sound names are only compared after a write to them. The copies are
+		// consistent, so a new rate is never paired with a half written sound name.
 		changed = 0;
-		// Check for heart/lung changes
-		if ( ( current.heart_rate != shmData->cardiac.rate ) || 
-			 ( strcmp(current.heart_sound, shmData->cardiac.heart_sound) != 0 ) )
-		{
-			snprintf(msgbuf, 1024, "Cardiac %d:%d, %s, %s", 
-				 current.heart_rate, shmData->cardiac.rate,
-				 current.heart_sound, shmData->cardiac.heart_sound	 );
-			log_message("", msgbuf);		
-			current.heart_rate = shmData->cardiac.rate;
-			memcpy(current.heart_sound, shmData->cardiac.heart_sound, 32 );
-			changed = 1;
+		dirty = shmDirtyTake(SHM_READER_SOUND, SHM_CARDIAC );
+		if ( dirty & ( SHM_BIT(cardiac, rate) | SHM_BIT(cardiac, heart_sound) ) )
+		{
+			shmSnapshot(SHM_CARDIAC, &card );
+			if ( ( current.heart_rate != card.rate ) || 
+				 ( strcmp(current.heart_sound, card.heart_sound) != 0 ) )
+			{
+				snprintf(msgbuf, 1024, "Cardiac %d:%d, %s, %s", 
+					 current.heart_rate, card.rate,
+					 current.heart_sound, card.heart_sound	 );
+				log_message("", msgbuf);		
+				current.heart_rate = card.rate;
+				if ( strcmp(current.heart_sound, card.heart_sound) != 0 )
+				{
+					// Only a new name is looked up; a rate change needs no string compare
+					memcpy(current.heart_sound, card.heart_sound, 32 );
+					current.heartName = soundCatalogName(&soundCatalog, current.heart_sound );
+				}
+				audioQueuePush(&audioEvents, AUDIO_EV_RATE, current.heart_rate, 0 );
+				changed = 1;
+			}
 		}
 		if ( changed )
 		{
@@ -1034,19 +1188,33 @@ main(int argc, char *argv[] )
 		}
 		
 		changed = 0;
-		if ( ( current.respiration_rate != shmData->respiration.rate ) ||
-			 ( strcmp(current.left_lung_sound, shmData->respiration.left_lung_sound) != 0 ) ||
-			 ( strcmp(current.right_lung_sound, shmData->respiration.right_lung_sound) != 0 ) )
-		{
-			snprintf(msgbuf, 1024, "Resp %d:%d, %s, %s, %s, %s", 
-				 current.respiration_rate, shmData->respiration.rate,
-				 current.left_lung_sound, shmData->respiration.left_lung_sound,
-				 current.right_lung_sound, shmData->respiration.right_lung_sound );
-			log_message("", msgbuf);
-			current.respiration_rate = shmData->respiration.rate;
-			memcpy(current.left_lung_sound, shmData->respiration.left_lung_sound, 32 );
-			memcpy(current.right_lung_sound, shmData->respiration.right_lung_sound, 32 );
-			changed = 1;
+		dirty = shmDirtyTake(SHM_READER_SOUND, SHM_RESPIRATION );
+		if ( dirty & ( SHM_BIT(respiration, rate) | SHM_BIT(respiration, left_lung_sound) |
+					   SHM_BIT(respiration, right_lung_sound) ) )
+		{
+			shmSnapshot(SHM_RESPIRATION, &resp );
+			if ( ( current.respiration_rate != resp.rate ) ||
+				 ( strcmp(current.left_lung_sound, resp.left_lung_sound) != 0 ) ||
+				 ( strcmp(current.right_lung_sound, resp.right_lung_sound) != 0 ) )
+			{
+				snprintf(msgbuf, 1024, "Resp %d:%d, %s, %s, %s, %s", 
+					 current.respiration_rate, resp.rate,
+					 current.left_lung_sound, resp.left_lung_sound,
+					 current.right_lung_sound, resp.right_lung_sound );
+				log_message("", msgbuf);
+				current.respiration_rate = resp.rate;
+				if ( strcmp(current.left_lung_sound, resp.left_lung_sound) != 0 )
+				{
+					memcpy(current.left_lung_sound, resp.left_lung_sound, 32 );
+					current.leftLungName = soundCatalogName(&soundCatalog, current.left_lung_sound );
+				}
+				if ( strcmp(current.right_lung_sound, resp.right_lung_sound) != 0 )
+				{
+					memcpy(current.right_lung_sound, resp.right_lung_sound, 32 );
+					current.rightLungName = soundCatalogName(&soundCatalog, current.right_lung_sound );
+				}
+				changed = 1;
+			}
 		}
 		if ( changed )
 		{
@@ -1055,7 +1223,8 @@ main(int argc, char *argv[] )
 		}
 		
 		runLung();
-		runHeart();
+		setHeartVolume(1 );	// Force volume setting as the track may have changed
+		
 		usleep(SOUND_LOOP_DELAY );
 	}
 }
@@ -1063,6 +1232,8 @@ main(int argc, char *argv[] )
 void *
 sync_thread ( void *ptr )
 {
+	struct syncEvent event;
+	long long beatTs;
 	int sts;
 	
 	sts = comm.openListen(LISTEN_ACTIVE );
@@ -1076,26 +1247,55 @@ sync_thread ( void *ptr )
 
 	while ( 1 )
 	{
-		sts = comm.wait();
+		sts = comm.waitEvent(&event );
+		shmData->syncStats.framed = comm.framedVersion;
+		shmData->syncStats.events++;
+		shmData->syncStats.lastRxTime = event.rxTime;
+		if ( event.framed )
+		{
+			shmData->syncStats.lost += event.lost;
+			shmData->syncStats.lastSeq = event.seq;
+			shmData->syncStats.lastMgrTime = event.mgrTime;
+		}
 		if ( sts & (SYNC_PULSE | SYNC_PULSE_VPC ) )
 		{
 			current.heartCount += 1;
+			
+			// The beat time is the sim-mgr's, when its clock offset is known
+			beatTs = -1;
+			if ( event.framed )
+			{
+				beatTs = clockSyncLocal(event.mgrTime );
+			}
+			if ( beatTs > 0 )
+			{
+				audioQueuePush(&audioEvents, AUDIO_EV_BEAT, 1, beatTs );
+			}
+			else
+			{
+				audioQueuePush(&audioEvents, AUDIO_EV_BEAT, 0, event.rxTime );
+			}
 		}
 		if ( sts & SYNC_BREATH )
 		{
 			current.breathCount += 1;
-			allAirOff(0 );
+			audioQueuePush(&audioEvents, AUDIO_EV_BREATH, 0, event.rxTime );
 		}
 		if( sts & SYNC_STATUS_PORT )
 		{
 			shmData->simMgrStatusPort = comm.simMgrStatusPort;
 		}
+		if( sts & SYNC_STATUS_CHANGE )
+		{
+			shmStatusNotify();
+		}
 	}
 }
 void
 setHeartVolume(int force )
 {
 	int gain = current.heartGain;
+	int loaded;
 	
 	if ( force ||
 		 ( current.heart_sound_mute != shmData->cardiac.heart_sound_mute ) ||
@@ -1126,12 +1326,17 @@ setHeartVolume(int force )
 	if ( force || ( gain != current.heartGain ) )
 	{
 		wav.trackGain(lubdub, current.heartGain );
+		if ( ( loaded = __atomic_load_n(&heartAhead.loaded, __ATOMIC_ACQUIRE ) ) >= 0 )
+		{
+			wav.trackGain(loaded, current.heartGain );
+		}
 	}
 }
 void
 setLeftLungVolume(int force )
 {
 	int gain = current.leftLungGain;
+	int loaded;
 	
 	if ( force ||
 		 ( current.left_lung_sound_mute != shmData->respiration.left_lung_sound_mute ) ||
@@ -1156,6 +1361,10 @@ setLeftLungVolume(int force )
 		if ( shmData->auscultation.side != 2 )
 		{
 			wav.trackGain(inhL, current.leftLungGain );
+			if ( ( loaded = __atomic_load_n(&leftLungAhead.loaded, __ATOMIC_ACQUIRE ) ) >= 0 )
+			{
+				wav.trackGain(loaded, current.leftLungGain );
+			}
 		}
 	}
 }
@@ -1163,6 +1372,7 @@ void
 setRightLungVolume(int force )
 {
 	int gain = current.rightLungGain;
+	int loaded;
 	
 	if ( force ||
 		 ( current.right_lung_sound_mute != shmData->respiration.right_lung_sound_mute ) ||
@@ -1186,70 +1396,189 @@ setRightLungVolume(int force )
 		if ( shmData->auscultation.side != 1 )
 		{
 			wav.trackGain(inhR, current.rightLungGain );
+			if ( ( loaded = __atomic_load_n(&rightLungAhead.loaded, __ATOMIC_ACQUIRE ) ) >= 0 )
+			{
+				wav.trackGain(loaded, current.rightLungGain );
+			}
 		}
 	}
 }
 
-void 
-runHeart ( void )
+#define EXH_LIMIT 400
+int exhLimit = EXH_LIMIT;
+#define INH_LIMIT 1.5
+double inhLimit = INH_LIMIT;
+
+// epoll tags for audio_thread
+#define DISPATCH_QUEUE		1
+#define DISPATCH_BEAT		2
+#define DISPATCH_SOUND		3
+#define DISPATCH_AIR		4
+#define DISPATCH_FALL_STOP	5
+#define DISPATCH_TIMERS		4
+
+int dispatchFD[DISPATCH_TIMERS+1];
+int airPhase = AIR_IDLE;
+
+/*
+ * Function: dispatchTimerSet
+ *
+ * Arm a dispatch timer to fire once at the CLOCK_MONOTONIC time at (nsec), or stop it if at is 0
+ */
+static void
+dispatchTimerSet(int tag, long long at )
 {
 	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its) );
+	its.it_value.tv_sec = at / 1000000000LL;
+	its.it_value.tv_nsec = at % 1000000000LL;
+	timerfd_settime(dispatchFD[tag], TFD_TIMER_ABSTIME, &its, NULL );
+}
+
+/*
+ * Function: inhaleTime
+ *
+ * Returns: The time the chest rises on a breath, 30% of the respiration period, in nsec
+ */
+static long long
+inhaleTime(void )
+{
+	double periodSeconds;
+	double inhTime;
 	
-	if ( shmData->auscultation.side != 0 && shmData->cardiac.pea == 0 )
+#define INH_PERCENT		(0.30)
+	if ( shmData->respiration.rate > 0 )
 	{
-		setHeartVolume(1 );	// Force volume setting as the track may have changed
+		periodSeconds = ( 1 / (double)shmData->respiration.rate ) * 60;
 	}
 	else
 	{
-		setHeartVolume(1 );	// Set volume only if a change occurred
+		periodSeconds = 2;
 	}
-	switch ( heartState )
+	inhTime = periodSeconds * INH_PERCENT;
+	if ( inhTime > inhLimit )
 	{
-		case 0:
-			if ( heartLast != current.heartCount )
-			{
-				heartLast = current.heartCount;
-				gpioPinSet(pulsePin, TURN_ON );
-				//if ( shmData->auscultation.side != 0 )
-				//{
-					its.it_interval.tv_sec = 0;
-					its.it_interval.tv_nsec = 0;
-					
-					// Set First expiration as the interval plus the delay
-					its.it_value.tv_sec = 0;
-					its.it_value.tv_nsec = LUB_DELAY;
-					if (timer_settime(heart_timer, 0, &its, NULL) == -1)
-					{
-						perror("runHeart: timer_settime");
-						//snprintf(msgbuf, 1024, "runHeart: timer_settime: %s", strerror(errno) );
-						//log_message("", msgbuf );
-						exit ( -1 );
-					}
-				//}
-			}
-			break;
-		case 1:
+		inhTime = inhLimit;
+	}
+	if ( inhTime < 0 )
+	{
+		snprintf(msgbuf, 1024, "inhaleTime: inhTime (%f) is negative. period %f rate %d", inhTime, periodSeconds, shmData->respiration.rate );
+		inhTime = inhLimit;
+		log_message("", msgbuf );
+	}
+	return ( (long long)( inhTime * 1000000000.0 ) );
+}
+
+/*
+ * Function: dispatchHeart
+ *
+ * Play the heart beats due at now, and set the beat timer for the next one
+ */
+static void
+dispatchHeart(long long now )
+{
+	int events;
+	
+	while ( ( events = beatSchedRun(&beats, now ) ) != 0 )
+	{
+		if ( events & BEAT_PULSE_ON )
+		{
+			gpioPinSet(pulsePin, TURN_ON );
+		}
+		if ( events & BEAT_SOUND )
+		{
 			gpioPinSet(pulsePin, TURN_OFF );
-			if ( shmData->cardiac.pea == 0 )
+			if ( shmData->cardiac.pea == 0 && ! __atomic_load_n(&audioHold, __ATOMIC_ACQUIRE ) )
 			{
-				//if ( shmData->auscultation.side != 0 )
-				//{
-					// gpioPinSet(pulsePin, TURN_OFF );
-					wav.trackPlayPoly(0, lubdub);
-					//snprintf(msgbuf, 1024, "runHeart: lub (%d) Gain is %d", lub, heartGain );
-					//log_message("", msgbuf );
-					heartState = 0;
-					heartPlaying = 1;
-				//}
-				//else
-				//{
-				//	heartState = 0;
-				//	heartPlaying = 0;
-				//}
+				playAhead(&heartAhead, lubdub, HEART_FADE_MS );
+				heartPlaying = 1;
 				
 				// Check pulse palpation
 				doPulse();
 			}
+			shmData->syncStats.beatIbi = beats.ibi / 1000;
+			shmData->syncStats.beatPredicted = beats.predicted;
+			shmData->syncStats.beatPhase = beats.phaseError / 1000;
+		}
+	}
+	dispatchTimerSet(DISPATCH_BEAT, beatSchedDue(&beats ) );
+}
+
+/*
+ * Function: dispatchBreath
+ *
+ * Start a breath on its sync: close the exhale valve, and set the timers for the
+ * chest rise and the breath sound
+ */
+static void
+dispatchBreath(long long now )
+{
+	allAirOff(0 );
+	if ( shmData->respiration.active )
+	{
+		// Manual respiration, run by dispatchAirIdle
+		airPhase = AIR_IDLE;
+		return;
+	}
+	__atomic_store_n(&lungState, 1, __ATOMIC_RELAXED );
+	dispatchTimerSet(DISPATCH_SOUND, now + BREATH_SOUND_DELAY );
+	dispatchTimerSet(DISPATCH_FALL_STOP, 0 );
+	
+	lungFall(TURN_OFF );
+	fallOnOff = 0;
+	airPhase = AIR_FALL_OFF;
+	dispatchTimerSet(DISPATCH_AIR, now + AIR_SWITCH_DELAY );
+}
+
+/*
+ * Function: dispatchAir
+ *
+ * Step the chest rise/fall sequence when its timer fires
+ */
+static void
+dispatchAir(long long now )
+{
+	switch ( airPhase )
+	{
+		case AIR_FALL_OFF:
+			if ( shmData->respiration.chest_movement )
+			{
+				if ( debug ) printf("ON\n" );
+				lungRise(TURN_ON );
+			}
+			riseOnOff = 1;
+			airPhase = AIR_RISE;
+			dispatchTimerSet(DISPATCH_AIR, now + inhaleTime() );
+			break;
+			
+		case AIR_RISE:
+			lungRise(TURN_OFF );
+			riseOnOff = 0;
+			if ( shmData->respiration.chest_movement )
+			{
+				airPhase = AIR_RISE_OFF;
+			}
+			else
+			{
+				// When chest movement is disabled, just pulse the exhale valve
+				lungFall(TURN_ON );
+				airPhase = AIR_FALL_PULSE;
+			}
+			exhLimit = EXH_LIMIT;
+			dispatchTimerSet(DISPATCH_AIR, now + AIR_SWITCH_DELAY );
+			break;
+			
+		case AIR_RISE_OFF:
+			lungFall(TURN_ON );
+			fallOnOff = 1;
+			airPhase = AIR_IDLE;
+			break;
+			
+		case AIR_FALL_PULSE:
+			lungFall(TURN_OFF );
+			fallOnOff = 0;
+			airPhase = AIR_IDLE;
 			break;
 			
 		default:
@@ -1257,189 +1586,199 @@ runHeart ( void )
 	}
 }
 
+/*
+ * Function: dispatchAirIdle
+ *
+ * Set the air valves between breaths, on each pass of the main loop. Kept on this
+ * thread so the valves and airPhase have a single owner, and a sequence under way,
+ * such as the AIR_FALL_PULSE, is not cut short.
+ *
+ * Parameters: rate - the respiration rate the main loop has
+ */
 static void
-delay_handler(int sig, siginfo_t *si, void *uc)
+dispatchAirIdle(int rate )
 {
-	if ( sig == HEART_TIMER_SIG )
+	if ( ! shmData->respiration.chest_movement && airPhase == AIR_IDLE )
 	{
-		if ( heartState == 0 )
-		{
-			heartState = 1;
-		}
-		else if ( heartState == 2 )
+		allAirOff(0);
+	}
+	if ( shmData->respiration.active ) // && shmData->respiration.chest_movement )
+	{
+		// Manual Respiration
+		lungFall(TURN_OFF );
+		if ( shmData->respiration.chest_movement )
 		{
-			heartState = 3;
+			lungRise(TURN_ON );
 		}
 	}
-	else if ( sig == BREATH_TIMER_SIG )
+	else if ( lungState == 0 && airPhase == AIR_IDLE && rate == 0 )
 	{
-		if ( lungState == 0 )
+		if ( exhLimit-- == 0 )
 		{
-			lungState = 1;
+			if ( debug ) printf("OFF\n" );
+			lungFall(TURN_OFF );
+			fallOnOff = 0;
+			lungRise(TURN_OFF );
+			snprintf(msgbuf, 1024, "dispatchAirIdle: exhLimit Hit" );
+			log_message("", msgbuf );
 		}
-	}	
+	}
 }
-#define EXH_LIMIT 400
-int exhLimit = EXH_LIMIT;
-#define INH_LIMIT 1.5
-double inhLimit = INH_LIMIT;
 
+/*
+ * Function: dispatchLungSound
+ *
+ * Play the breath sound for the side being listened to
+ */
 static void
-rise_handler(int sig, siginfo_t *si, void *uc)
+dispatchLungSound(long long now )
 {
-	if ( shmData->respiration.chest_movement )
+	if ( shmData->auscultation.side > 0 && shmData->auscultation.side < 4 &&
+		 ! __atomic_load_n(&audioHold, __ATOMIC_ACQUIRE ) )
 	{
-		// Stop rise
-		lungRise(TURN_OFF );
-		riseOnOff = 0;
-		usleep(10000);	// Delay 10 MSEC before fall
-		lungFall(TURN_ON );
-		fallOnOff = 1;
+		if ( shmData->auscultation.side == 1 )
+		{
+			playAhead(&leftLungAhead, inhL, LUNG_FADE_MS );
+		}
+		else
+		{
+			// A track shared by both sides is only looked ahead for the left
+			playAhead(( inhR == inhL ) ? &leftLungAhead : &rightLungAhead, inhR, LUNG_FADE_MS );
+		}
+
+		if ( debug > 1 )
+		{
+			printf("inh: %d-%d\n", inhR, inhL );
+		}
+		lungPlaying = 1;
 	}
 	else
 	{
-		// When chest movement is disabled, 
-		lungRise(TURN_OFF );
-		lungFall(TURN_ON);
-		usleep(10000);
-		lungFall(TURN_OFF );
-		riseOnOff = 0;
-		fallOnOff = 0;
+		lungPlaying = 0;
 	}
-	exhLimit = EXH_LIMIT;
+	__atomic_store_n(&lungState, 0, __ATOMIC_RELAXED );
+	dispatchTimerSet(DISPATCH_FALL_STOP, now + FALL_STOP_DELAY );
 }
 
-void
-initialize_timers(void )
+/*
+ * Function: audio_thread
+ *
+ * Real-time dispatch of the heart and lung triggers. Each event or timer is acted on
+ * as soon as it arrives, so the sounds and air valves do not wait on the main loop.
+ * If SCHED_FIFO is not permitted, it runs at normal priority.
+ */
+void *
+audio_thread ( void *ptr )
 {
-	struct sigaction new_action;
-	sigset_t mask;
+	struct epoll_event epEvents[DISPATCH_TIMERS+1];
+	struct epoll_event ev;
+	struct sched_param param;
+	struct audioEvent event;
+	uint64_t expirations;
+	long long now;
+	int epollFD;
+	int tag;
+	int sts;
+	int n;
+	int i;
 	
-	printf("\n\ninitialize_timers\n\n" );
-	// Pulse Timer Setup
-	new_action.sa_flags = SA_SIGINFO;
-	new_action.sa_sigaction = delay_handler;
-	sigemptyset(&new_action.sa_mask);
-	if (sigaction(HEART_TIMER_SIG, &new_action, NULL) == -1)
-	{
-		perror("sigaction");
-		snprintf(msgbuf, 1024, "sigaction() fails for Pulse Timer: %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit ( -1 );
-	}
-	// Block timer signal temporarily
-	sigemptyset(&mask);
-	sigaddset(&mask, HEART_TIMER_SIG);
-	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
+	memset(&param, 0, sizeof(param) );
+	param.sched_priority = AUDIO_THREAD_PRIORITY;
+	sts = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param );
+	if ( sts != 0 )
 	{
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Pulse Timer %s", strerror(errno) );
+		snprintf(msgbuf, 1024, "audio_thread: SCHED_FIFO not set: %s", strerror(sts) );
 		log_message("", msgbuf );
-		exit ( -1 );
 	}
-	// Create the Timer
-	heart_sev.sigev_notify = SIGEV_SIGNAL;
-	heart_sev.sigev_signo = HEART_TIMER_SIG;
-	heart_sev.sigev_value.sival_ptr = &heart_timer;
-	
-	if ( timer_create(CLOCK_MONOTONIC, &heart_sev, &heart_timer ) == -1 )
+	else
 	{
-		perror("timer_create" );
-		snprintf(msgbuf, 1024, "timer_create() fails for Pulse Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit (-1);
-	}
-    if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
-    {
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Pulse Timer%s ", strerror(errno) );
-		log_message("", msgbuf );
-		exit ( -1 );
+		// The triggers are written by the wavTrigger writer threads
+		wav.writerPriority(AUDIO_THREAD_PRIORITY );
+		wav2.writerPriority(AUDIO_THREAD_PRIORITY );
 	}
 	
-	// Breath Timer Setup
-	new_action.sa_flags = SA_SIGINFO;
-	new_action.sa_sigaction = delay_handler;
-	sigemptyset(&new_action.sa_mask);
-	if (sigaction(BREATH_TIMER_SIG, &new_action, NULL) == -1)
-	{
-		perror("sigaction");
-		snprintf(msgbuf, 1024, "sigaction() fails for Breath Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit(-1 );
-	}
-	// Block timer signal temporarily
-	sigemptyset(&mask);
-	sigaddset(&mask, BREATH_TIMER_SIG);
-	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
+	epollFD = epoll_create1(EPOLL_CLOEXEC );
+	if ( epollFD < 0 )
 	{
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Breath Timer %s", strerror(errno) );
+		snprintf(msgbuf, 1024, "audio_thread: epoll_create1: %s", strerror(errno) );
 		log_message("", msgbuf );
 		exit ( -1 );
 	}
-	// Create the Timer
-	breath_sev.sigev_notify = SIGEV_SIGNAL;
-	breath_sev.sigev_signo = BREATH_TIMER_SIG;
-	breath_sev.sigev_value.sival_ptr = &breath_timer;
-	
-	if ( timer_create(CLOCK_MONOTONIC, &breath_sev, &breath_timer ) == -1 )
+	dispatchFD[DISPATCH_QUEUE] = audioEvents.fd;
+	for ( tag = DISPATCH_BEAT ; tag <= DISPATCH_FALL_STOP ; tag++ )
 	{
-		perror("timer_create" );
-		snprintf(msgbuf, 1024, "timer_create() fails for Breath Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit (-1);
-	}
-	
-    if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
-    {
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Breath Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit ( -1 );
-	}
-	
-	// Rise Timer Setup
-	new_action.sa_flags = SA_SIGINFO;
-	new_action.sa_sigaction = rise_handler;
-	sigemptyset(&new_action.sa_mask);
-	if (sigaction(RISE_TIMER_SIG, &new_action, NULL) == -1)
-	{
-		perror("sigaction");
-		snprintf(msgbuf, 1024, "sigaction() fails for Rise Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit(-1 );
+		dispatchFD[tag] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+		if ( dispatchFD[tag] < 0 )
+		{
+			snprintf(msgbuf, 1024, "audio_thread: timerfd_create: %s", strerror(errno) );
+			log_message("", msgbuf );
+			exit ( -1 );
+		}
 	}
-	// Block timer signal temporarily
-	sigemptyset(&mask);
-	sigaddset(&mask, RISE_TIMER_SIG);
-	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
+	for ( tag = DISPATCH_QUEUE ; tag <= DISPATCH_FALL_STOP ; tag++ )
 	{
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Rise Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit ( -1 );
+		memset(&ev, 0, sizeof(ev) );
+		ev.events = EPOLLIN;
+		ev.data.u32 = tag;
+		epoll_ctl(epollFD, EPOLL_CTL_ADD, dispatchFD[tag], &ev );
 	}
-	// Create the Timer
-	rise_sev.sigev_notify = SIGEV_SIGNAL;
-	rise_sev.sigev_signo = RISE_TIMER_SIG;
-	rise_sev.sigev_value.sival_ptr = &rise_timer;
+	beatSchedInit(&beats, LUB_DELAY );
 	
-	if ( timer_create(CLOCK_MONOTONIC, &rise_sev, &rise_timer ) == -1 )
+	while ( 1 )
 	{
-		perror("timer_create" );
-		snprintf(msgbuf, 1024, "timer_create() fails for Rise Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit (-1);
-	}
-	
-    if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
-    {
-		perror("sigprocmask");
-		snprintf(msgbuf, 1024, "sigprocmask() fails for Rise Timer %s", strerror(errno) );
-		log_message("", msgbuf );
-		exit ( -1 );
+		n = epoll_wait(epollFD, epEvents, DISPATCH_TIMERS+1, -1 );
+		if ( n < 0 )
+		{
+			continue;
+		}
+		now = ainNow();
+		for ( i = 0 ; i < n ; i++ )
+		{
+			tag = epEvents[i].data.u32;
+			if ( tag == DISPATCH_QUEUE )
+			{
+				audioQueueClear(&audioEvents );
+				while ( audioQueuePop(&audioEvents, &event ) )
+				{
+					switch ( event.type )
+					{
+						case AUDIO_EV_BEAT:
+							beatSchedSync(&beats, event.ts, event.value );
+							break;
+						case AUDIO_EV_BREATH:
+							dispatchBreath(now );
+							break;
+						case AUDIO_EV_RATE:
+							beatSchedRate(&beats, event.value );
+							break;
+						case AUDIO_EV_AIR:
+							dispatchAirIdle(event.value );
+							break;
+					}
+				}
+				continue;
+			}
+			if ( read(dispatchFD[tag], &expirations, sizeof(expirations) ) != sizeof(expirations) )
+			{
+				continue;
+			}
+			switch ( tag )
+			{
+				case DISPATCH_SOUND:
+					dispatchLungSound(now );
+					break;
+				case DISPATCH_AIR:
+					dispatchAir(now );
+					break;
+				case DISPATCH_FALL_STOP:
+					lungFall(TURN_OFF );
+					break;
+			}
+		}
+		// A sync or a rate change may have moved the next beat
+		dispatchHeart(ainNow() );
 	}
+	return ( NULL );
 }
 
 void
@@ -1472,30 +1811,16 @@ lungRise(int control )
 	gpioPinSet(riseRPin, control );
 }
 /* Lung State:
-	0 - Idle. Waiting for Sync. When Sync Received:
-		Start Inflation. 
-		Start timer to end inflation.
-		Start 40 ms timer to wait for sound
-	1 - Play Sound
+	0 - Idle. Waiting for Sync.
+	1 - Breath started by audio_thread. Its sound is played BREATH_SOUND_DELAY after the sync.
 	
+	runLung keeps the lung volumes set, and has audio_thread set the air valves for
+	manual respiration and between breaths.
 */
 	
 void 
 runLung( void )
 {
-	struct itimerspec its;
-	long int delayTime;	// Delay in ns
-	double periodSeconds;
-	double inhTime;
-	double fractional;
-	double integer;
-	time_t now;
-	
-	if ( ! shmData->respiration.chest_movement )
-	{
-		allAirOff(0);
-	}
-
 	if ( shmData->auscultation.side != 0  )
 	{
 		current.respiration_rate = shmData->respiration.rate;
@@ -1507,171 +1832,7 @@ runLung( void )
 		setLeftLungVolume(0 );	// Set volume only if a change occurred
 		setRightLungVolume(0 );	// Set volume only if a change occurred
 	}
-	if ( shmData->respiration.active ) // && shmData->respiration.chest_movement )
-	{
-		// Manual Respiration
-		lungFall(TURN_OFF );
-		if ( shmData->respiration.chest_movement )
-		{
-			lungRise(TURN_ON );
-		}
-	}
-	else
-	{
-		switch ( lungState )
-		{
-			case 0:
-				if ( fallStopTime )
-				{
-					now = time(NULL );
-					if ( now >= fallStopTime )
-					{
-						lungFall(TURN_OFF );
-						fallStopTime = 0;
-					}
-				}
-				if ( lungLast != current.breathCount )
-				{
-					lungLast = current.breathCount;
-				// Breath Timer
-					// Clear the interval, run single execution
-					its.it_interval.tv_sec = 0;
-					its.it_interval.tv_nsec = 0;
-					
-					// Set First expiration as the interval plus the delay
-					its.it_value.tv_sec = 0;
-					delayTime = 40000000;	// Delay in ns
-					its.it_value.tv_nsec = delayTime;
-					if (timer_settime(breath_timer, 0, &its, NULL) == -1)
-					{
-						perror("runLung: timer_settime");
-						snprintf(msgbuf, 1024, "runLung: timer_settime: %s", strerror(errno) );
-						log_message("", msgbuf );
-						exit ( -1 );
-					}
-					lungFall(TURN_OFF );
-					fallOnOff = 0;
-					usleep(10000);
-
-					if ( shmData->respiration.chest_movement )
-					{
-						if ( debug ) printf("ON\n" );
-						lungRise(TURN_ON );
-					}
-					riseOnOff = 1;
-				// Rise Timer
-					// Clear the interval, run single execution
-					its.it_interval.tv_sec = 0;
-					its.it_interval.tv_nsec = 0;
-					
-					// The duration should be 30% of the respiration period
-#define INH_PERCENT		(0.30)
-					if ( shmData->respiration.rate > 0 )
-					{
-						periodSeconds = ( 1 / (double)shmData->respiration.rate ) * 60;
-					}
-					else
-					{
-						periodSeconds = 2;
-					}
-					inhTime = periodSeconds * INH_PERCENT;
-					if ( inhTime > inhLimit )
-					{
-						inhTime = inhLimit;
-					}
-					
-					if ( inhTime < 0 )
-					{
-						snprintf(msgbuf, 1024, "runLung: rise inhTime (%f) is negative. period %f rate %d", inhTime, periodSeconds, shmData->respiration.rate );
-						inhTime = inhLimit;
-						log_message("", msgbuf );
-					}
-					fractional = modf(inhTime, &integer );
-					its.it_value.tv_sec = (int)integer;
-					delayTime = fractional * 1000000000; //Seconds to nanoseconds
-
-					if ( delayTime < 0 )
-					{
-						snprintf(msgbuf, 1024, "runLung: rise delayTime is negative for inhTime %f rate %d", inhTime, shmData->respiration.rate );
-						delayTime = 0;
-						log_message("", msgbuf );
-					}
-					its.it_value.tv_nsec = delayTime;
-					
-					if (timer_settime(rise_timer, 0, &its, NULL) == -1)
-					{
-						//perror("runLung: rise timer_settime");
-						snprintf(msgbuf, 1024, "runLung: rise timer_settime: %s", strerror(errno) );
-						log_message("", msgbuf );
-						snprintf(msgbuf, 1024, "runLung: periodSeconds %f, (%ld : %ld)", periodSeconds, its.it_value.tv_sec, its.it_value.tv_nsec );
-						log_message("", msgbuf );
-						exit ( -1 );
-					}
-				}
-				else if ( current.respiration_rate == 0 )
-				{
-					if ( exhLimit-- == 0 )
-					{
-						if ( debug ) printf("OFF\n" );
-						lungFall(TURN_OFF );
-						fallOnOff = 0;
-						lungRise(TURN_OFF );
-						snprintf(msgbuf, 1024, "runLung: exhLimit Hit" );
-						log_message("", msgbuf );
-					}
-				}
-				break;
-			case 1:
-				if ( shmData->auscultation.side > 0 &&  shmData->auscultation.side < 4 )
-				{
-					if ( shmData->auscultation.side == 1 )
-					{
-						wav.trackPlayPoly(0, inhL);
-					}
-					else
-					{
-						wav.trackPlayPoly(0, inhR);
-					}
-
-					if ( debug > 1 )
-					{
-						printf("inh: %d-%d\n", inhR, inhL );
-					}
-					lungState = 0;
-					lungPlaying = 1;
-				}
-				else
-				{
-					lungState = 0;
-					lungPlaying = 0;
-				}
-				now = time(NULL );
-				fallStopTime = now + 10;
-				break;
-#if 0
-			case 2: // No longer used
-				if ( shmData->auscultation.side == 0 )
-				{
-					wav.trackStop(inh );
-					lungState = 0;
-					lungPlaying = 0;
-				}
-				else
-				{
-					// INH playing. Check for completion
-					if ( wav.checkTrack(inh ) == 0 )
-					{
-						// inh done
-						lungState = 0;
-						lungPlaying = 0;
-					}
-				}
-				break;
-#endif	
-			default:
-				break;
-		}
-	}
+	audioQueuePush(&audioEvents, AUDIO_EV_AIR, current.respiration_rate, 0 );
 }
 
 int getPulseVolume(int pressure, int strength )
@@ -37,15 +37,68 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
 #include "wavTrigger.h"
 
 #include <syslog.h>
 
+static long long
+wavNow(void )
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts );
+	return ( (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec );
+}
+
 wavTrigger::wavTrigger(void)
 {
+	pthread_mutexattr_t attr;
+	pthread_condattr_t condAttr;
+	
 	sioPort = -1;
 	wavIndex = -1;
 	boardType = BOARD_UNKNOWN;
+	
+	framesQueued = 0;
+	framesCoalesced = 0;
+	writes = 0;
+	writerStarted = false;
+	writerBusy = false;
+	triggerCount = 0;
+	gainCount = 0;
+	
+	// The sound dispatch thread runs at real-time priority and queues commands too
+	pthread_mutexattr_init(&attr );
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT );
+	pthread_mutex_init(&queueLock, &attr );
+	pthread_mutexattr_destroy(&attr );
+	pthread_cond_init(&queueWork, NULL );
+	pthread_cond_init(&queueDone, NULL );
+	
+	// The track status waits use CLOCK_MONOTONIC deadlines. checkTrack is called
+	// from the sound dispatch thread too, so the lock also inherits priority.
+	pthread_mutexattr_init(&attr );
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT );
+	pthread_mutex_init(&statusLock, &attr );
+	pthread_mutexattr_destroy(&attr );
+	pthread_condattr_init(&condAttr );
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC );
+	pthread_cond_init(&statusCond, &condAttr );
+	pthread_condattr_destroy(&condAttr );
+	readerStarted = false;
+	reportsSeen = false;
+	replySeq = 0;
+	replyCode = 0;
+	replyLen = 0;
+	tracksPlaying = 0;
+	memset(trackBits, 0, sizeof(trackBits) );
+	memset(trackTime, 0, sizeof(trackTime) );
+	
+	framesSuppressed = 0;
+	bytesSaved = 0;
+	cacheReset();
 }
 
 // **************************************************************
@@ -53,6 +106,266 @@ void wavTrigger::start(int port, int index ) {
   sioPort = port;
   wavIndex = index;
   boardType = BOARD_UNKNOWN;
+  cacheReset();
+  
+  if ( sioPort >= 0 && ! writerStarted )
+  {
+	  if ( pthread_create(&writer, NULL, writerThread, this ) == 0 )
+	  {
+		  writerStarted = true;
+	  }
+  }
+  if ( sioPort >= 0 && ! readerStarted )
+  {
+	  if ( pthread_create(&reader, NULL, readerThread, this ) == 0 )
+	  {
+		  readerStarted = true;
+	  }
+  }
+}
+
+/*
+ * Commands are not written by the caller. They are queued for a writer thread, which
+ * writes whatever has built up in one write(). At 57600 baud a frame takes 1-2 ms on
+ * the wire, so while one batch is going out the next one collects:
+ *	- A gain for the same master, channel or track as one still waiting replaces it.
+ *	- Triggers (track control, fades and the other commands) go ahead of the gains.
+ *	  Gains waiting for the triggered track or channel, or the master, are moved
+ *	  ahead with it, so a track is never started before its own gain.
+ * If the writer thread can not be started, commands are written directly.
+ */
+
+// **************************************************************
+void wavTrigger::sendCommand(int kind, int chan, int trk, int value, const char *frame, int len) {
+
+struct wavCommand *cmd;
+int i;
+
+  pthread_mutex_lock(&queueLock );
+  if ( ! cacheUpdate(kind, chan, trk, value ) )
+  {
+	  framesSuppressed++;
+	  bytesSaved += len;
+	  pthread_mutex_unlock(&queueLock );
+	  return;
+  }
+  if ( ! writerStarted )
+  {
+	  write(sioPort, frame, len );
+	  pthread_mutex_unlock(&queueLock );
+	  return;
+  }
+  framesQueued++;
+  if ( WAV_CMD_IS_GAIN(kind ) )
+  {
+	  for ( i = 0 ; i < gainCount ; i++ )
+	  {
+		  cmd = &gains[i];
+		  if ( cmd->kind == kind && cmd->chan == chan && cmd->trk == trk )
+		  {
+			  memcpy(cmd->frame, frame, len );
+			  cmd->len = len;
+			  framesCoalesced++;
+			  pthread_mutex_unlock(&queueLock );
+			  return;
+		  }
+	  }
+  }
+  while ( triggerCount + gainCount >= WAV_QUEUE_LEN )
+  {
+	  pthread_cond_wait(&queueDone, &queueLock );
+  }
+  if ( WAV_CMD_IS_GAIN(kind ) )
+  {
+	  cmd = &gains[gainCount++];
+  }
+  else
+  {
+	  promoteGains(chan, trk );
+	  cmd = &triggers[triggerCount++];
+  }
+  cmd->kind = kind;
+  cmd->chan = chan;
+  cmd->trk = trk;
+  cmd->len = len;
+  memcpy(cmd->frame, frame, len );
+  pthread_cond_signal(&queueWork );
+  pthread_mutex_unlock(&queueLock );
+}
+
+// **************************************************************
+// Record a command in the board state mirror. The queue lock is held, so the mirror
+// changes in the order the commands are written.
+// Returns false if the command would not change anything and need not be sent.
+bool wavTrigger::cacheUpdate(int kind, int chan, int trk, int value) {
+
+short *entry;
+
+  switch ( kind )
+  {
+	  case WAV_CMD_MASTER_GAIN:
+		  entry = &masterCache;
+		  break;
+	  case WAV_CMD_CHANNEL_GAIN:
+		  entry = ( chan >= 0 && chan < WAV_CHANNELS ) ? &channelCache[chan] : NULL;
+		  break;
+	  case WAV_CMD_TRACK_GAIN:
+		  entry = ( trk >= 0 && trk < WAV_TRACKS ) ? &trackGainCache[trk] : NULL;
+		  break;
+	  case WAV_CMD_LOOP:
+		  entry = ( trk >= 0 && trk < WAV_TRACKS ) ? &trackLoopCache[trk] : NULL;
+		  break;
+	  case WAV_CMD_FADE:
+		  // The gain moves on the board for the length of the fade
+		  if ( trk >= 0 && trk < WAV_TRACKS )
+		  {
+			  trackGainCache[trk] = WAV_CACHE_UNKNOWN;
+		  }
+		  return ( true );
+	  default:
+		  return ( true );
+  }
+  if ( entry == NULL )
+  {
+	  return ( true );
+  }
+  if ( *entry == value )
+  {
+	  return ( false );
+  }
+  *entry = value;
+  return ( true );
+}
+
+// **************************************************************
+void wavTrigger::cacheReset(void) {
+
+int i;
+
+  pthread_mutex_lock(&queueLock );
+  masterCache = WAV_CACHE_UNKNOWN;
+  for ( i = 0 ; i < WAV_CHANNELS ; i++ )
+  {
+	  channelCache[i] = WAV_CACHE_UNKNOWN;
+  }
+  for ( i = 0 ; i < WAV_TRACKS ; i++ )
+  {
+	  trackGainCache[i] = WAV_CACHE_UNKNOWN;
+	  trackLoopCache[i] = WAV_CACHE_UNKNOWN;
+  }
+  pthread_mutex_unlock(&queueLock );
+}
+
+// **************************************************************
+// Move the waiting gains that a trigger for chan/trk depends on to the trigger queue.
+// A trigger for no particular track, such as stop all, takes all of them.
+void wavTrigger::promoteGains(int chan, int trk) {
+
+struct wavCommand *cmd;
+int kept = 0;
+int i;
+
+  for ( i = 0 ; i < gainCount ; i++ )
+  {
+	  cmd = &gains[i];
+	  if ( ( chan < 0 && trk < 0 ) ||
+		   ( cmd->kind == WAV_CMD_MASTER_GAIN ) ||
+		   ( cmd->kind == WAV_CMD_CHANNEL_GAIN && cmd->chan == chan ) ||
+		   ( cmd->kind == WAV_CMD_TRACK_GAIN && cmd->trk == trk ) )
+	  {
+		  triggers[triggerCount++] = *cmd;
+	  }
+	  else
+	  {
+		  gains[kept++] = *cmd;
+	  }
+  }
+  gainCount = kept;
+}
+
+// **************************************************************
+void wavTrigger::flush(void) {
+
+  if ( ! writerStarted )
+  {
+	  return;
+  }
+  pthread_mutex_lock(&queueLock );
+  while ( triggerCount + gainCount > 0 || writerBusy )
+  {
+	  pthread_cond_wait(&queueDone, &queueLock );
+  }
+  pthread_mutex_unlock(&queueLock );
+}
+
+// **************************************************************
+// Run the writer at the priority of the thread that plays the sounds
+void wavTrigger::writerPriority(int priority) {
+
+struct sched_param param;
+
+  if ( writerStarted )
+  {
+	  param.sched_priority = priority;
+	  pthread_setschedparam(writer, SCHED_FIFO, &param );
+  }
+}
+
+// **************************************************************
+void *wavTrigger::writerThread(void *arg) {
+
+  ((wavTrigger *)arg)->writerRun();
+  return ( NULL );
+}
+
+// **************************************************************
+void wavTrigger::writerRun(void) {
+
+char batch[WAV_BATCH_MAX];
+int len;
+int used;
+int i;
+
+  pthread_mutex_lock(&queueLock );
+  while ( 1 )
+  {
+	  while ( triggerCount + gainCount == 0 )
+	  {
+		  pthread_cond_wait(&queueWork, &queueLock );
+	  }
+	  // Triggers first, then gains, as many whole frames as fit
+	  len = 0;
+	  for ( used = 0 ; used < triggerCount && len + triggers[used].len <= WAV_BATCH_MAX ; used++ )
+	  {
+		  memcpy(&batch[len], triggers[used].frame, triggers[used].len );
+		  len += triggers[used].len;
+	  }
+	  for ( i = used ; i < triggerCount ; i++ )
+	  {
+		  triggers[i - used] = triggers[i];
+	  }
+	  triggerCount -= used;
+	  for ( used = 0 ; triggerCount == 0 && used < gainCount && len + gains[used].len <= WAV_BATCH_MAX ; used++ )
+	  {
+		  memcpy(&batch[len], gains[used].frame, gains[used].len );
+		  len += gains[used].len;
+	  }
+	  for ( i = used ; i < gainCount ; i++ )
+	  {
+		  gains[i - used] = gains[i];
+	  }
+	  gainCount -= used;
+	  writerBusy = true;
+	  pthread_cond_broadcast(&queueDone );
+	  pthread_mutex_unlock(&queueLock );
+	  
+	  write(sioPort, batch, len );
+	  
+	  pthread_mutex_lock(&queueLock );
+	  writes++;
+	  writerBusy = false;
+	  pthread_cond_broadcast(&queueDone );
+  }
 }
 
 // **************************************************************
@@ -81,7 +394,7 @@ int len;
   txbuf[6] = 0x55;
   len = 7;
   
-  write(sioPort, txbuf, len );
+  sendCommand(WAV_CMD_MASTER_GAIN, -1, -1, gain, txbuf, len );
 }
 
 // **************************************************************
@@ -107,7 +420,7 @@ int len;
   txbuf[7] = 0x55;
   len = 8;
   
-  write(sioPort, txbuf, len );
+  sendCommand(WAV_CMD_CHANNEL_GAIN, chan, -1, gain, txbuf, len );
 }
 // **************************************************************
 void wavTrigger::trackPlaySolo(int chan, int trk) {
@@ -204,7 +517,15 @@ int i;
 	// }
 	// printf("\n" );
 	
-  write(sioPort, txbuf, len);
+  if ( code == TRK_LOOP_ON || code == TRK_LOOP_OFF )
+  {
+	  // Loop state is mirrored, so the loop off sent with each play is dropped once known
+	  sendCommand(WAV_CMD_LOOP, chan, trk, code == TRK_LOOP_ON, txbuf, len );
+  }
+  else
+  {
+	  sendCommand(WAV_CMD_TRIGGER, chan, trk, code, txbuf, len );
+  }
 }
 
 // **************************************************************
@@ -221,7 +542,7 @@ char txbuf[10];
   txbuf[2] = 0x05;
   txbuf[3] = CMD_STOP_ALL;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 5);
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 5 );
 }
 
 // **************************************************************
@@ -238,7 +559,7 @@ char txbuf[10];
   txbuf[2] = 0x05;
   txbuf[3] = CMD_RESUME_ALL_SYNC;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 5);
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 5 );
 }
 
 // **************************************************************
@@ -261,7 +582,7 @@ unsigned short vol;
   txbuf[6] = (char)vol;
   txbuf[7] = (char)(vol >> 8);
   txbuf[8] = 0x55;
-  write(sioPort, txbuf, 9);
+  sendCommand(WAV_CMD_TRACK_GAIN, -1, trk, gain, txbuf, 9 );
 }
 
 // **************************************************************
@@ -287,7 +608,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = stopFlag;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sendCommand(WAV_CMD_FADE, -1, trk, gain, txbuf, 12 );
 }
 
 // **************************************************************
@@ -318,7 +639,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = 0x00;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sendCommand(WAV_CMD_FADE, chan, trkTo, gain, txbuf, 12 );
 
   // Start a fade-out on the From track
   txbuf[0] = 0xf0;
@@ -334,7 +655,7 @@ unsigned short vol;
   txbuf[9] = (char)(time >> 8);
   txbuf[10] = 0x01;
   txbuf[11] = 0x55;
-  write(sioPort, txbuf, 12);
+  sendCommand(WAV_CMD_FADE, chan, trkFrom, -40, txbuf, 12 );
 }
 
 // **************************************************************
@@ -355,7 +676,7 @@ unsigned short off;
   txbuf[4] = (char)off;
   txbuf[5] = (char)(off >> 8);
   txbuf[6] = 0x55;
-  write(sioPort, txbuf, 7);
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 7 );
 }
 
 // **************************************************************
@@ -374,12 +695,11 @@ unsigned short off;
   txbuf[3] = CMD_AMP_POWER;
   txbuf[4] = on;
   txbuf[5] = 0x55;
-  write(sioPort, txbuf, 6);
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 6 );
 }
 
 // **************************************************************
 int wavTrigger::getVersion(char *buf, int maxLen) {
-char txbuf[10];
 int len;
 int i;
 float ver;
@@ -390,13 +710,7 @@ int year;
 	  return ( -1 );
   }
 
-  txbuf[0] = 0xf0;
-  txbuf[1] = 0xaa;
-  txbuf[2] = 0x05;
-  txbuf[3] = CMD_GET_VERSION;
-  txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
-  len = getReturnData(buf, maxLen );
+  len = query(CMD_GET_VERSION, CMD_VERSION_STRING, buf, maxLen );
   
   if ( len == 0x19 || len == 21)
   {
@@ -422,43 +736,90 @@ int year;
 	  sprintf(&buf[1], "Unknown Board 0x%02x 0x%02x %s", buf[0], buf[1], &buf[3] );
   }
   sprintf( boardFWVersion, "%.*s", len-1, &buf[1] );
+  if ( boardType != BOARD_UNKNOWN )
+  {
+	  setReporting(1 );
+  }
   return(len);
 }
 
 // **************************************************************
-int wavTrigger::getSysInfo(char *buf, int maxLen) {
+// Have the board send a track report each time a track starts or stops
+void wavTrigger::setReporting(int enable) {
+
 char txbuf[8];
-unsigned short off;
+
+  txbuf[0] = 0xf0;
+  txbuf[1] = 0xaa;
+  txbuf[2] = 0x06;
+  txbuf[3] = CMD_SET_REPORTING;
+  txbuf[4] = enable;
+  txbuf[5] = 0x55;
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 6 );
+}
+
+// **************************************************************
+int wavTrigger::getSysInfo(char *buf, int maxLen) {
   if ( sioPort < 0 )
   {
 	  return ( -1 );
   }
-
-  txbuf[0] = 0xf0;
-  txbuf[1] = 0xaa;
-  txbuf[2] = 0x05;
-  txbuf[3] = CMD_GET_SYS_INFO;
-  txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
-  return(getReturnData(buf, maxLen ) );
+  return ( query(CMD_GET_SYS_INFO, CMD_SYS_INFO, buf, maxLen ) );
 }
 
 // **************************************************************
 int wavTrigger::getStatus(char *buf, int maxLen) {
-char txbuf[8];
-unsigned short off;
   if ( sioPort < 0 )
   {
 	  return ( -1 );
   }
+  return ( query(CMD_GET_STATUS, CMD_STATUS, buf, maxLen ) );
+}
+
+// **************************************************************
+// Send a query and return its reply, as the reply code followed by the data.
+// Returns the reply length, or -1 if none came.
+int wavTrigger::query(int cmd, int replyCmd, char *buf, int maxLen) {
+
+char txbuf[8];
+struct timespec deadline;
+unsigned int seq;
+int len = -1;
 
   txbuf[0] = 0xf0;
   txbuf[1] = 0xaa;
   txbuf[2] = 0x05;
-  txbuf[3] = CMD_GET_STATUS;
+  txbuf[3] = cmd;
   txbuf[4] = 0x55;
-  write(sioPort, txbuf, 6);
-  return(getReturnData(buf, maxLen ) );
+  if ( ! readerStarted )
+  {
+	  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 5 );
+	  flush();
+	  return ( getReturnData(buf, maxLen ) );
+  }
+  pthread_mutex_lock(&statusLock );
+  seq = replySeq;
+  pthread_mutex_unlock(&statusLock );
+  
+  sendCommand(WAV_CMD_TRIGGER, -1, -1, 0, txbuf, 5 );
+  
+  memset(buf, 0, maxLen );
+  statusDeadline(&deadline, WAV_REPLY_MS );
+  pthread_mutex_lock(&statusLock );
+  while ( replySeq == seq || replyCode != replyCmd )
+  {
+	  if ( pthread_cond_timedwait(&statusCond, &statusLock, &deadline ) != 0 )
+	  {
+		  break;
+	  }
+  }
+  if ( replySeq != seq && replyCode == replyCmd )
+  {
+	  len = ( replyLen < maxLen ) ? replyLen : maxLen;
+	  memcpy(buf, reply, len );
+  }
+  pthread_mutex_unlock(&statusLock );
+  return ( len );
 }
 
 // **************************************************************
@@ -534,43 +895,306 @@ int wavTrigger::getReturnData(char *buf, int maxLen) {
 	return ( -1 );
 }			
 
-#define MAX_BUF 255
-
-char trkStatusBuffer[MAX_BUF+1];
-int tracksReturned = 0;
-
 int wavTrigger::getTracksPlaying() {
 	int tracks;
 	int val;
+	char buf[WAV_RX_MAX];
 
-	val = getStatus(trkStatusBuffer, MAX_BUF );
-	tracks = (val-1)/2;
-	tracksReturned = tracks;
+	val = getStatus(buf, WAV_RX_MAX );
+	if ( val < 1 )
+	{
+		return ( val );
+	}
+	if ( ! readerStarted )
+	{
+		statusUpdate(CMD_STATUS, (unsigned char *)&buf[1], val - 1 );
+	}
+	pthread_mutex_lock(&statusLock );
+	tracks = tracksPlaying;
+	pthread_mutex_unlock(&statusLock );
 	return ( tracks );
 }
 
 int wavTrigger::getTrackStatus(int trk) {
-	int tracks;
 
-	tracks = getTracksPlaying();
+	getTracksPlaying();
 	return ( checkTrack(trk ) );
 }
 
 int wavTrigger::checkTrack(int trk )
 {
-	int i;
-	int val;
+	int playing;
+	
+	if ( trk < 0 || trk >= WAV_TRACKS )
+	{
+		return ( 0 );
+	}
+	pthread_mutex_lock(&statusLock );
+	playing = WAV_TRACK_ON(trackBits, trk );
+	pthread_mutex_unlock(&statusLock );
+	return ( playing );
+}
+
+// Time the track last started or stopped, CLOCK_MONOTONIC nsec, or 0 if not seen
+long long wavTrigger::trackChanged(int trk )
+{
+	long long ts;
+	
+	if ( trk < 0 || trk >= WAV_TRACKS )
+	{
+		return ( 0 );
+	}
+	pthread_mutex_lock(&statusLock );
+	ts = trackTime[trk];
+	pthread_mutex_unlock(&statusLock );
+	return ( ts );
+}
+
+/*
+ * Function: waitDone
+ *
+ * Wait for a track, or all tracks if trk is -1, to finish. A status query is made
+ * first; the board answers it after the commands queued before it, so a track that
+ * was just started is seen as playing. If the board has not sent any track reports,
+ * the status is polled every WAV_STATUS_POLL_MS.
+ *
+ * Parameters: trk - the track, or -1
+ *             timeoutMs - the longest wait, or -1 for no limit
+ *
+ * Returns: 0 when done, -1 on timeout
+ */
+int wavTrigger::waitDone(int trk, int timeoutMs )
+{
+	struct timespec deadline;
+	struct timespec poll;
+	bool last;
+	int sts = 0;
 	
-	for ( i = 0 ; i < tracksReturned ; i++ )
+	if ( sioPort < 0 || trk >= WAV_TRACKS )
 	{
-		val = ( trkStatusBuffer[2+(i*2)] << 8 ) + trkStatusBuffer[1+(i*2)];
-		if ( val == trk )
+		return ( 0 );
+	}
+	getTracksPlaying();
+	if ( timeoutMs >= 0 )
+	{
+		statusDeadline(&deadline, timeoutMs );
+	}
+	pthread_mutex_lock(&statusLock );
+	while ( trk < 0 ? tracksPlaying > 0 : WAV_TRACK_ON(trackBits, trk ) )
+	{
+		statusDeadline(&poll, WAV_STATUS_POLL_MS );
+		last = ( timeoutMs >= 0 ) && ( poll.tv_sec > deadline.tv_sec ||
+			   ( poll.tv_sec == deadline.tv_sec && poll.tv_nsec >= deadline.tv_nsec ) );
+		if ( last )
+		{
+			poll = deadline;
+		}
+		if ( pthread_cond_timedwait(&statusCond, &statusLock, &poll ) == 0 )
+		{
+			continue;
+		}
+		if ( last )
 		{
-			return ( 1 );
+			sts = -1;
+			break;
+		}
+		if ( ! reportsSeen )
+		{
+			pthread_mutex_unlock(&statusLock );
+			getTracksPlaying();
+			pthread_mutex_lock(&statusLock );
 		}
 	}
-	return ( 0 );
+	pthread_mutex_unlock(&statusLock );
+	return ( sts );
+}
+
+int wavTrigger::waitTrackDone(int trk, int timeoutMs )
+{
+	if ( trk < 0 )
+	{
+		return ( 0 );
+	}
+	return ( waitDone(trk, timeoutMs ) );
+}
+
+int wavTrigger::waitAllDone(int timeoutMs )
+{
+	return ( waitDone(-1, timeoutMs ) );
+}
+
+void wavTrigger::waitTilDone(int trk )
+{
+	waitTrackDone(trk, -1 );
+}
+
+// **************************************************************
+void wavTrigger::statusDeadline(struct timespec *ts, int ms) {
+
+  clock_gettime(CLOCK_MONOTONIC, ts );
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += ( ms % 1000 ) * 1000000L;
+  if ( ts->tv_nsec >= 1000000000L )
+  {
+	  ts->tv_sec++;
+	  ts->tv_nsec -= 1000000000L;
+  }
+}
+
+/*
+ * The reader thread takes everything the board sends. Frames are
+ *	0xF0 0xAA <total length> <code> <data> 0x55
+ * Replies to queries are kept for query(), and status replies and track reports
+ * update the track bitmap.
+ */
+
+// **************************************************************
+void *wavTrigger::readerThread(void *arg) {
+
+  ((wavTrigger *)arg)->readerRun();
+  return ( NULL );
 }
+
+// **************************************************************
+void wavTrigger::readerRun(void) {
+
+unsigned char rx[WAV_RX_MAX * 2];
+int have = 0;
+int start;
+int len;
+int sts;
+
+  while ( 1 )
+  {
+	  sts = read(sioPort, &rx[have], sizeof(rx) - have );
+	  if ( sts <= 0 )
+	  {
+		  if ( sts < 0 )
+		  {
+			  usleep(100000 );
+		  }
+		  continue;
+	  }
+	  have += sts;
+	  start = 0;
+	  while ( have - start >= 3 )
+	  {
+		  if ( rx[start] != 0xf0 || rx[start+1] != 0xaa )
+		  {
+			  start++;
+			  continue;
+		  }
+		  len = rx[start+2];
+		  if ( len < 5 || len > WAV_RX_MAX )
+		  {
+			  start++;
+			  continue;
+		  }
+		  if ( have - start < len )
+		  {
+			  break;
+		  }
+		  if ( rx[start+len-1] == 0x55 )
+		  {
+			  statusUpdate(rx[start+3], &rx[start+4], len - 5 );
+			  start += len;
+		  }
+		  else
+		  {
+			  start++;
+		  }
+	  }
+	  if ( start > 0 )
+	  {
+		  memmove(rx, &rx[start], have - start );
+		  have -= start;
+	  }
+  }
+}
+
+// **************************************************************
+// Take one frame from the board: the reply code and its data
+void wavTrigger::statusUpdate(int code, unsigned char *data, int len) {
+
+unsigned int bits[WAV_TRACKS / 32];
+long long now;
+unsigned int diff;
+int trk;
+int i;
+int w;
+
+  if ( len < 0 )
+  {
+	  return;
+  }
+  now = wavNow();
+  pthread_mutex_lock(&statusLock );
+  switch ( code )
+  {
+	  case CMD_STATUS:
+		  // The list of tracks playing now replaces the bitmap
+		  memset(bits, 0, sizeof(bits) );
+		  for ( i = 0 ; i + 1 < len ; i += 2 )
+		  {
+			  trk = data[i] | ( data[i+1] << 8 );
+			  if ( trk < WAV_TRACKS )
+			  {
+				  WAV_TRACK_WORD(bits, trk ) |= WAV_TRACK_MASK(trk );
+			  }
+		  }
+		  tracksPlaying = 0;
+		  for ( w = 0 ; w < WAV_TRACKS / 32 ; w++ )
+		  {
+			  diff = bits[w] ^ trackBits[w];
+			  for ( i = 0 ; diff ; i++, diff >>= 1 )
+			  {
+				  if ( diff & 1 )
+				  {
+					  trackTime[w * 32 + i] = now;
+				  }
+			  }
+			  trackBits[w] = bits[w];
+			  tracksPlaying += __builtin_popcount(bits[w] );
+		  }
+		  break;
+		  
+	  case CMD_TRACK_REPORT:
+		  // Track (0 based), voice, and 1 for started or 0 for stopped
+		  if ( len < 4 )
+		  {
+			  break;
+		  }
+		  trk = ( data[0] | ( data[1] << 8 ) ) + 1;
+		  if ( trk < WAV_TRACKS )
+		  {
+			  if ( data[3] && ! WAV_TRACK_ON(trackBits, trk ) )
+			  {
+				  WAV_TRACK_WORD(trackBits, trk ) |= WAV_TRACK_MASK(trk );
+				  tracksPlaying++;
+				  trackTime[trk] = now;
+			  }
+			  else if ( ! data[3] && WAV_TRACK_ON(trackBits, trk ) )
+			  {
+				  WAV_TRACK_WORD(trackBits, trk ) &= ~WAV_TRACK_MASK(trk );
+				  tracksPlaying--;
+				  trackTime[trk] = now;
+			  }
+		  }
+		  reportsSeen = true;
+		  break;
+  }
+  if ( code == CMD_VERSION_STRING || code == CMD_SYS_INFO || code == CMD_STATUS )
+  {
+	  reply[0] = code;
+	  replyLen = ( len + 1 < WAV_RX_MAX ) ? len + 1 : WAV_RX_MAX;
+	  memcpy(&reply[1], data, replyLen - 1 );
+	  replyCode = code;
+	  replySeq++;
+  }
+  pthread_cond_broadcast(&statusCond );
+  pthread_mutex_unlock(&statusLock );
+}
+
 void wavTrigger::show(void) {
 	printf("Board: " );
 	switch ( boardType )
@@ -55,6 +55,9 @@
 #ifndef WAVTRIGGER_H
 #define WAVTRIGGER_H
 
+#include <pthread.h>
+#include <time.h>
+
 // Board Types
 #define BOARD_UNKNOWN			-1
 #define BOARD_WAV_TRIGGER		0
@@ -72,6 +75,7 @@
 #define CMD_VOLUME				5
 #define CMD_TRACK_VOLUME		8
 #define CMD_AMP_POWER			9
+#define CMD_SET_REPORTING		13
 #define CMD_TRACK_FADE			10
 #define CMD_RESUME_ALL_SYNC		11
 #define CMD_SAMPLERATE_OFFSET	12
@@ -92,6 +96,8 @@
 	// If there are no tracks playing, the number of data bytes will be 0.
 	// Example: 0xf0, 0xaa, 0x09, 0x83, 0x01, 0x00, 0x0e, 0x00, 0x55
 	//          start       len   op    trk 0x0001, trk 0x000e  end
+#define CMD_TRACK_REPORT		0x84		// Sent when a track starts or stops, if reporting is on. Len is 8
+	// Data: track - 1 (2 bytes), voice, 1 if started or 0 if stopped
 
 
 
@@ -104,6 +110,43 @@
 #define TRK_LOOP_OFF	6
 #define TRK_LOAD		7
 
+// Command queue to the writer thread
+#define WAV_QUEUE_LEN			64		// Frames waiting to be written
+#define WAV_FRAME_MAX			12		// Longest command frame
+#define WAV_BATCH_MAX			64		// Bytes given to one write()
+
+// Kinds of queued command. Gains for the same target replace each other while
+// they wait; the other kinds are triggers, and are written before gains.
+#define WAV_CMD_TRIGGER			0
+#define WAV_CMD_MASTER_GAIN		1
+#define WAV_CMD_CHANNEL_GAIN	2
+#define WAV_CMD_TRACK_GAIN		3
+#define WAV_CMD_LOOP			4
+#define WAV_CMD_FADE			5
+#define WAV_CMD_IS_GAIN(kind)	( (kind) >= WAV_CMD_MASTER_GAIN && (kind) <= WAV_CMD_TRACK_GAIN )
+
+// Mirror of the board state last sent, so commands that would not change it are dropped
+#define WAV_CHANNELS			8
+#define WAV_TRACKS				4096
+#define WAV_CACHE_UNKNOWN		0x7fff
+
+// Status from the reader thread
+#define WAV_RX_MAX				256		// Longest frame from the board
+#define WAV_REPLY_MS			1000	// Wait for the reply to a query
+#define WAV_STATUS_POLL_MS		100		// Status poll while waiting, if the board sends no track reports
+#define WAV_TRACK_WORD(bits, trk)	( (bits)[(trk) >> 5] )
+#define WAV_TRACK_MASK(trk)			( 1u << ( (trk) & 31 ) )
+#define WAV_TRACK_ON(bits, trk)		( ( WAV_TRACK_WORD(bits, trk ) & WAV_TRACK_MASK(trk ) ) != 0 )
+
+struct wavCommand
+{
+	int kind;
+	int chan;			// Channel, or -1
+	int trk;			// Track, or -1
+	int len;
+	char frame[WAV_FRAME_MAX];
+};
+
 
 class wavTrigger
 {
@@ -132,20 +175,76 @@ public:
 	int getSysInfo(char *buf, int maxLen );
 	int getStatus(char *buf, int maxLen );
 	void waitTilDone(int trk );
+	int waitTrackDone(int trk, int timeoutMs ); // Returns 0 once the track is not playing, -1 on timeout. timeoutMs of -1 waits forever
+	int waitAllDone(int timeoutMs ); // As waitTrackDone, for all tracks
 	int getTracksPlaying(); // Gathers track status and returns the number of tracks playing
 	int getTrackStatus(int trk); // Returns 1 if the track is playing, else 0. Gathers track status and returns the status of the indicated track
 	int checkTrack(int trk ); // Checks the already gathered status and returns the status for the track
+	long long trackChanged(int trk ); // Time the track last started or stopped, CLOCK_MONOTONIC nsec
 	void show(void );
+	void flush(void );	// Waits until all queued commands have been written
+	void cacheReset(void );	// Forget the board state, so the next commands are all sent
+	void writerPriority(int priority );
 	int wavIndex;
 	
 	int boardType;
 	char boardFWVersion[32];
 	int tsunamiMode;
 	
+	// Writer statistics
+	unsigned int framesQueued;
+	unsigned int framesCoalesced;	// Gains replaced by a newer one before they were written
+	unsigned int writes;
+	unsigned int framesSuppressed;	// Not sent as the board already had that state
+	unsigned int bytesSaved;
+	
 private:
 	void trackControl(int chan, int trk, int code);
 	int getReturnData(char *buf, int maxLen );
+	int query(int cmd, int replyCmd, char *buf, int maxLen );
+	void setReporting(int enable );
+	int waitDone(int trk, int timeoutMs );
+	void statusDeadline(struct timespec *ts, int ms );
+	static void *readerThread(void *arg );
+	void readerRun(void );
+	void statusUpdate(int code, unsigned char *data, int len );
+	void sendCommand(int kind, int chan, int trk, int value, const char *frame, int len );
+	bool cacheUpdate(int kind, int chan, int trk, int value );
+	void promoteGains(int chan, int trk );
+	static void *writerThread(void *arg );
+	void writerRun(void );
 	int	sioPort;	// The current port
+	
+	pthread_t writer;
+	bool writerStarted;
+	bool writerBusy;
+	pthread_mutex_t queueLock;
+	pthread_cond_t queueWork;		// Signalled to the writer when commands are queued
+	pthread_cond_t queueDone;		// Signalled when space is freed or the queue drains
+	struct wavCommand triggers[WAV_QUEUE_LEN];
+	int triggerCount;
+	struct wavCommand gains[WAV_QUEUE_LEN];
+	int gainCount;
+	
+	// Board state, WAV_CACHE_UNKNOWN until a command has been sent
+	short masterCache;
+	short channelCache[WAV_CHANNELS];
+	short trackGainCache[WAV_TRACKS];
+	short trackLoopCache[WAV_TRACKS];
+	
+	// Track status, kept by the reader thread
+	pthread_t reader;
+	bool readerStarted;
+	pthread_mutex_t statusLock;
+	pthread_cond_t statusCond;		// Broadcast for each frame from the board
+	unsigned int trackBits[WAV_TRACKS / 32];
+	long long trackTime[WAV_TRACKS];	// Last start or stop, CLOCK_MONOTONIC nsec
+	int tracksPlaying;
+	bool reportsSeen;
+	char reply[WAV_RX_MAX];			// Last reply to a query: the code, then the data
+	int replyLen;
+	int replyCode;
+	unsigned int replySeq;
 
 };
 